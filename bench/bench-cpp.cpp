@@ -0,0 +1,201 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "prettyprint.h"
+
+// Benchmarks for the C++ API. Build with `make RELEASE=1 bench` for meaningful
+// numbers.
+//
+// The output has the same columns as that of bench.c. Each case runs in its
+// own process so that peak RSS is its own.
+
+static size_t allocations;
+
+void* operator new(size_t size) {
+    allocations++;
+    void* p = std::malloc(size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+static double now() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+struct result {
+    double build = 0;
+    double render = 0;
+    size_t bytes = 0;
+    size_t allocs = 0;
+};
+
+static void print_result(const char* name, const result& r) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    // Rendering to a string is a single write.
+    std::printf("%s\t%.3f\t%.3f\t%zu\t%.1f\t%d\t%zu\t%ld\n", name, r.build * 1e3, r.render * 1e3, r.bytes,
+            r.render > 0 ? r.bytes / r.render / 1e6 : 0.0, 1, r.allocs, ru.ru_maxrss);
+}
+
+static void run(const char* name, void (*bench)(result&, size_t), size_t n) {
+    std::fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::perror("fork");
+        return;
+    }
+    if (pid == 0) {
+        result r;
+        bench(r, n);
+        print_result(name, r);
+        std::fflush(stdout);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+}
+
+// Render d to a string, recording the figures in r. Allocations made by
+// the build and the render are counted.
+template <typename Doc>
+static void render_doc(result& r, const Doc& d) {
+    double start = now();
+    std::string s = pp::to_string(d);
+    r.render = now() - start;
+    r.bytes = s.size();
+    r.allocs = allocations;
+}
+
+// A list of n small groups built with operator+ and operator<<.
+static void bench_build(result& r, size_t n) {
+    allocations = 0;
+    double start = now();
+    auto d = pp::nil();
+    for (size_t i = 0; i < n; i++) {
+        d = std::move(d) + pp::group(pp::nest(2, pp::text("key:") + pp::line() + pp::text("value")))
+            << pp::text(",") + pp::line();
+    }
+    r.build = now() - start;
+    render_doc(r, d);
+}
+
+// The same list built with doc_ref handles.
+static void bench_build_local(result& r, size_t n) {
+    using namespace pp;
+    allocations = 0;
+    double start = now();
+    doc_ref d = local::nil();
+    for (size_t i = 0; i < n; i++) {
+        d = std::move(d) + local::group(local::nest(2, local::text("key:") + local::line() + local::text("value")))
+            << local::text(",") + local::line();
+    }
+    r.build = now() - start;
+    render_doc(r, d);
+}
+
+static std::string make_words(size_t n) {
+    std::string text;
+    text.reserve(n * 6);
+    for (size_t i = 0; i < n; i++) {
+        text += "word ";
+        if (i % 13 == 12) text += '\n';
+    }
+    return text;
+}
+
+// A stream of n words.
+static void bench_words(result& r, size_t n) {
+    std::string text = make_words(n);
+    allocations = 0;
+    double start = now();
+    auto d = pp::words(text);
+    r.build = now() - start;
+    render_doc(r, d);
+}
+
+static void bench_words_local(result& r, size_t n) {
+    std::string text = make_words(n);
+    allocations = 0;
+    double start = now();
+    pp::doc_ref d = pp::local::words(text);
+    r.build = now() - start;
+    render_doc(r, d);
+}
+
+template <typename Doc, typename Builders>
+static Doc json_value(size_t& budget, int depth) {
+    if (budget == 0 || depth == 0) {
+        if (budget > 0) budget--;
+        return Builders::text("12345");
+    }
+    Doc entries;
+    bool first = true;
+    for (int i = 0; i < 4 && budget > 0; i++) {
+        Doc entry = Builders::text("\"key\":") + Builders::sep() + json_value<Doc, Builders>(budget, depth - 1);
+        entries = first ? std::move(entry) : std::move(entry) + Builders::text(",") + Builders::line() + std::move(entries);
+        first = false;
+    }
+    if (first) return Builders::text("{}");
+    return Builders::group(Builders::text("{") + Builders::nest(2, Builders::line() + std::move(entries))
+            + Builders::line() + Builders::text("}"));
+}
+
+struct shared_builders {
+    static std::shared_ptr<const pp::doc> text(const char* s) { return pp::text(s); }
+    static std::shared_ptr<const pp::doc> sep() { return pp::sep(); }
+    static std::shared_ptr<const pp::doc> line() { return pp::line(); }
+    static std::shared_ptr<const pp::doc> nest(size_t i, std::shared_ptr<const pp::doc> d) {
+        return pp::nest(i, std::move(d));
+    }
+    static std::shared_ptr<const pp::doc> group(std::shared_ptr<const pp::doc> d) { return pp::group(std::move(d)); }
+};
+
+struct local_builders {
+    static pp::doc_ref text(const char* s) { return pp::local::text(s); }
+    static pp::doc_ref sep() { return pp::local::sep(); }
+    static pp::doc_ref line() { return pp::local::line(); }
+    static pp::doc_ref nest(size_t i, pp::doc_ref d) { return pp::local::nest(i, std::move(d)); }
+    static pp::doc_ref group(pp::doc_ref d) { return pp::local::group(std::move(d)); }
+};
+
+// A JSON-like tree of n values.
+static void bench_json(result& r, size_t n) {
+    allocations = 0;
+    double start = now();
+    auto d = json_value<std::shared_ptr<const pp::doc>, shared_builders>(n, 12);
+    r.build = now() - start;
+    render_doc(r, d);
+}
+
+static void bench_json_local(result& r, size_t n) {
+    allocations = 0;
+    double start = now();
+    auto d = json_value<pp::doc_ref, local_builders>(n, 12);
+    r.build = now() - start;
+    render_doc(r, d);
+}
+
+int main() {
+    // Documents are freed recursively in C++, so these are kept small
+    // enough not to overflow the stack.
+    run("cpp_build", bench_build, 10000);
+    run("cpp_build_local", bench_build_local, 10000);
+    run("cpp_words", bench_words, 10000);
+    run("cpp_words_local", bench_words_local, 10000);
+    run("cpp_json", bench_json, 200000);
+    run("cpp_json_local", bench_json_local, 200000);
+
+    return 0;
+}
@@ -0,0 +1,1019 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "prettyprint.h"
+
+/*
+ * Benchmarks for the C API. Build with `make RELEASE=1 bench` for meaningful
+ * numbers.
+ *
+ * Each case runs in its own process (so that peak RSS is its own) and prints
+ * one tab-separated line with the columns named in the header.
+ */
+
+// Allocations are counted by linking with -Wl,--wrap=malloc (and calloc and
+// realloc), atomically since some cases render on several threads.
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t size);
+
+static size_t allocations;
+
+void* __wrap_malloc(size_t size) {
+    __sync_fetch_and_add(&allocations, 1);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+    __sync_fetch_and_add(&allocations, 1);
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* p, size_t size) {
+    __sync_fetch_and_add(&allocations, 1);
+    return __real_realloc(p, size);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+    // Seconds to build the document.
+    double build;
+    // Seconds per render.
+    double render;
+    // Bytes written per render.
+    size_t bytes;
+    // Writer calls per render.
+    size_t writes;
+    // Allocations while building the document and rendering it once.
+    size_t allocs;
+} result;
+
+static void print_header(void) {
+    printf("# case\tbuild_ms\trender_ms\tbytes\tMB_per_s\twrites\tallocs\tpeak_rss_kb\n");
+}
+
+static void print_result(const char* name, const result* r) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("%s\t%.3f\t%.3f\t%zu\t%.1f\t%zu\t%zu\t%ld\n", name, r->build * 1e3, r->render * 1e3, r->bytes,
+            r->render > 0 ? r->bytes / r->render / 1e6 : 0.0, r->writes, r->allocs, ru.ru_maxrss);
+}
+
+static void run(const char* name, void (*bench)(result*, size_t), size_t n) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return;
+    }
+    if (pid == 0) {
+        result r = { 0, 0, 0, 0, 0 };
+        bench(&r, n);
+        print_result(name, &r);
+        fflush(stdout);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+}
+
+static size_t written;
+static size_t write_calls;
+
+static void count_write(void* data, const char* text, size_t length) {
+    (void)data;
+    (void)text;
+    written += length;
+    write_calls++;
+}
+
+static pp_settings default_settings(void) {
+    pp_settings settings = {0};
+    settings.width = 80;
+    settings.max_indent = 40;
+    return settings;
+}
+
+// Render d reps times, recording per-render figures in r. Allocations made
+// by the first render are counted.
+static void render_doc(result* r, const pp_settings* settings, const pp_measure_table* m, const pp_doc* d, int reps) {
+    pp_writer w = { count_write, NULL };
+    double start = now();
+    for (int i = 0; i < reps; i++) {
+        written = write_calls = 0;
+        _pp_pretty_measured(&w, settings, m, d);
+        if (i == 0) r->allocs = allocations;
+    }
+    r->render = (now() - start) / reps;
+    r->bytes = written;
+    r->writes = write_calls;
+}
+
+static char* make_words(size_t n) {
+    char* text = (char*)malloc(n * 6 + 1);
+    char* p = text;
+    for (size_t i = 0; i < n; i++) {
+        memcpy(p, "word ", 5);
+        p += 5;
+        if (i % 13 == 12) *p++ = '\n';
+    }
+    *p = '\0';
+    return text;
+}
+
+// A long stream of words.
+static void bench_words(result* r, size_t n) {
+    char* text = make_words(n);
+    pp_settings settings = default_settings();
+
+    allocations = 0;
+    double start = now();
+    pp_doc* d = pp_words(text);
+    r->build = now() - start;
+
+    render_doc(r, &settings, NULL, d, 5);
+    pp_free(d);
+    free(text);
+}
+
+// A chain of n nested groups around a short line; every group fits.
+static void bench_nested_groups(result* r, size_t n) {
+    pp_settings settings = default_settings();
+
+    allocations = 0;
+    double start = now();
+    pp_doc* d = pp_appends(pp_string("x"), pp_line(), pp_string("y"));
+    for (size_t i = 0; i < n; i++) d = pp_group(pp_nest(1, d));
+    r->build = now() - start;
+
+    render_doc(r, &settings, NULL, d, 5);
+    pp_free(d);
+}
+
+// Many small groups, most of which fit on a line.
+static void bench_shallow_groups(result* r, size_t n) {
+    pp_settings settings = default_settings();
+
+    allocations = 0;
+    double start = now();
+    pp_doc* d = pp_nil();
+    for (size_t i = 0; i < n; i++) {
+        pp_doc* g = pp_group(pp_nest(2, pp_appends(
+                        pp_string("key:"), pp_line(), pp_string("value"), pp_sep(), pp_string("x"))));
+        d = pp_append(g, pp_append(pp_line(), d));
+        if (i % 100 == 99) d = pp_group(pp_nest(1, d));
+    }
+    r->build = now() - start;
+
+    render_doc(r, &settings, NULL, d, 20);
+    pp_free(d);
+}
+
+// A wide, grouped list of n items, which is too long for one line.
+static void bench_wide_list(result* r, size_t n) {
+    pp_settings settings = default_settings();
+
+    allocations = 0;
+    double start = now();
+    pp_doc* items = pp_string("item");
+    for (size_t i = 1; i < n; i++) items = pp_appends(pp_string("item"), pp_string(","), pp_line(), items);
+    pp_doc* d = pp_group(pp_appends(pp_string("["), pp_nest(2, pp_append(pp_line(), items)), pp_line(),
+                pp_string("]")));
+    r->build = now() - start;
+
+    render_doc(r, &settings, NULL, d, 20);
+    pp_free(d);
+}
+
+// The same list with the items held by one concatenation.
+static void bench_wide_list_concat(result* r, size_t n) {
+    pp_settings settings = default_settings();
+
+    allocations = 0;
+    double start = now();
+    const pp_doc** docs = malloc(sizeof(pp_doc*) * (3 * n - 1));
+    for (size_t i = 0; i < n; i++) {
+        docs[3 * i] = pp_string("item");
+        if (i + 1 < n) {
+            docs[3 * i + 1] = pp_string(",");
+            docs[3 * i + 2] = pp_line();
+        }
+    }
+    pp_doc* items = pp_concat(docs, 3 * n - 2);
+    free(docs);
+    pp_doc* d = pp_group(pp_appends(pp_string("["), pp_nest(2, pp_append(pp_line(), items)), pp_line(),
+                pp_string("]")));
+    r->build = now() - start;
+
+    render_doc(r, &settings, NULL, d, 20);
+    pp_free(d);
+}
+
+// The items of the list filled onto lines.
+static void bench_fill(result* r, size_t n) {
+    pp_settings settings = default_settings();
+
+    allocations = 0;
+    double start = now();
+    const pp_doc** docs = malloc(sizeof(pp_doc*) * n);
+    for (size_t i = 0; i < n; i++) docs[i] = pp_string(i + 1 < n ? "item," : "item");
+    pp_doc* items = pp_fill(docs, n);
+    free(docs);
+    pp_doc* d = pp_appends(pp_string("["), pp_nest(2, items), pp_string("]"));
+    r->build = now() - start;
+
+    render_doc(r, &settings, NULL, d, 20);
+    pp_free(d);
+}
+
+static pp_doc* json_value(size_t* budget, int depth) {
+    if (*budget == 0 || depth == 0) {
+        if (*budget > 0) (*budget)--;
+        return pp_string("12345");
+    }
+    pp_doc* entries = NULL;
+    for (int i = 0; i < 4 && *budget > 0; i++) {
+        pp_doc* entry = pp_appends(pp_string("\"key\":"), pp_sep(), json_value(budget, depth - 1));
+        entries = entries == NULL ? entry : pp_appends(entry, pp_string(","), pp_line(), entries);
+    }
+    if (entries == NULL) return pp_string("{}");
+    return pp_group(pp_appends(pp_string("{"), pp_nest(2, pp_append(pp_line(), entries)), pp_line(),
+                pp_string("}")));
+}
+
+// A JSON-like tree of n values.
+static void bench_json(result* r, size_t n) {
+    pp_settings settings = default_settings();
+
+    allocations = 0;
+    double start = now();
+    pp_doc* d = json_value(&n, 12);
+    r->build = now() - start;
+
+    render_doc(r, &settings, NULL, d, 5);
+    pp_free(d);
+}
+
+// The JSON-like tree, printing only its first 100 lines.
+static void bench_json_head(result* r, size_t n) {
+    pp_settings settings = default_settings();
+    settings.max_lines = 100;
+    settings.elision = "...\n";
+
+    allocations = 0;
+    double start = now();
+    pp_doc* d = json_value(&n, 12);
+    r->build = now() - start;
+
+    render_doc(r, &settings, NULL, d, 5);
+    pp_free(d);
+}
+
+static pp_doc* json_value_interned(pp_interner* in, size_t* budget, int depth) {
+    if (*budget == 0 || depth == 0) {
+        if (*budget > 0) (*budget)--;
+        return pp_intern_string(in, "12345");
+    }
+    pp_doc* entries = NULL;
+    for (int i = 0; i < 4 && *budget > 0; i++) {
+        const pp_doc* entry[] = { pp_intern_string(in, "\"key\":"), pp_sep(), json_value_interned(in, budget, depth - 1) };
+        pp_doc* e = pp_intern_concat(in, entry, 3);
+        if (entries == NULL) entries = e;
+        else {
+            const pp_doc* more[] = { e, pp_intern_string(in, ","), pp_line(), entries };
+            entries = pp_intern_concat(in, more, 4);
+        }
+    }
+    if (entries == NULL) return pp_intern_string(in, "{}");
+    const pp_doc* object[] = { pp_intern_string(in, "{"), pp_intern_nest(in, 2, pp_intern_append(in, pp_line(), entries)),
+        pp_line(), pp_intern_string(in, "}") };
+    return pp_intern_group(in, pp_intern_concat(in, object, 4));
+}
+
+// The same tree built with an interner, which shares its repeated subtrees.
+static void bench_json_interned(result* r, size_t n) {
+    pp_settings settings = default_settings();
+
+    allocations = 0;
+    double start = now();
+    pp_interner* in = pp_interner_create(0);
+    pp_doc* d = json_value_interned(in, &n, 12);
+    r->build = now() - start;
+
+    render_doc(r, &settings, pp_interner_measure(in), d, 5);
+    pp_interner_destroy(in);
+}
+
+// The same tree serialized and rendered from its serialized form; the build
+// time is that of serializing.
+static void bench_json_serialized(result* r, size_t n) {
+    pp_settings settings = default_settings();
+    pp_doc* d = json_value(&n, 12);
+
+    allocations = 0;
+    double start = now();
+    size_t size = pp_doc_serialize_into(NULL, 0, &settings, d);
+    void* data = malloc(size);
+    pp_doc_serialize_into(data, size, &settings, d);
+    r->build = now() - start;
+
+    pp_writer w = { count_write, NULL };
+    start = now();
+    for (int i = 0; i < 5; i++) {
+        written = write_calls = 0;
+        _pp_pretty_serialized(&w, &settings, data);
+        if (i == 0) r->allocs = allocations;
+    }
+    r->render = (now() - start) / 5;
+    r->bytes = written;
+    r->writes = write_calls;
+
+    free(data);
+    pp_free(d);
+}
+
+static void json_stream(pp_stream* st, size_t* budget, int depth) {
+    if (*budget == 0 || depth == 0) {
+        if (*budget > 0) (*budget)--;
+        pp_stream_text(st, "12345", 5);
+        return;
+    }
+    pp_stream_group_open(st);
+    pp_stream_text(st, "{", 1);
+    pp_stream_nest_push(st, 2);
+    for (int i = 0; i < 4 && *budget > 0; i++) {
+        // Once the output is cut, the rest of the tree is not produced.
+        if (pp_stream_line(st) == 1) *budget = 0;
+        pp_stream_text(st, "\"key\":", 6);
+        pp_stream_sep(st);
+        json_stream(st, budget, depth - 1);
+        if (i < 3 && *budget > 0) pp_stream_text(st, ",", 1);
+    }
+    pp_stream_nest_pop(st);
+    pp_stream_line(st);
+    pp_stream_text(st, "}", 1);
+    pp_stream_group_close(st);
+}
+
+// A tree of the same shape as bench_json, streamed without building a
+// document; if head, only its first 100 lines are printed.
+static void bench_json_streamed(result* r, size_t n, int head) {
+    pp_settings settings = default_settings();
+    if (head) {
+        settings.max_lines = 100;
+        settings.elision = "...\n";
+    }
+    pp_writer w = { count_write, NULL };
+
+    allocations = 0;
+    written = write_calls = 0;
+    double start = now();
+    pp_stream* st = pp_stream_begin(&w, &settings);
+    json_stream(st, &n, 12);
+    pp_stream_end(st);
+    r->render = now() - start;
+    r->bytes = written;
+    r->writes = write_calls;
+    r->allocs = allocations;
+}
+
+static void bench_json_stream(result* r, size_t n) {
+    bench_json_streamed(r, n, 0);
+}
+
+static void bench_json_stream_head(result* r, size_t n) {
+    bench_json_streamed(r, n, 1);
+}
+
+enum {
+    BENCH_DOC_FILTERED = PP_DOC_EXTENSION_START
+};
+
+typedef struct {
+    pp_doc_type_t type;
+    int v;
+    const pp_doc* inner;
+} bench_doc_filtered;
+
+typedef struct {
+    pp_settings s;
+    int filter_value;
+} bench_settings;
+
+static pp_doc_type_t eval_ext(const pp_settings* settings, pp_doc_type_t tp, pp_doc** d) {
+    const bench_doc_filtered* f = (const bench_doc_filtered*)*d;
+    (void)tp;
+    if (((const bench_settings*)settings)->filter_value >= f->v) {
+        *d = (pp_doc*)f->inner;
+        return (*d)->type;
+    }
+    return PP_DOC_NIL;
+}
+
+static void free_ext(pp_doc* d) {
+    pp_free_ext(free_ext, (pp_doc*)((bench_doc_filtered*)d)->inner);
+    free(d);
+}
+
+static pp_doc* filtered_list(size_t n) {
+    pp_doc* d = pp_nil();
+    for (size_t i = 0; i < n; i++) {
+        bench_doc_filtered* f = (bench_doc_filtered*)malloc(sizeof(bench_doc_filtered));
+        f->type = (pp_doc_type_t)BENCH_DOC_FILTERED;
+        f->v = (int)(i % 4);
+        f->inner = pp_group(pp_appends(pp_string("entry"), pp_line(), pp_string("value")));
+        d = pp_appends(pp_line(), (pp_doc*)f, d);
+    }
+    return d;
+}
+
+static bench_settings filter_settings(void) {
+    bench_settings settings;
+    settings.s = default_settings();
+    settings.s.evaluate_extension = eval_ext;
+    settings.filter_value = 2;
+    return settings;
+}
+
+// A list of n lines of which half are filtered out by an extension, as in
+// example/c-api.c.
+static void bench_extensions(result* r, size_t n) {
+    bench_settings settings = filter_settings();
+
+    allocations = 0;
+    double start = now();
+    pp_doc* d = filtered_list(n);
+    r->build = now() - start;
+
+    render_doc(r, &settings.s, NULL, d, 5);
+    pp_free_ext(free_ext, d);
+}
+
+enum {
+    BENCH_DOC_NUMBER = BENCH_DOC_FILTERED + 1
+};
+
+typedef struct {
+    pp_doc_type_t type;
+    int v;
+} bench_doc_number;
+
+// Resolve the filtered documents as eval_ext does, and numbers into text made
+// for the render, leaving the documents untouched.
+static const pp_doc* resolve_ext(const pp_settings* settings, const pp_doc* d, pp_ext_context* context) {
+    if (d->type == (pp_doc_type_t)BENCH_DOC_NUMBER) {
+        char text[16];
+        int length = sprintf(text, "%d", ((const bench_doc_number*)d)->v);
+        return pp_ext_text(context, text, (size_t)length);
+    }
+    const bench_doc_filtered* f = (const bench_doc_filtered*)d;
+    return ((const bench_settings*)settings)->filter_value >= f->v ? f->inner : NULL;
+}
+
+static void free_resolved_ext(pp_doc* d) {
+    if (d->type == (pp_doc_type_t)BENCH_DOC_FILTERED) pp_free_ext(free_resolved_ext, (pp_doc*)((bench_doc_filtered*)d)->inner);
+    free(d);
+}
+
+typedef struct {
+    char* text;
+    size_t length;
+    size_t capacity;
+} bench_buffer;
+
+static void buffer_write(void* data, const char* text, size_t length) {
+    bench_buffer* b = (bench_buffer*)data;
+    if (b->length + length > b->capacity) {
+        b->capacity = (b->length + length) * 2;
+        b->text = (char*)realloc(b->text, b->capacity);
+    }
+    memcpy(b->text + b->length, text, length);
+    b->length += length;
+}
+
+typedef struct {
+    const pp_settings* settings;
+    const pp_doc* d;
+    const bench_buffer* expected;
+    int reps;
+    int mismatches;
+} render_thread;
+
+static void* render_thread_main(void* data) {
+    render_thread* t = (render_thread*)data;
+    bench_buffer b = { NULL, 0, 0 };
+    pp_writer w = { buffer_write, &b };
+    for (int i = 0; i < t->reps; i++) {
+        b.length = 0;
+        _pp_pretty(&w, t->settings, t->d);
+        if (b.length != t->expected->length || memcmp(b.text, t->expected->text, b.length) != 0) t->mismatches++;
+    }
+    free(b.text);
+    return NULL;
+}
+
+static bench_settings resolve_settings(void) {
+    bench_settings settings = filter_settings();
+    settings.s.evaluate_extension = NULL;
+    settings.s.resolve_extension = resolve_ext;
+    return settings;
+}
+
+// A filtered list of n numbers, each grouped with a label, in groups of ten.
+static pp_doc* number_list(size_t n) {
+    pp_doc* d = pp_nil();
+    pp_doc* run = pp_nil();
+    for (size_t i = 0; i < n; i++) {
+        bench_doc_number* v = (bench_doc_number*)malloc(sizeof(bench_doc_number));
+        v->type = (pp_doc_type_t)BENCH_DOC_NUMBER;
+        v->v = (int)i;
+        bench_doc_filtered* f = (bench_doc_filtered*)malloc(sizeof(bench_doc_filtered));
+        f->type = (pp_doc_type_t)BENCH_DOC_FILTERED;
+        f->v = (int)(i % 4);
+        f->inner = pp_group(pp_appends(pp_string("entry"), pp_line(), (pp_doc*)v));
+        run = pp_appends(run, pp_line(), (pp_doc*)f);
+        if (i % 10 == 9 || i + 1 == n) {
+            d = pp_appends(d, pp_line(), pp_group(pp_nest(2, run)));
+            run = pp_nil();
+        }
+    }
+    pp_free(run);
+    return d;
+}
+
+// The list of numbers resolved by resolve_ext on every render, or, if pure,
+// once when measured (which is then the build time).
+static void bench_extensions_resolved(result* r, size_t n, int pure) {
+    bench_settings settings = resolve_settings();
+    settings.s.pure_extensions = pure;
+
+    allocations = 0;
+    double start = now();
+    pp_doc* d = number_list(n);
+    pp_measure_table* m = NULL;
+    if (pure) {
+        start = now();
+        m = pp_measure_resolved(&settings.s, d);
+    }
+    r->build = now() - start;
+
+    render_doc(r, &settings.s, m, d, 5);
+    pp_measure_free(m);
+    pp_free_ext(free_resolved_ext, d);
+}
+
+static void bench_extensions_impure(result* r, size_t n) {
+    bench_extensions_resolved(r, n, 0);
+}
+
+static void bench_extensions_pure(result* r, size_t n) {
+    bench_extensions_resolved(r, n, 1);
+}
+
+// A report of n sections, each a JSON-like tree of 50 values under a heading,
+// separated by lines, rendered on one thread or on every processor.
+static void bench_sections(result* r, size_t n, int parallel) {
+    pp_settings settings = default_settings();
+
+    allocations = 0;
+    double start = now();
+    pp_doc* d = pp_nil();
+    for (size_t i = 0; i < n; i++) {
+        size_t budget = 50;
+        pp_doc* section = pp_appends(pp_string("section:"), pp_nest(2, pp_appends(pp_line(), json_value(&budget, 4))));
+        d = d->type == PP_DOC_NIL ? section : pp_appends(d, pp_line(), pp_line(), section);
+    }
+    r->build = now() - start;
+
+    pp_writer w = { count_write, NULL };
+    start = now();
+    for (int i = 0; i < 5; i++) {
+        written = write_calls = 0;
+        if (parallel) _pp_pretty_parallel(&w, &settings, d, 0);
+        else _pp_pretty(&w, &settings, d);
+        if (i == 0) r->allocs = allocations;
+    }
+    r->render = (now() - start) / 5;
+    r->bytes = written;
+    r->writes = write_calls;
+    pp_free(d);
+}
+
+static void bench_sections_serial(result* r, size_t n) {
+    bench_sections(r, n, 0);
+}
+
+static void bench_sections_parallel(result* r, size_t n) {
+    bench_sections(r, n, 1);
+}
+
+// A JSON-like tree of n values measured on one thread or on every processor
+// (which is the build time) and rendered with the measurements.
+static void bench_measure(result* r, size_t n, int parallel) {
+    pp_settings settings = default_settings();
+    pp_doc* d = json_value(&n, 12);
+
+    allocations = 0;
+    double start = now();
+    pp_measure_table* m = parallel ? pp_measure_parallel(d, 0) : pp_measure(d);
+    r->build = now() - start;
+
+    render_doc(r, &settings, m, d, 5);
+    pp_measure_free(m);
+    pp_free(d);
+}
+
+static void bench_measure_serial(result* r, size_t n) {
+    bench_measure(r, n, 0);
+}
+
+static void bench_measure_parallel(result* r, size_t n) {
+    bench_measure(r, n, 1);
+}
+
+// A report of n sections laid out once (the build time), in which the middle
+// section is then replaced five times; the render time is that of a
+// replacement.
+static void bench_layout_replace(result* r, size_t n) {
+    pp_settings settings = default_settings();
+    pp_doc* d = pp_nil();
+    const pp_doc* middle = NULL;
+    for (size_t i = 0; i < n; i++) {
+        size_t budget = 50;
+        pp_doc* section = pp_appends(pp_string("section:"), pp_nest(2, pp_appends(pp_line(), json_value(&budget, 4))));
+        if (i == n / 2) middle = section;
+        d = d->type == PP_DOC_NIL ? section : pp_appends(d, pp_line(), pp_line(), section);
+    }
+
+    allocations = 0;
+    double start = now();
+    pp_layout* l = pp_layout_create(&settings, d);
+    r->build = now() - start;
+
+    pp_doc* replacements[5];
+    start = now();
+    for (int i = 0; i < 5; i++) {
+        size_t budget = 50 + i;
+        replacements[i] = pp_appends(pp_string("edited:"), pp_nest(2, pp_appends(pp_line(), json_value(&budget, 4))));
+        pp_layout_replace(l, middle, replacements[i]);
+        middle = replacements[i];
+    }
+    r->render = (now() - start) / 5;
+    r->allocs = allocations;
+
+    pp_writer w = { count_write, NULL };
+    written = write_calls = 0;
+    _pp_layout_write(&w, l);
+    r->bytes = written;
+    r->writes = write_calls;
+
+    pp_layout_free(l);
+    for (int i = 0; i < 5; i++) pp_free(replacements[i]);
+    pp_free(d);
+}
+
+static const pp_doc* json_force(void* data, pp_ext_context* context) {
+    (void)context;
+    size_t budget = (size_t)data;
+    return json_value(&budget, 3);
+}
+
+static void json_release(void* data, const pp_doc* d) {
+    (void)data;
+    pp_free((pp_doc*)d);
+}
+
+// A list of n JSON-like trees of 20 values of which three quarters are
+// filtered out, built up front or lazily (when the build time is only that of
+// the list and the render makes the trees that are printed). Rendered once.
+static void bench_filtered_trees(result* r, size_t n, int lazy) {
+    bench_settings settings = filter_settings();
+    settings.filter_value = 0;
+
+    allocations = 0;
+    double start = now();
+    pp_doc* d = pp_nil();
+    for (size_t i = 0; i < n; i++) {
+        size_t budget = 20;
+        bench_doc_filtered* f = (bench_doc_filtered*)malloc(sizeof(bench_doc_filtered));
+        f->type = (pp_doc_type_t)BENCH_DOC_FILTERED;
+        f->v = (int)(i % 4);
+        f->inner = lazy ? pp_lazy(json_force, json_release, (void*)budget) : json_value(&budget, 3);
+        d = pp_appends(pp_line(), (pp_doc*)f, d);
+    }
+    r->build = now() - start;
+
+    render_doc(r, &settings.s, NULL, d, 1);
+    pp_free_ext(free_ext, d);
+}
+
+static void bench_filtered_trees_eager(result* r, size_t n) {
+    bench_filtered_trees(r, n, 0);
+}
+
+static void bench_filtered_trees_lazy(result* r, size_t n) {
+    bench_filtered_trees(r, n, 1);
+}
+
+// A filtered list of numbers resolved by resolve_ext, rendered concurrently
+// on every processor (at least two threads) and checked against a render on
+// one thread. The render time is the wall time per render.
+static void bench_extensions_threaded(result* r, size_t n) {
+    bench_settings settings = resolve_settings();
+
+    allocations = 0;
+    double start = now();
+    pp_doc* d = number_list(n);
+    r->build = now() - start;
+
+    bench_buffer expected = { NULL, 0, 0 };
+    pp_writer w = { buffer_write, &expected };
+    _pp_pretty(&w, &settings.s, d);
+    r->allocs = allocations;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = cpus > 2 ? (int)cpus : 2;
+    pthread_t* threads = (pthread_t*)malloc(count * sizeof(pthread_t));
+    render_thread* t = (render_thread*)malloc(count * sizeof(render_thread));
+    start = now();
+    for (int i = 0; i < count; i++) {
+        render_thread ti = { &settings.s, d, &expected, 5, 0 };
+        t[i] = ti;
+        pthread_create(&threads[i], NULL, render_thread_main, &t[i]);
+    }
+    int mismatches = 0;
+    for (int i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+        mismatches += t[i].mismatches;
+    }
+    r->render = (now() - start) / (count * 5);
+    r->bytes = expected.length;
+    if (mismatches > 0) fprintf(stderr, "extensions_threaded: %d of %d renders differ\n", mismatches, count * 5);
+
+    free(t);
+    free(threads);
+    free(expected.text);
+    pp_free_ext(free_resolved_ext, d);
+}
+
+// A small, template-shaped document (a filtered list and a JSON-like tree)
+// rendered many times, from the document or compiled; the build time is that
+// of compiling, if any.
+static void bench_template(result* r, size_t reps, int compiled) {
+    bench_settings settings = filter_settings();
+    size_t n = 40;
+    pp_doc* d = pp_append(filtered_list(40), json_value(&n, 3));
+
+    allocations = 0;
+    double start = now();
+    pp_program* p = compiled ? pp_compile(&settings.s, d) : NULL;
+    r->build = now() - start;
+
+    pp_writer w = { count_write, NULL };
+    start = now();
+    for (size_t i = 0; i < reps; i++) {
+        written = write_calls = 0;
+        if (compiled) _pp_pretty_compiled(&w, &settings.s, p);
+        else _pp_pretty(&w, &settings.s, d);
+        if (i == 0) r->allocs = allocations;
+    }
+    r->render = (now() - start) / reps;
+    r->bytes = written;
+    r->writes = write_calls;
+
+    pp_program_free(p);
+    pp_free_ext(free_ext, d);
+}
+
+static void bench_template_tree(result* r, size_t reps) {
+    bench_template(r, reps, 0);
+}
+
+static void bench_template_compiled(result* r, size_t reps) {
+    bench_template(r, reps, 1);
+}
+
+// A deeply indented dump, where every line is indented.
+static void bench_indented(result* r, size_t n) {
+    pp_settings settings = default_settings();
+
+    allocations = 0;
+    double start = now();
+    pp_doc* d = pp_nil();
+    for (size_t i = 0; i < n; i++) {
+        d = pp_appends(pp_string("{"), pp_nest(2, pp_appends(pp_line(), pp_string("item"), pp_nest(4, d))),
+                pp_line(), pp_string("}"));
+    }
+    r->build = now() - start;
+
+    render_doc(r, &settings, NULL, d, 20);
+    pp_free(d);
+}
+
+static pp_doc* nested_map(size_t n) {
+    pp_doc* d = pp_nil();
+    for (size_t i = 0; i < n; i++) {
+        pp_doc* g = pp_group(pp_nest(2, pp_appends(
+                        pp_string("key:"), pp_line(), pp_words("a value of several words"))));
+        d = pp_group(pp_nest(1, pp_appends(pp_string("["), g, pp_sep(), d, pp_string("]"))));
+    }
+    return d;
+}
+
+// Rendering one document at four widths; the build time is that of
+// measuring, if any.
+static void bench_widths(result* r, size_t n, int measured) {
+    pp_doc* d = nested_map(n);
+    pp_settings settings = default_settings();
+
+    allocations = 0;
+    double start = now();
+    pp_measure_table* m = measured ? pp_measure(d) : NULL;
+    r->build = now() - start;
+
+    pp_writer w = { count_write, NULL };
+    written = write_calls = 0;
+    start = now();
+    for (settings.width = 40; settings.width <= 160; settings.width += 40)
+        _pp_pretty_measured(&w, &settings, m, d);
+    r->render = (now() - start) / 4;
+    r->bytes = written / 4;
+    r->writes = write_calls / 4;
+    r->allocs = allocations;
+
+    pp_measure_free(m);
+    pp_free(d);
+}
+
+static void bench_widths_unmeasured(result* r, size_t n) {
+    bench_widths(r, n, 0);
+}
+
+static void bench_widths_measured(result* r, size_t n) {
+    bench_widths(r, n, 1);
+}
+
+// The same four renders made in one traversal.
+static void bench_widths_multi(result* r, size_t n) {
+    pp_doc* d = nested_map(n);
+    pp_settings settings[4];
+    const pp_settings* each[4];
+    pp_writer w = { count_write, NULL };
+    const pp_writer* writers[4] = { &w, &w, &w, &w };
+    for (int i = 0; i < 4; i++) {
+        settings[i] = default_settings();
+        settings[i].width = 40 * (i + 1);
+        each[i] = &settings[i];
+    }
+
+    allocations = 0;
+    written = write_calls = 0;
+    double start = now();
+    _pp_pretty_multi(each, writers, 4, d);
+    r->render = (now() - start) / 4;
+    r->bytes = written / 4;
+    r->writes = write_calls / 4;
+    r->allocs = allocations;
+
+    pp_free(d);
+}
+
+// Building and freeing a document of many small nodes with malloc or an
+// arena (reset and reused, if reuse is set); the build time includes freeing.
+static void bench_alloc(result* r, size_t n, int arena, int reuse) {
+    pp_arena* a = arena ? pp_arena_create(0) : NULL;
+    for (int pass = 0; pass < 1 + reuse; pass++) {
+        allocations = 0;
+        double start = now();
+        pp_doc* d = pp_nil();
+        for (size_t i = 0; i < n; i++) {
+            if (a == NULL) {
+                d = pp_appends(pp_group(pp_nest(2, pp_appends(pp_string("key:"), pp_line(), pp_string("value")))),
+                        pp_line(), d);
+            }
+            else {
+                d = pp_arena_appends(a, pp_arena_group(a, pp_arena_nest(a, 2, pp_arena_appends(a,
+                                    pp_arena_string(a, "key:"), pp_line(), pp_arena_string(a, "value")))),
+                        pp_line(), d);
+            }
+        }
+        if (a == NULL) pp_free(d);
+        else pp_arena_reset(a);
+        r->build = now() - start;
+        r->allocs = allocations;
+    }
+    pp_arena_destroy(a);
+}
+
+static void bench_build_free_malloc(result* r, size_t n) {
+    bench_alloc(r, n, 0, 0);
+}
+
+static void bench_build_free_arena(result* r, size_t n) {
+    bench_alloc(r, n, 1, 0);
+}
+
+static void bench_build_free_arena_reused(result* r, size_t n) {
+    bench_alloc(r, n, 1, 1);
+}
+
+static void fd_write(void* data, const char* text, size_t length) {
+    write_calls++;
+    written += length;
+    if (write(*(int*)data, text, length) < 0) perror("write");
+}
+
+// Writing a word stream to /dev/null, directly (10 MB) or through a buffered
+// writer of the given size (100 MB). Writes are write(2) calls, and the
+// render time covers all of the output.
+static void bench_output(result* r, size_t buffer_size) {
+    char* text = make_words(100000);
+    pp_doc* d = pp_nest(4, pp_words(text));
+    pp_settings settings = default_settings();
+    size_t bytes = buffer_size == 0 ? 10 * 1000 * 1000 : 100 * 1000 * 1000;
+
+    int fd = open("/dev/null", O_WRONLY);
+    pp_writer sink = { fd_write, &fd };
+    char* buffer = (char*)malloc(buffer_size > 0 ? buffer_size : 1);
+    pp_buffered_writer b;
+    _pp_buffered_writer(&b, buffer, buffer_size, &sink);
+
+    written = write_calls = 0;
+    double start = now();
+    while (written < bytes) {
+        if (buffer_size == 0) _pp_pretty(&sink, &settings, d);
+        else _pp_pretty(&b.writer, &settings, d);
+    }
+    if (buffer_size > 0) _pp_buffered_flush(&b);
+    r->render = now() - start;
+    r->bytes = written;
+    r->writes = write_calls;
+
+    close(fd);
+    free(buffer);
+    pp_free(d);
+    free(text);
+}
+
+int main() {
+    char name[64];
+
+    print_header();
+    run("words", bench_words, 200000);
+    run("shallow_groups", bench_shallow_groups, 6000);
+    for (size_t n = 1000; n <= 1000000; n *= 10) {
+        sprintf(name, "nested_groups_%zu", n);
+        run(name, bench_nested_groups, n);
+    }
+    run("wide_list", bench_wide_list, 100000);
+    run("wide_list_concat", bench_wide_list_concat, 100000);
+    run("fill", bench_fill, 100000);
+    run("json", bench_json, 200000);
+    run("json_head", bench_json_head, 200000);
+    run("json_interned", bench_json_interned, 200000);
+    run("json_serialized", bench_json_serialized, 200000);
+    run("json_stream", bench_json_stream, 200000);
+    run("json_stream_head", bench_json_stream_head, 200000);
+    run("extensions", bench_extensions, 100000);
+    run("extensions_resolved", bench_extensions_impure, 100000);
+    run("extensions_pure", bench_extensions_pure, 100000);
+    run("extensions_threaded", bench_extensions_threaded, 100000);
+    run("filtered_trees_eager", bench_filtered_trees_eager, 20000);
+    run("filtered_trees_lazy", bench_filtered_trees_lazy, 20000);
+    run("sections_serial", bench_sections_serial, 5000);
+    run("sections_parallel", bench_sections_parallel, 5000);
+    run("layout_replace", bench_layout_replace, 5000);
+    run("measure_serial", bench_measure_serial, 200000);
+    run("measure_parallel", bench_measure_parallel, 200000);
+    run("template_tree", bench_template_tree, 100000);
+    run("template_compiled", bench_template_compiled, 100000);
+    run("indented", bench_indented, 2000);
+    run("widths_unmeasured", bench_widths_unmeasured, 20000);
+    run("widths_measured", bench_widths_measured, 20000);
+    run("widths_multi", bench_widths_multi, 20000);
+    run("build_free_malloc", bench_build_free_malloc, 100000);
+    run("build_free_arena", bench_build_free_arena, 100000);
+    run("build_free_arena_reused", bench_build_free_arena_reused, 100000);
+    run("output_unbuffered", bench_output, 0);
+    for (size_t size = 512; size <= 65536; size *= 8) {
+        sprintf(name, "output_buffer_%zu", size);
+        run(name, bench_output, size);
+    }
+
+    return 0;
+}
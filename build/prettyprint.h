@@ -0,0 +1,2053 @@
+#ifndef PRETTYPRINT_H
+#define PRETTYPRINT_H
+
+#ifndef PRETTYPRINT_USE_CPP
+#define PRETTYPRINT_USE_CPP __cplusplus
+#endif
+
+#if PRETTYPRINT_USE_CPP != 0
+#include <cstddef>
+#endif
+
+typedef enum {
+    PP_DOC_NIL,
+    PP_DOC_TEXT,
+    PP_DOC_SEP,
+    PP_DOC_LINE,
+    PP_DOC_NEST,
+    PP_DOC_APPEND,
+    PP_DOC_GROUP,
+    PP_DOC_CONCAT,
+    PP_DOC_WORDS,
+    PP_DOC_FILL,
+    PP_DOC_LAZY,
+    PP_DOC_EXTENSION_START = 100
+} pp_doc_type_t;
+
+/** @defgroup NoMemAlloc No-memory-allocation API
+ * @{
+ */
+
+/**
+ * @brief A document object.
+ *
+ * This is a bare document object; other objects extend it.
+ */
+typedef struct {
+    /**
+     * @brief The type of the document.
+     */
+    pp_doc_type_t type;
+} pp_doc;
+
+/**
+ * @brief A text document object.
+ */
+typedef struct {
+    pp_doc_type_t type;
+    /**
+     * @brief The text to display.
+     */
+    const char* text;
+    /**
+     * @brief The length of the text to display.
+     */
+    size_t length;
+} pp_doc_text;
+
+/**
+ * @brief An append document object.
+ */
+typedef struct {
+    pp_doc_type_t type;
+    /**
+     * @brief The first document to be appended.
+     */
+    const pp_doc* a;
+    /**
+     * @brief The second document to be appended.
+     */
+    const pp_doc* b;
+} pp_doc_append;
+
+/**
+ * @brief A nest document object.
+ */
+typedef struct {
+    pp_doc_type_t type;
+    /**
+     * @brief The amount by which to increase the indent.
+     */
+    size_t indent;
+    /**
+     * @brief The document to nest with the new indentation.
+     */
+    const pp_doc* nested;
+} pp_doc_nest;
+
+/**
+ * @brief A group document object.
+ */
+typedef struct {
+    pp_doc_type_t type;
+    /**
+     * @brief The document to group.
+     */
+    const pp_doc* grouped;
+} pp_doc_group;
+
+/**
+ * @brief A concatenation document object.
+ *
+ * This is equivalent to appending its documents in order, but takes one
+ * object however many documents there are.
+ */
+typedef struct {
+    pp_doc_type_t type;
+    /**
+     * @brief The number of documents.
+     */
+    size_t count;
+    /**
+     * @brief The documents to concatenate.
+     */
+    const pp_doc* const* docs;
+} pp_doc_concat;
+
+/**
+ * @brief A fill document object.
+ *
+ * Fills have the fields of concatenations: the documents to fill lines with,
+ * and their number.
+ */
+typedef pp_doc_concat pp_doc_fill;
+
+/**
+ * @brief A words document object.
+ *
+ * This is equivalent to a concatenation of a text document for each word in
+ * the text, with a separator between words divided by a space and a line
+ * between words divided by a newline. The text is split as it is rendered.
+ */
+typedef struct {
+    pp_doc_type_t type;
+    /**
+     * @brief The text to split into words.
+     */
+    const char* text;
+    /**
+     * @brief The length of the text.
+     */
+    size_t length;
+} pp_doc_words;
+
+/**
+ * @brief The context in which extensions and lazy documents are resolved.
+ *
+ * This holds the documents made by extension resolvers and lazy documents,
+ * until the document being rendered is done with.
+ */
+typedef struct _pp_ext_context pp_ext_context;
+
+/**
+ * @brief A lazy document object.
+ *
+ * The document is produced by a function when it is rendered (or serialized
+ * or compiled), so that parts of a document which are never printed need
+ * never be made.
+ */
+typedef struct {
+    pp_doc_type_t type;
+    /**
+     * @brief Produce the document.
+     *
+     * This is called at most once per render for each time the document is
+     * printed (even if enclosing groups examine it to see whether they fit),
+     * and may be called concurrently if the document is rendered on several
+     * threads. Documents it needs only for the render may be allocated from
+     * @p context (see @p pp_ext_alloc).
+     *
+     * @param data The data member.
+     * @param context The context of the render.
+     *
+     * @return The document, or NULL for nil.
+     */
+    const pp_doc* (*force)(void* data, pp_ext_context* context);
+    /**
+     * @brief Release a document produced by @p force, or NULL.
+     *
+     * This is called once the render (or serialization, or compiled program)
+     * that produced the document is done with it.
+     *
+     * @param data The data member.
+     * @param d The document returned by @p force.
+     */
+    void (*release)(void* data, const pp_doc* d);
+    /**
+     * @brief Data to pass to the functions.
+     */
+    void* data;
+} pp_doc_lazy;
+
+/** @defgroup PPAPI Pretty-printing API
+ * @{
+ */
+
+typedef struct _pp_settings pp_settings;
+
+struct _pp_settings {
+    /**
+     * @brief The maximum width of a line.
+     */
+    size_t width;
+    /**
+     * @brief The maximum indent allowed.
+     *
+     * Anything exceeding this indent will be truncated to it.
+     */
+    size_t max_indent;
+    /**
+     * @brief Extension evaluator function.
+     *
+     * Set to NULL to not evaluate any extensions. In this case, if an
+     * extension document is encountered, it will be completely ignored.
+     *
+     * If a document has a type that is greater than or equal to @p
+     * PP_DOC_EXTENSION_START, this function is called on the document. It
+     * should return the new type that the document should be considered as.
+     * Note that the document's fields (besides @p type) should be set
+     * accordingly.
+     *
+     * This is useful for taking advantage of custom settings. The @p settings
+     * object that is passed to @p _pp_print could be a struct that merely
+     * starts with the @p pp_settings struct, and contains more settings that
+     * interacts with extensions in different ways. Likewise the extension
+     * documents need to (when applicable, based on the types to which they
+     * will evaluate) contain a @p doc struct at the beginning, but may contain
+     * extra data. This function will be called repeatedly until the returned type
+     * is less than @p PP_DOC_EXTENSION_START.
+     *
+     * Because the @p type field is not expected to be overwritten, it is
+     * possible to change state in the document such that the document would
+     * behave the same if another call to @p _pp_print is made, although it is
+     * up to extension implementors to fulfill this behavior (if desired).
+     *
+     * Note that @p d may be set by this method to change the location of the
+     * document to be used.
+     *
+     * An extension examined to decide whether a group fits is evaluated once
+     * for the render, however many groups examine it, and the result is the
+     * one printed.
+     *
+     * @param settings The settings object.
+     * @param type The type of the document.
+     * @param d A double-pointer to The document to evaluate. May be changed.
+     */
+    pp_doc_type_t (*evaluate_extension)(const pp_settings* settings, pp_doc_type_t type, pp_doc** d);
+    /**
+     * @brief Reentrant extension resolver function.
+     *
+     * If set, this is used in place of @p evaluate_extension. It is called
+     * with an extension document and returns the document to use in its
+     * place, which is resolved in turn if it is also an extension. NULL is
+     * taken as nil.
+     *
+     * Unlike @p evaluate_extension, this must not modify the document.
+     * Documents made while resolving should be allocated from @p context
+     * with @p pp_ext_alloc or @p pp_ext_text; they are released once the
+     * render is done. A document whose extensions are resolved this way is
+     * only read while rendering, so it may be rendered on several threads at
+     * once.
+     *
+     * @param settings The settings object.
+     * @param d The document to resolve.
+     * @param context The context from which to allocate documents.
+     *
+     * @return The document to use in place of @p d.
+     */
+    const pp_doc* (*resolve_extension)(const pp_settings* settings, const pp_doc* d, pp_ext_context* context);
+    /**
+     * @brief Whether extensions are pure.
+     *
+     * If nonzero, extensions resolve to equivalent documents whenever they
+     * are resolved with these settings, so that @p pp_measure_resolved may
+     * resolve them once for every render of a document.
+     */
+    int pure_extensions;
+    /**
+     * @brief The most lines to write, or 0 for no limit.
+     *
+     * Rendering stops at the line break that would start the line after the
+     * last, so the cost of rendering is that of the lines written rather than
+     * of the whole document.
+     */
+    size_t max_lines;
+    /**
+     * @brief The most bytes to write, or 0 for no limit.
+     *
+     * Output is cut at exactly this many bytes (not counting @p elision),
+     * which may be within a line or a multibyte character.
+     */
+    size_t max_bytes;
+    /**
+     * @brief Text written once if output is cut by @p max_lines or @p max_bytes.
+     *
+     * It is written as-is, after the last byte kept, and may be NULL for none.
+     */
+    const char* elision;
+};
+
+#if PRETTYPRINT_USE_CPP == 0 || PRETTYPRINT_CPP_INTERNAL == 1
+
+/**
+ * @brief The fields are internal to the renderer.
+ */
+struct _pp_ext_context {
+    void* blocks;
+    char* next;
+    char* end;
+    void* memo;
+    size_t memo_count;
+    size_t memo_capacity;
+    const pp_ext_context* parent;
+    void* releases;
+};
+
+/** @} */
+
+/** @defgroup AdvancedPP Advanced pretty-printing API
+ * @{
+ */
+
+typedef struct {
+    /**
+     * @brief The function to use to write out text.
+     *
+     * @param data The data member.
+     * @param text The text to write.
+     * @param length The length of the text to write.
+     */
+    void (*write)(void* data, const char* text, size_t length);
+    /**
+     * @brief Data to pass to the write function.
+     */
+    void* data;
+} pp_writer;
+
+/**
+ * @brief A writer that collects output in a buffer.
+ *
+ * Renderers write many small fragments; this coalesces them into writes of
+ * up to the buffer size to another writer. Pass @p writer to the renderer.
+ */
+typedef struct {
+    /**
+     * @brief The writer which writes to the buffer.
+     */
+    pp_writer writer;
+    /**
+     * @brief The writer to which the buffer is flushed.
+     */
+    pp_writer sink;
+    char* buffer;
+    size_t size;
+    size_t used;
+} pp_buffered_writer;
+
+/**
+ * @brief A unit of pending work for the renderer.
+ *
+ * Rendering uses an explicit stack of frames rather than recursion, so the
+ * depth of a document is bounded only by the memory available to the stack.
+ * The fields are internal to the renderer.
+ */
+typedef struct {
+    const pp_doc* doc;
+    size_t indent;
+    int flat;
+    int fill;
+    size_t pos;
+} pp_render_frame;
+
+/**
+ * @brief The measurements of a document.
+ *
+ * The fields are internal to the renderer.
+ */
+typedef struct {
+    const pp_doc* doc;
+    /**
+     * @brief The width of the document when flattened.
+     */
+    size_t width;
+    /**
+     * @brief The part of @p width taken by trailing separators.
+     */
+    size_t trailing;
+    /**
+     * @brief Whether the document contains extensions, and so must be
+     * measured when rendered.
+     */
+    int dynamic;
+} pp_measure_entry;
+
+/**
+ * @brief A table of precomputed document measurements.
+ *
+ * The fields are internal to the renderer.
+ */
+typedef struct {
+    pp_measure_entry* entries;
+    size_t capacity;
+    size_t count;
+    /**
+     * @brief The extensions resolved when measuring, if they are pure.
+     */
+    pp_ext_context ext;
+    /**
+     * @brief The document measured with pure extensions, and its copy with
+     * them resolved, which renders of the document print.
+     */
+    const pp_doc* document;
+    const pp_doc* resolved;
+} pp_measure_table;
+
+/** @} */
+
+#endif
+
+#if PRETTYPRINT_USE_CPP == 0
+
+/**
+ * @brief A nil document.
+ */
+extern pp_doc* _pp_nil;
+
+/**
+ * @brief A separator document.
+ *
+ * A separator is most commonly represented as a space, but may be omitted in
+ * newlines.
+ */
+extern pp_doc* _pp_sep;
+
+/**
+ * @brief Initialize a text document.
+ *
+ * @param result The document to initialize.
+ * @param text The text of the document. Ownership of memory is not accounted for.
+ * @param length The length of text to use.
+ */
+void _pp_text(pp_doc_text* result, const char* text, size_t length);
+
+/**
+ * @brief A line document.
+ */
+extern pp_doc* _pp_line;
+
+/**
+ * @brief Initialize a nested document.
+ *
+ * Nested documents are an easy way to make indented sections. Indentation
+ * takes effect after newlines in nested.
+ *
+ * @param result The document to initialize.
+ * @param indent The amount by which to increase the indent.
+ * @param nested The nested document.
+ */
+void _pp_nest(pp_doc_nest* result, size_t indent, const pp_doc* nested);
+
+/**
+ * @brief Initialize an appended document.
+ *
+ * @param result The document to initialize.
+ * @param a The first document to append.
+ * @param b The second document to append.
+ */
+void _pp_append(pp_doc_append* result, const pp_doc* a, const pp_doc* b);
+
+/**
+ * @brief Initialize a grouped document.
+ *
+ * Grouped documents will display on a single line if possible, replacing all
+ * @p line instances with spaces.
+ *
+ * @param result The document to initialize.
+ * @param d The document to group.
+ */
+void _pp_group(pp_doc_group* result, const pp_doc* d);
+
+/**
+ * @brief Initialize a concatenation document.
+ *
+ * @param result The document to initialize.
+ * @param docs The documents to concatenate, which are not copied.
+ * @param count The number of documents in @p docs.
+ */
+void _pp_concat(pp_doc_concat* result, const pp_doc* const* docs, size_t count);
+
+/**
+ * @brief Initialize a fill document.
+ *
+ * Fill documents place as many of their documents on each line as fit,
+ * separated by spaces. Each document is laid out as a group: it is flat if
+ * it fits on the line it starts on. Lines are filled in a single pass, with
+ * each document measured at most once.
+ *
+ * @param result The document to initialize.
+ * @param docs The documents to fill lines with, which are not copied.
+ * @param count The number of documents in @p docs.
+ */
+void _pp_fill(pp_doc_fill* result, const pp_doc* const* docs, size_t count);
+
+/**
+ * @brief Initialize a words document.
+ *
+ * @param result The document to initialize.
+ * @param text The text to split into words. Ownership of memory is not accounted for.
+ * @param length The length of text to use.
+ */
+void _pp_words(pp_doc_words* result, const char* text, size_t length);
+
+/**
+ * @brief Initialize a lazy document.
+ *
+ * @see pp_doc_lazy
+ *
+ * @param result The document to initialize.
+ * @param force The function producing the document.
+ * @param release The function releasing produced documents, or NULL.
+ * @param data Data to pass to the functions.
+ */
+void _pp_lazy(pp_doc_lazy* result, const pp_doc* (*force)(void* data, pp_ext_context* context),
+        void (*release)(void* data, const pp_doc* d), void* data);
+
+/** @} */
+
+/** @addtogroup AdvancedPP
+ * @{
+ */
+
+/**
+ * @brief Pretty print a document.
+ *
+ * The document is not modified (unless an @p evaluate_extension function
+ * does so), so it may be printed on several threads at once.
+ *
+ * @param writer The writer to use.
+ * @param settings The settings to use when printing.
+ * @param document The document to print.
+ */
+void _pp_pretty(const pp_writer* writer, const pp_settings* settings, const pp_doc* document);
+
+/**
+ * @brief Allocate memory while resolving an extension.
+ *
+ * The memory is suitably aligned for any document, and is released when the
+ * render (or serialization, or compiled program) that resolved the extension
+ * is done.
+ *
+ * @param context The context passed to the resolver.
+ * @param size The number of bytes to allocate.
+ *
+ * @return The memory, or NULL if it could not be allocated.
+ */
+void* pp_ext_alloc(pp_ext_context* context, size_t size);
+
+/**
+ * @brief Create a text document while resolving an extension.
+ *
+ * The text is copied into the document.
+ *
+ * @param context The context passed to the resolver.
+ * @param text The text of the document.
+ * @param length The length of the text.
+ *
+ * @return The document, or NULL if it could not be allocated.
+ */
+pp_doc* pp_ext_text(pp_ext_context* context, const char* text, size_t length);
+
+/**
+ * @brief Pretty print a document using precomputed measurements.
+ *
+ * Groups whose measurements are in @p measure are laid out without examining
+ * their contents. This is only valid while the measured documents are
+ * unchanged.
+ *
+ * @param writer The writer to use.
+ * @param settings The settings to use when printing.
+ * @param measure The measurements from @p pp_measure, or NULL.
+ * @param document The document to print.
+ */
+void _pp_pretty_measured(const pp_writer* writer, const pp_settings* settings,
+        const pp_measure_table* measure, const pp_doc* document);
+
+/**
+ * @brief Initialize a buffered writer.
+ *
+ * @param result The writer to initialize.
+ * @param buffer The buffer to use.
+ * @param size The size of @p buffer, which must be nonzero.
+ * @param sink The writer to which to flush the buffer.
+ */
+void _pp_buffered_writer(pp_buffered_writer* result, char* buffer, size_t size, const pp_writer* sink);
+
+/**
+ * @brief Write out any buffered output.
+ *
+ * @param b The buffered writer.
+ */
+void _pp_buffered_flush(pp_buffered_writer* b);
+
+/**
+ * @brief Pretty print a document using a caller-supplied render stack.
+ *
+ * This makes no memory allocations (other than those of extension resolvers
+ * with @p pp_ext_alloc). The stack needs roughly one frame per
+ * level of document nesting (counting each append in a chain and each
+ * concatenation or fill as a level), plus the depth of the largest group.
+ *
+ * @param writer The writer to use.
+ * @param settings The settings to use when printing.
+ * @param document The document to print.
+ * @param stack The frames to use for the render stack.
+ * @param capacity The number of frames in @p stack.
+ *
+ * @return 0 on success, or -1 if @p stack was too small (in which case the
+ * output will be incomplete).
+ */
+int _pp_pretty_stack(const pp_writer* writer, const pp_settings* settings, const pp_doc* document,
+        pp_render_frame* stack, size_t capacity);
+
+/** @} */
+
+/** @defgroup MallocAPI Malloc API
+ * 
+ * Most users should find this API sufficient.
+ * @{
+ */
+
+/**
+ * @brief Create a nil document.
+ *
+ * @return The document (not malloc'd).
+ */
+pp_doc* pp_nil(void);
+
+/**
+ * @brief Create a separator document.
+ *
+ * @return The document (not malloc'd).
+ */
+pp_doc* pp_sep(void);
+
+/**
+ * @brief Create a text document.
+ *
+ * @param text The text for the document.
+ * @param length The length of the text.
+ *
+ * @return The document, or NULL if the document could not be allocated.
+ */
+pp_doc* pp_text(const char* text, size_t length);
+
+/**
+ * @brief Create a line document.
+ *
+ * @return The document (not malloc'd).
+ */
+pp_doc* pp_line(void);
+
+/**
+ * @brief Create a nested document.
+ *
+ * @param indent The amount by which to increase the indentation.
+ * @param nested The nested document.
+ *
+ * @return The document, or NULL if the document could not be allocated.
+ */
+pp_doc* pp_nest(size_t indent, const pp_doc* nested);
+
+/**
+ * @brief Create an appended document.
+ *
+ * @param a The first document to append.
+ * @param b The second document to append.
+ *
+ * @return The document, or NULL if the document could not be allocated.
+ */
+pp_doc* pp_append(const pp_doc* a, const pp_doc* b);
+
+/**
+ * @brief Create a grouped document.
+ *
+ * @param d The document to group.
+ *
+ * @return The document, or NULL if the document could not be allocated.
+ */
+pp_doc* pp_group(const pp_doc* d);
+
+/**
+ * @brief Create a concatenated document.
+ *
+ * This renders as the documents appended in order, with one allocation
+ * however many documents there are.
+ *
+ * @param docs The documents to concatenate, which are copied into the
+ * document.
+ * @param count The number of documents in @p docs.
+ *
+ * @return The document, or NULL if the document could not be allocated.
+ */
+pp_doc* pp_concat(const pp_doc* const* docs, size_t count);
+
+/**
+ * @brief Create a fill document.
+ *
+ * @see _pp_fill
+ *
+ * @param docs The documents to fill lines with, which are copied into the
+ * document.
+ * @param count The number of documents in @p docs.
+ *
+ * @return The document, or NULL if the document could not be allocated.
+ */
+pp_doc* pp_fill(const pp_doc* const* docs, size_t count);
+
+/**
+ * @brief Create a lazy document.
+ *
+ * @see _pp_lazy
+ *
+ * @param force The function producing the document.
+ * @param release The function releasing produced documents, or NULL.
+ * @param data Data to pass to the functions. Ownership of memory is not
+ * accounted for.
+ *
+ * @return The document, or NULL if the document could not be allocated.
+ */
+pp_doc* pp_lazy(const pp_doc* (*force)(void* data, pp_ext_context* context),
+        void (*release)(void* data, const pp_doc* d), void* data);
+
+/**
+ * @brief Free a document.
+ *
+ * This frees the memory of all sub-documents as well.
+ *
+ * @param d The document to free.
+ */
+void pp_free(pp_doc* d);
+
+/**
+ * @brief An extension-aware free function.
+ *
+ * If @p free_ext is NULL, ignores extension documents.
+ *
+ * This frees the memory of all sub-documents, and calls @p free_ext when an
+ * extension document is encountered. @p free_ext is expected to also free the
+ * document pointer (if necessary).
+ *
+ * @param free_ext The free function used for extension documents.
+ * @param d The document to free.
+ */
+void pp_free_ext(void (*free_ext)(pp_doc* d), pp_doc* d);
+
+/**
+ * @brief Measure a document for repeated rendering.
+ *
+ * This records the flat width of every subtree of @p d, so that rendering
+ * with the result (at any settings) needn't re-examine grouped documents to
+ * decide whether they fit. Subtrees containing extensions are still examined
+ * when rendered.
+ *
+ * @param d The document to measure.
+ *
+ * @return The measurements, or NULL if they could not be allocated. Free with
+ * @p pp_measure_free.
+ */
+pp_measure_table* pp_measure(const pp_doc* d);
+
+/**
+ * @brief Measure a document for repeated rendering with particular settings.
+ *
+ * This is @p pp_measure, except that if @p settings has @p pure_extensions
+ * set, extensions are resolved once here and the document is copied with
+ * their results in their place (sharing the subtrees without extensions), so
+ * that rendering @p d with the result neither resolves nor re-examines them.
+ * Other documents rendered with the result resolve their extensions as usual.
+ * Such measurements must only be used with settings that resolve extensions
+ * the same way. Lazy documents are not produced here.
+ *
+ * @param settings The settings with which extensions are resolved.
+ * @param d The document to measure.
+ *
+ * @return The measurements, or NULL if they could not be allocated. Free with
+ * @p pp_measure_free.
+ */
+pp_measure_table* pp_measure_resolved(const pp_settings* settings, const pp_doc* d);
+
+/**
+ * @brief Measure a document on several threads.
+ *
+ * This is @p pp_measure, with the subtrees near the root of @p d measured
+ * concurrently. Large documents whose root is a long chain of appends are
+ * measured mostly on one thread.
+ *
+ * Whether this is faster than @p pp_measure on several processors has not
+ * been measured. On one processor it takes about as long.
+ *
+ * @param d The document to measure.
+ * @param threads The number of threads to use (including the calling thread),
+ * or 0 to use one per processor.
+ *
+ * @return The measurements, or NULL if they could not be allocated. Free with
+ * @p pp_measure_free.
+ */
+pp_measure_table* pp_measure_parallel(const pp_doc* d, size_t threads);
+
+/**
+ * @brief Free document measurements.
+ *
+ * @param m The measurements to free. May be NULL.
+ */
+void pp_measure_free(pp_measure_table* m);
+
+/**
+ * @brief Create a buffered writer that flushes to a file pointer.
+ *
+ * @param f The file pointer to write to.
+ * @param size The size of the buffer, or 0 for a default size.
+ *
+ * @return The writer, or NULL if it could not be allocated. Free with @p
+ * pp_buffered_free.
+ */
+pp_buffered_writer* pp_buffered_file(FILE* f, size_t size);
+
+/**
+ * @brief Create a buffered writer that flushes to a file descriptor.
+ *
+ * @param fd The file descriptor to write to.
+ * @param size The size of the buffer, or 0 for a default size.
+ *
+ * @return The writer, or NULL if it could not be allocated. Free with @p
+ * pp_buffered_free.
+ */
+pp_buffered_writer* pp_buffered_fd(int fd, size_t size);
+
+/**
+ * @brief Flush and free a buffered writer.
+ *
+ * @param b The writer to free. May be NULL.
+ */
+void pp_buffered_free(pp_buffered_writer* b);
+
+/** @} */
+
+/** @defgroup ArenaAPI Arena API
+ *
+ * Documents may be allocated from an arena instead of individually with
+ * malloc. Arena documents are all released at once with @p pp_arena_reset or
+ * @p pp_arena_destroy, and must not be passed to @p pp_free.
+ * @{
+ */
+
+typedef struct _pp_arena pp_arena;
+
+/**
+ * @brief Create an arena.
+ *
+ * @param chunk_size The size of the blocks of memory allocated by the arena,
+ * or 0 for a default size.
+ *
+ * @return The arena, or NULL if it could not be allocated.
+ */
+pp_arena* pp_arena_create(size_t chunk_size);
+
+/**
+ * @brief Release all documents allocated from an arena.
+ *
+ * The arena keeps its memory for reuse.
+ *
+ * @param a The arena.
+ */
+void pp_arena_reset(pp_arena* a);
+
+/**
+ * @brief Release all documents allocated from an arena, and the arena.
+ *
+ * @param a The arena. May be NULL.
+ */
+void pp_arena_destroy(pp_arena* a);
+
+/**
+ * @brief Create a text document in an arena.
+ *
+ * @see pp_text
+ */
+pp_doc* pp_arena_text(pp_arena* a, const char* text, size_t length);
+
+/**
+ * @brief Create a nested document in an arena.
+ *
+ * @see pp_nest
+ */
+pp_doc* pp_arena_nest(pp_arena* a, size_t indent, const pp_doc* nested);
+
+/**
+ * @brief Create an appended document in an arena.
+ *
+ * @see pp_append
+ */
+pp_doc* pp_arena_append(pp_arena* arena, const pp_doc* a, const pp_doc* b);
+
+/**
+ * @brief Create a grouped document in an arena.
+ *
+ * @see pp_group
+ */
+pp_doc* pp_arena_group(pp_arena* a, const pp_doc* d);
+
+/**
+ * @brief Create a concatenated document in an arena.
+ *
+ * @see pp_concat
+ */
+pp_doc* pp_arena_concat(pp_arena* a, const pp_doc* const* docs, size_t count);
+
+/**
+ * @brief Create a fill document in an arena.
+ *
+ * @see pp_fill
+ */
+pp_doc* pp_arena_fill(pp_arena* a, const pp_doc* const* docs, size_t count);
+
+/**
+ * @brief Create a lazy document in an arena.
+ *
+ * @see pp_lazy
+ */
+pp_doc* pp_arena_lazy(pp_arena* a, const pp_doc* (*force)(void* data, pp_ext_context* context),
+        void (*release)(void* data, const pp_doc* d), void* data);
+
+/**
+ * @brief Create a text document from a null-terminated string in an arena.
+ *
+ * @see pp_string
+ */
+pp_doc* pp_arena_string(pp_arena* a, const char* str);
+
+/**
+ * @brief Create a document with space-separated words in an arena.
+ *
+ * @see pp_words
+ */
+pp_doc* pp_arena_words(pp_arena* a, const char* words);
+
+/**
+ * @brief Append all documents passed as parameters in an arena.
+ *
+ * @see pp_appends
+ */
+#define pp_arena_appends(a, ...) pp_arena_appends_impl(a, __VA_ARGS__, NULL)
+pp_doc* pp_arena_appends_impl(pp_arena* a, ...);
+
+/** @} */
+
+/** @defgroup InternAPI Interning API
+ *
+ * Documents may be interned (hash-consed), so that equal documents are the
+ * same object: text and words are equal when their text is, and other
+ * documents when their fields are and their children are the same objects.
+ * Documents built from interned parts are therefore a DAG in which each
+ * distinct subtree is stored once, which suits generated documents that
+ * repeat the same pieces many times.
+ *
+ * Interned documents are allocated from an arena owned by the interner, and
+ * are released with it by @p pp_interner_destroy; they must not be passed to
+ * @p pp_free. Text is copied into the interner. Documents that were not
+ * interned may be used as children, but must outlive the interner.
+ *
+ * Every interned document is measured once, when it is interned, and the
+ * measurements are available from @p pp_interner_measure for rendering.
+ *
+ * Functions returning documents return NULL if memory could not be allocated.
+ * @{
+ */
+
+typedef struct _pp_interner pp_interner;
+
+/**
+ * @brief Create an interner.
+ *
+ * @param chunk_size The size of the blocks of memory allocated by the
+ * interner's arena, or 0 for a default size.
+ *
+ * @return The interner, or NULL if it could not be allocated.
+ */
+pp_interner* pp_interner_create(size_t chunk_size);
+
+/**
+ * @brief Release an interner and all documents interned with it.
+ *
+ * @param in The interner. May be NULL.
+ */
+void pp_interner_destroy(pp_interner* in);
+
+/**
+ * @brief Get the measurements of the documents interned so far.
+ *
+ * Pass these to @p pp_pretty_measured (or @p _pp_pretty_measured) to render
+ * interned documents without measuring shared subtrees again. They are
+ * updated as documents are interned, and are owned by the interner.
+ *
+ * @param in The interner.
+ *
+ * @return The measurements.
+ */
+const pp_measure_table* pp_interner_measure(const pp_interner* in);
+
+/**
+ * @brief Intern a text document.
+ *
+ * @see pp_text
+ */
+pp_doc* pp_intern_text(pp_interner* in, const char* text, size_t length);
+
+/**
+ * @brief Intern a text document from a null-terminated string.
+ *
+ * @see pp_string
+ */
+pp_doc* pp_intern_string(pp_interner* in, const char* str);
+
+/**
+ * @brief Intern a document with space-separated words.
+ *
+ * @see pp_words
+ */
+pp_doc* pp_intern_words(pp_interner* in, const char* words);
+
+/**
+ * @brief Intern a nested document.
+ *
+ * @see pp_nest
+ */
+pp_doc* pp_intern_nest(pp_interner* in, size_t indent, const pp_doc* nested);
+
+/**
+ * @brief Intern an appended document.
+ *
+ * @see pp_append
+ */
+pp_doc* pp_intern_append(pp_interner* in, const pp_doc* a, const pp_doc* b);
+
+/**
+ * @brief Intern a grouped document.
+ *
+ * @see pp_group
+ */
+pp_doc* pp_intern_group(pp_interner* in, const pp_doc* d);
+
+/**
+ * @brief Intern a concatenated document.
+ *
+ * @see pp_concat
+ */
+pp_doc* pp_intern_concat(pp_interner* in, const pp_doc* const* docs, size_t count);
+
+/**
+ * @brief Intern a fill document.
+ *
+ * @see pp_fill
+ */
+pp_doc* pp_intern_fill(pp_interner* in, const pp_doc* const* docs, size_t count);
+
+/** @} */
+
+/** @defgroup StreamAPI Streaming API
+ *
+ * A document may be rendered as it is produced, without building it in
+ * memory, by describing its structure with a sequence of calls. The output is
+ * the same as that of rendering the equivalent document: @p pp_stream_text
+ * stands for a text document, @p pp_stream_group_open and @p
+ * pp_stream_group_close enclose the content of a group, and @p
+ * pp_stream_nest_push and @p pp_stream_nest_pop enclose the content of a
+ * nest.
+ *
+ * Output is held back only while deciding whether a group fits on the
+ * current line, so the memory used is bounded by the width (and the depth of
+ * nesting) rather than the size of the document.
+ *
+ * Functions returning int return 0 on success and -1 if memory could not be
+ * allocated, after which the stream produces no more output. If the output
+ * has been cut by the @p max_lines or @p max_bytes settings, they return 1
+ * and ignore what they are given, so the rest of the document need not be
+ * produced (though the stream must still be ended with @p pp_stream_end,
+ * which returns 0).
+ * @{
+ */
+
+typedef struct _pp_stream pp_stream;
+
+/**
+ * @brief Start streaming a document.
+ *
+ * @param writer The writer to which to print the document.
+ * @param settings The settings to use when printing. These must remain valid
+ * until @p pp_stream_end.
+ *
+ * @return The stream, or NULL if it could not be allocated.
+ */
+pp_stream* pp_stream_begin(const pp_writer* writer, const pp_settings* settings);
+
+/**
+ * @brief Stream text.
+ *
+ * @param s The stream.
+ * @param text The text, which is copied if it must be held back.
+ * @param length The length of the text.
+ */
+int pp_stream_text(pp_stream* s, const char* text, size_t length);
+
+/**
+ * @brief Stream a line break (or a space, if flattened).
+ *
+ * @param s The stream.
+ */
+int pp_stream_line(pp_stream* s);
+
+/**
+ * @brief Stream a separator.
+ *
+ * @param s The stream.
+ */
+int pp_stream_sep(pp_stream* s);
+
+/**
+ * @brief Open a group.
+ *
+ * @param s The stream.
+ */
+int pp_stream_group_open(pp_stream* s);
+
+/**
+ * @brief Close the innermost open group.
+ *
+ * @param s The stream.
+ */
+int pp_stream_group_close(pp_stream* s);
+
+/**
+ * @brief Increase the indentation of what follows until @p pp_stream_nest_pop.
+ *
+ * @param s The stream.
+ * @param indent The amount to add to the indentation.
+ */
+int pp_stream_nest_push(pp_stream* s, size_t indent);
+
+/**
+ * @brief Restore the indentation from before the innermost @p
+ * pp_stream_nest_push.
+ *
+ * @param s The stream.
+ */
+int pp_stream_nest_pop(pp_stream* s);
+
+/**
+ * @brief Finish streaming a document and free the stream.
+ *
+ * Open groups and nests are closed, and all held-back output is written.
+ *
+ * @param s The stream. May be NULL, in which case -1 is returned.
+ */
+int pp_stream_end(pp_stream* s);
+
+/** @} */
+
+/** @defgroup SerialAPI Serialized documents
+ *
+ * A document may be serialized into a compact, position-independent form
+ * that can be stored (on disk, for instance) and rendered directly, without
+ * being rebuilt. Extensions are evaluated when serializing, with the
+ * settings given then; layout is decided when rendering, so a serialized
+ * document may be rendered at any width. Serialized documents use the host's
+ * byte order.
+ * @{
+ */
+
+/**
+ * @brief Serialize a document into memory.
+ *
+ * @param buffer The buffer to which to serialize the document, which must be
+ * aligned as for malloc. May be NULL if @p capacity is 0.
+ * @param capacity The size of @p buffer. Nothing is written if the
+ * serialized document does not fit.
+ * @param settings The settings with which to evaluate extensions.
+ * @param document The document to serialize.
+ *
+ * @return The size of the serialized document, or 0 if memory could not be
+ * allocated or the document is too large to serialize.
+ */
+size_t pp_doc_serialize_into(void* buffer, size_t capacity, const pp_settings* settings, const pp_doc* document);
+
+/**
+ * @brief Serialize a document to a file.
+ *
+ * @param f The file pointer to which to write the serialized document.
+ * @param settings The settings with which to evaluate extensions.
+ * @param document The document to serialize.
+ *
+ * @return 0 on success, or -1 if memory could not be allocated, the document
+ * is too large to serialize, or writing failed.
+ */
+int pp_doc_serialize(FILE* f, const pp_settings* settings, const pp_doc* document);
+
+/**
+ * @brief Check that memory holds a valid serialized document.
+ *
+ * Serialized documents from untrusted sources must be checked before they are
+ * rendered.
+ *
+ * @param data The serialized document.
+ * @param size The size of the serialized document.
+ *
+ * @return 0 if the document is valid, or -1 if not.
+ */
+int pp_doc_validate(const void* data, size_t size);
+
+/**
+ * @brief A serialized document mapped into memory.
+ */
+typedef struct {
+    const void* data;
+    size_t size;
+} pp_mapped_doc;
+
+/**
+ * @brief Map a serialized document file into memory.
+ *
+ * @param path The path of the file.
+ *
+ * @return The mapped document, or NULL if the file could not be mapped or
+ * does not hold a valid serialized document. Unmap with @p pp_doc_unmap.
+ */
+pp_mapped_doc* pp_doc_map(const char* path);
+
+/**
+ * @brief Unmap a serialized document.
+ *
+ * @param m The mapped document. May be NULL.
+ */
+void pp_doc_unmap(pp_mapped_doc* m);
+
+/**
+ * @brief Pretty print a serialized document.
+ *
+ * @param writer The writer to use.
+ * @param settings The settings to use when printing. Extensions are not
+ * evaluated.
+ * @param data The serialized document, which must be valid.
+ */
+void _pp_pretty_serialized(const pp_writer* writer, const pp_settings* settings, const void* data);
+
+/**
+ * @brief Pretty print a serialized document.
+ *
+ * @param f The file pointer to which to print the document.
+ * @param settings The settings to use when printing. Extensions are not
+ * evaluated.
+ * @param data The serialized document, which must be valid.
+ */
+void pp_pretty_serialized(FILE* f, const pp_settings* settings, const void* data);
+
+/** @} */
+
+/** @defgroup CompileAPI Compiled documents
+ *
+ * A document that is rendered many times may be compiled into a linear
+ * program, which renders without walking the document or evaluating
+ * extensions. Extensions are evaluated when compiling, with the settings
+ * given then; layout is decided when rendering, so a program may be rendered
+ * at any width. Programs refer to the text of the document they were
+ * compiled from, which must outlive them.
+ * @{
+ */
+
+typedef struct _pp_program pp_program;
+
+/**
+ * @brief Compile a document.
+ *
+ * @param settings The settings with which to evaluate extensions.
+ * @param document The document to compile.
+ *
+ * @return The program, or NULL if it could not be allocated. Free with @p
+ * pp_program_free.
+ */
+pp_program* pp_compile(const pp_settings* settings, const pp_doc* document);
+
+/**
+ * @brief Free a compiled document.
+ *
+ * @param p The program to free. May be NULL.
+ */
+void pp_program_free(pp_program* p);
+
+/**
+ * @brief Pretty print a compiled document.
+ *
+ * This makes no memory allocations.
+ *
+ * @param writer The writer to use.
+ * @param settings The settings to use when printing. Extensions are not
+ * evaluated.
+ * @param program The compiled document.
+ */
+void _pp_pretty_compiled(const pp_writer* writer, const pp_settings* settings, const pp_program* program);
+
+/**
+ * @brief Pretty print a compiled document.
+ *
+ * @param f The file pointer to which to print the document.
+ * @param settings The settings to use when printing. Extensions are not
+ * evaluated.
+ * @param program The compiled document.
+ */
+void pp_pretty_compiled(FILE* f, const pp_settings* settings, const pp_program* program);
+
+/** @} */
+
+/** @defgroup LayoutAPI Retained layouts
+ *
+ * A layout holds the rendered output of a document, divided at its top-level
+ * lines (those outside any group, reached from the root through nests,
+ * appends and concatenations alone), with the offset of every line. Since the
+ * layout after such a line depends only on its indentation, replacing part of
+ * the document re-renders only the parts between top-level lines that contain
+ * it, and the output stays that of @p _pp_pretty.
+ *
+ * The layout refers to its document and settings, which must outlive it. It
+ * holds the whole output, so the @p max_lines and @p max_bytes settings are
+ * ignored.
+ * @{
+ */
+
+typedef struct _pp_layout pp_layout;
+
+/**
+ * @brief Render a document into a layout.
+ *
+ * @param settings The settings to use when printing.
+ * @param document The document to print.
+ *
+ * @return The layout, or NULL if it could not be allocated. Free with @p
+ * pp_layout_free.
+ */
+pp_layout* pp_layout_create(const pp_settings* settings, const pp_doc* document);
+
+/**
+ * @brief Free a layout.
+ *
+ * @param l The layout to free. May be NULL.
+ */
+void pp_layout_free(pp_layout* l);
+
+/**
+ * @brief Replace part of the document of a layout, and re-render it.
+ *
+ * Every occurrence of @p old in the document is replaced with @p
+ * replacement. The document itself is not modified: the documents containing
+ * @p old are copied by the layout, and the copy becomes its document.
+ * Documents are found by walking the document (though not within extensions
+ * or lazy documents), which is much cheaper than rendering it; only the parts
+ * between top-level lines that changed are rendered again.
+ *
+ * @param l The layout.
+ * @param old The document to replace.
+ * @param replacement The document to put in its place, which must outlive the
+ * layout.
+ *
+ * @return 1 if @p old was replaced, 0 if it was not found, or -1 if memory
+ * could not be allocated, in which case the layout is unchanged.
+ */
+int pp_layout_replace(pp_layout* l, const pp_doc* old, const pp_doc* replacement);
+
+/**
+ * @brief Get the current document of a layout.
+ *
+ * @param l The layout.
+ *
+ * @return The document, with any replacements made.
+ */
+const pp_doc* pp_layout_document(const pp_layout* l);
+
+/**
+ * @brief Get the number of lines of a layout's output.
+ *
+ * @param l The layout.
+ *
+ * @return The number of lines, which is one more than the number of line
+ * breaks.
+ */
+size_t pp_layout_lines(const pp_layout* l);
+
+/**
+ * @brief Get a line of a layout's output.
+ *
+ * @param l The layout.
+ * @param line The index of the line, less than @p pp_layout_lines.
+ * @param length Set to the length of the line, without its line break.
+ *
+ * @return The text of the line, which is valid until the layout is changed.
+ */
+const char* pp_layout_line(const pp_layout* l, size_t line, size_t* length);
+
+/**
+ * @brief Write the output of a layout.
+ *
+ * @param writer The writer to use.
+ * @param l The layout.
+ */
+void _pp_layout_write(const pp_writer* writer, const pp_layout* l);
+
+/**
+ * @brief Write the output of a layout to a file.
+ *
+ * @param f The file pointer to which to write.
+ * @param l The layout.
+ */
+void pp_layout_write(FILE* f, const pp_layout* l);
+
+/** @} */
+
+/** @defgroup HighFunc Higher-level functions
+ * @{
+ */
+
+/**
+ * @brief Create a text document from a null-terminated string.
+ *
+ * The length is determined with @p strlen().
+ *
+ * @param str The string to use for the text document.
+ *
+ * @return The document, or NULL if the document could not be allocated.
+ */
+pp_doc* pp_string(const char* str);
+
+/**
+ * @brief Create a document with space-separated words.
+ *
+ * The words in the null-terminated string @p words (as determined by the space
+ * characters in the string) are separated by separators, and any newlines in
+ * the string are made into lines. The string is referenced rather than
+ * copied, and is split as it is rendered, so the document is a single
+ * object however many words there are.
+ *
+ * @param words The string to split into words.
+ *
+ * @return The document, or NULL if the document could not be allocated.
+ */
+pp_doc* pp_words(const char* words);
+
+/**
+ * @brief Append all documents passed as parameters.
+ *
+ * The result is a single concatenation document.
+ *
+ * @param ... A variable list of documents to append.
+ *
+ * @return The document, or NULL if the document could not be allocated.
+ */
+#define pp_appends(...) pp_appends_impl(0, __VA_ARGS__, NULL)
+pp_doc* pp_appends_impl(size_t count, ...);
+
+/** @} */
+
+/** @addtogroup PPAPI
+ * @{
+ */
+
+/**
+ * @brief Pretty print a document.
+ *
+ * @param f The file pointer to which to print the document.
+ * @param settings The settings to use when printing.
+ * @param document The document to print.
+ */
+void pp_pretty(FILE* f, const pp_settings* settings, const pp_doc* document);
+
+/**
+ * @brief Pretty print a document to a file descriptor.
+ *
+ * @param fd The file descriptor to which to print the document.
+ * @param settings The settings to use when printing.
+ * @param document The document to print.
+ */
+void pp_pretty_fd(int fd, const pp_settings* settings, const pp_doc* document);
+
+/**
+ * @brief Pretty print a document on several threads.
+ *
+ * The document is divided at its top-level lines (those not within a group,
+ * reached through nests, appends and concatenations alone), after which the
+ * layout is known, and the parts between them are rendered concurrently. The
+ * output is that of @p _pp_pretty. The whole output is held in memory until
+ * it is written.
+ *
+ * Whether this is faster than @p _pp_pretty on several processors has not
+ * been measured. On one processor it is not: with @p threads 0 it renders as
+ * @p _pp_pretty does, and with more threads than processors, holding the
+ * output costs roughly 10-20% more than @p _pp_pretty.
+ *
+ * Extensions must be resolved with @p resolve_extension; if only
+ * @p evaluate_extension is set, the document is printed on one thread, as it
+ * is if @p max_lines or @p max_bytes is set.
+ *
+ * @param writer The writer to use.
+ * @param settings The settings to use when printing.
+ * @param document The document to print.
+ * @param threads The number of threads to use (including the calling thread),
+ * or 0 for the number of processors online.
+ *
+ * @return 0 on success, or -1 if memory could not be allocated, in which case
+ * nothing is written.
+ */
+int _pp_pretty_parallel(const pp_writer* writer, const pp_settings* settings, const pp_doc* document,
+        size_t threads);
+
+/**
+ * @brief Pretty print a document to a file on several threads.
+ *
+ * @see _pp_pretty_parallel
+ */
+int pp_pretty_parallel(FILE* f, const pp_settings* settings, const pp_doc* document, size_t threads);
+
+/**
+ * @brief Pretty print a document with several settings at once.
+ *
+ * The document is traversed once for all of the renders, each written to its
+ * own writer as @p _pp_pretty would write it, which is faster than rendering
+ * it once per settings. Groups are examined once for every render that
+ * hasn't already flattened them.
+ *
+ * Renders with the same settings object, or whose settings evaluate no
+ * extensions, resolve extensions (and produce lazy documents) once between
+ * them. Other renders are traversed separately, since their extensions may
+ * resolve differently.
+ *
+ * @param settings The settings of each render.
+ * @param writers The writer of each render.
+ * @param count The number of renders.
+ * @param document The document to print.
+ *
+ * @return 0 on success, or -1 if memory could not be allocated, in which case
+ * the output may be incomplete.
+ */
+int _pp_pretty_multi(const pp_settings* const* settings, const pp_writer* const* writers, size_t count,
+        const pp_doc* document);
+
+/**
+ * @brief Pretty print a document to several files with several settings at
+ * once.
+ *
+ * @see _pp_pretty_multi
+ */
+int pp_pretty_multi(const pp_settings* const* settings, FILE* const* files, size_t count, const pp_doc* document);
+
+/**
+ * @brief Compute the length of a document's output.
+ *
+ * @param settings The settings to use when printing.
+ * @param document The document to measure.
+ *
+ * @return The number of bytes @p pp_render_into would write with enough
+ * space. This is exact unless extensions in @p document evaluate differently
+ * from render to render.
+ */
+size_t pp_render_size(const pp_settings* settings, const pp_doc* document);
+
+/**
+ * @brief Pretty print a document into memory.
+ *
+ * The output is not null-terminated.
+ *
+ * @param buffer The buffer to which to print the document. May be NULL if @p
+ * capacity is 0.
+ * @param capacity The size of @p buffer. Output past this is discarded.
+ * @param settings The settings to use when printing.
+ * @param document The document to print.
+ *
+ * @return The length of the whole output, which is greater than @p capacity
+ * if it was truncated.
+ */
+size_t pp_render_into(char* buffer, size_t capacity, const pp_settings* settings, const pp_doc* document);
+
+/**
+ * @brief Pretty print a document using precomputed measurements.
+ *
+ * @param f The file pointer to which to print the document.
+ * @param settings The settings to use when printing.
+ * @param measure The measurements from @p pp_measure, or NULL.
+ * @param document The document to print.
+ */
+void pp_pretty_measured(FILE* f, const pp_settings* settings, const pp_measure_table* measure,
+        const pp_doc* document);
+
+/** @} */
+
+#else
+
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/** @defgroup CXXAPI C++ API
+ * @{
+ */
+
+namespace pp {
+
+struct doc : public pp_doc {};
+
+namespace impl {
+
+/**
+ * The base of documents owned by @p doc_ref handles.
+ */
+struct ref_node {
+    ref_node() : refs(0) {}
+    virtual ~ref_node() {}
+    size_t refs;
+};
+
+}
+
+/**
+ * A handle to a document with an intrusive, non-atomic reference count.
+ *
+ * These are cheaper to copy and release than @p std::shared_ptr, but a
+ * document built with them (and every @p doc_ref to any part of it) must only
+ * be used by one thread at a time. Use @p freeze to share a finished document
+ * between threads.
+ */
+class doc_ref {
+public:
+    doc_ref() noexcept : node(nullptr), d(nullptr) {}
+    /** Refer to a shared document. */
+    explicit doc_ref(std::shared_ptr<const doc> shared);
+    doc_ref(impl::ref_node* node, const doc* d) noexcept
+        : node(node), d(d)
+    {
+        if (node != nullptr) node->refs++;
+    }
+    doc_ref(const doc_ref& o) noexcept
+        : doc_ref(o.node, o.d)
+    {}
+    doc_ref(doc_ref&& o) noexcept
+        : node(o.node), d(o.d)
+    {
+        o.node = nullptr;
+        o.d = nullptr;
+    }
+    ~doc_ref() {
+        if (node != nullptr && --node->refs == 0) delete node;
+    }
+
+    doc_ref& operator=(doc_ref o) noexcept {
+        std::swap(node, o.node);
+        std::swap(d, o.d);
+        return *this;
+    }
+
+    const doc* get() const noexcept { return d; }
+    explicit operator bool() const noexcept { return d != nullptr; }
+
+private:
+    impl::ref_node* node;
+    const doc* d;
+};
+
+namespace data {
+
+template <typename T>
+struct from_doc : public T {
+    doc* as_doc() { return reinterpret_cast<doc*>(static_cast<T*>(this)); }
+};
+
+struct doc_text : public from_doc<pp_doc_text> {
+    doc_text(const char* t, size_t length);
+    doc_text(const char* str);
+};
+
+struct doc_string : public from_doc<pp_doc_text> {
+    doc_string(const std::string& s);
+private:
+    const std::string s;
+};
+
+struct doc_words : public from_doc<pp_doc_words> {
+    doc_words(const std::string& s);
+private:
+    const std::string s;
+};
+
+/*
+ * Composite documents hold their children with a handle type, which is
+ * either std::shared_ptr<const doc> or doc_ref.
+ */
+
+template <typename Handle>
+struct basic_doc_nest : public from_doc<pp_doc_nest> {
+    basic_doc_nest(size_t indent, Handle nested);
+private:
+    Handle s_nested;
+};
+
+template <typename Handle>
+struct basic_doc_append : public from_doc<pp_doc_append> {
+    basic_doc_append(Handle a, Handle b);
+private:
+    Handle s_a;
+    Handle s_b;
+};
+
+template <typename Handle>
+struct basic_doc_group : public from_doc<pp_doc_group> {
+    basic_doc_group(Handle grouped);
+private:
+    Handle s_grouped;
+};
+
+template <typename Handle>
+struct basic_doc_concat : public from_doc<pp_doc_concat> {
+    basic_doc_concat(std::vector<Handle> docs);
+private:
+    std::vector<Handle> s_handles;
+    std::vector<const pp_doc*> s_docs;
+};
+
+template <typename Handle>
+struct basic_doc_fill : public basic_doc_concat<Handle> {
+    basic_doc_fill(std::vector<Handle> docs);
+};
+
+template <typename Handle>
+struct basic_doc_lazy : public from_doc<pp_doc_lazy> {
+    basic_doc_lazy(std::function<Handle()> make);
+private:
+    static const pp_doc* force(void* data, pp_ext_context* context);
+    static void release(void* data, const pp_doc* d);
+
+    std::function<Handle()> s_make;
+};
+
+
+typedef basic_doc_nest<std::shared_ptr<const doc>> doc_nest;
+typedef basic_doc_append<std::shared_ptr<const doc>> doc_append;
+typedef basic_doc_group<std::shared_ptr<const doc>> doc_group;
+typedef basic_doc_concat<std::shared_ptr<const doc>> doc_concat;
+typedef basic_doc_fill<std::shared_ptr<const doc>> doc_fill;
+typedef basic_doc_lazy<std::shared_ptr<const doc>> doc_lazy;
+
+}
+
+namespace impl {
+
+/**
+ * Create a document of type T with a single allocation from @p alloc.
+ */
+template <typename T, typename Alloc, typename... Args>
+std::shared_ptr<doc> allocate_doc(const Alloc& alloc, Args&&... args) {
+    auto t = std::allocate_shared<T>(alloc, std::forward<Args>(args)...);
+    doc* d = t->as_doc();
+    return std::shared_ptr<doc>(t, d);
+}
+
+}
+
+std::shared_ptr<doc> nil();
+
+std::shared_ptr<doc> sep();
+
+std::shared_ptr<doc> text(const char* t, size_t length);
+std::shared_ptr<doc> text(const char* str);
+std::shared_ptr<doc> text(const std::string& s);
+
+std::shared_ptr<doc> line();
+
+std::shared_ptr<doc> nest(size_t indent, std::shared_ptr<const doc> nested);
+
+std::shared_ptr<doc> append(std::shared_ptr<const doc> a, std::shared_ptr<const doc> b);
+
+std::shared_ptr<doc> group(std::shared_ptr<const doc> grouped);
+
+/** Concatenate all of @p docs in one document. */
+std::shared_ptr<doc> concat(std::vector<std::shared_ptr<const doc>> docs);
+std::shared_ptr<doc> concat(std::initializer_list<std::shared_ptr<const doc>> docs);
+
+/** Fill lines with @p docs, separated by spaces. @see _pp_fill */
+std::shared_ptr<doc> fill(std::vector<std::shared_ptr<const doc>> docs);
+std::shared_ptr<doc> fill(std::initializer_list<std::shared_ptr<const doc>> docs);
+
+/**
+ * A document made by @p make when it is rendered, and released once the
+ * render is done. @p make must not throw. @see pp_doc_lazy
+ */
+std::shared_ptr<doc> lazy(std::function<std::shared_ptr<const doc>()> make);
+
+std::shared_ptr<doc> words(const std::string& words);
+
+/** Variants of the above which allocate documents with @p alloc. */
+template <typename Alloc>
+std::shared_ptr<doc> text(std::allocator_arg_t, const Alloc& alloc, const char* t, size_t length) {
+    return impl::allocate_doc<data::doc_text>(alloc, t, length);
+}
+template <typename Alloc>
+std::shared_ptr<doc> text(std::allocator_arg_t, const Alloc& alloc, const char* str) {
+    return impl::allocate_doc<data::doc_text>(alloc, str);
+}
+template <typename Alloc>
+std::shared_ptr<doc> text(std::allocator_arg_t, const Alloc& alloc, const std::string& s) {
+    return impl::allocate_doc<data::doc_string>(alloc, s);
+}
+template <typename Alloc>
+std::shared_ptr<doc> nest(std::allocator_arg_t, const Alloc& alloc, size_t indent, std::shared_ptr<const doc> nested) {
+    return impl::allocate_doc<data::doc_nest>(alloc, indent, std::move(nested));
+}
+template <typename Alloc>
+std::shared_ptr<doc> append(std::allocator_arg_t, const Alloc& alloc, std::shared_ptr<const doc> a,
+        std::shared_ptr<const doc> b) {
+    return impl::allocate_doc<data::doc_append>(alloc, std::move(a), std::move(b));
+}
+template <typename Alloc>
+std::shared_ptr<doc> group(std::allocator_arg_t, const Alloc& alloc, std::shared_ptr<const doc> grouped) {
+    return impl::allocate_doc<data::doc_group>(alloc, std::move(grouped));
+}
+template <typename Alloc>
+std::shared_ptr<doc> concat(std::allocator_arg_t, const Alloc& alloc, std::vector<std::shared_ptr<const doc>> docs) {
+    return impl::allocate_doc<data::doc_concat>(alloc, std::move(docs));
+}
+template <typename Alloc>
+std::shared_ptr<doc> fill(std::allocator_arg_t, const Alloc& alloc, std::vector<std::shared_ptr<const doc>> docs) {
+    return impl::allocate_doc<data::doc_fill>(alloc, std::move(docs));
+}
+template <typename Alloc>
+std::shared_ptr<doc> lazy(std::allocator_arg_t, const Alloc& alloc, std::function<std::shared_ptr<const doc>()> make) {
+    return impl::allocate_doc<data::doc_lazy>(alloc, std::move(make));
+}
+
+/** Alias of append. */
+std::shared_ptr<doc> operator+(std::shared_ptr<const doc> a, std::shared_ptr<const doc> b);
+std::shared_ptr<doc> operator+(std::shared_ptr<const doc> a, const std::string& words);
+
+/** Aliases of append that add a separator. */
+std::shared_ptr<doc> operator<<(std::shared_ptr<const doc> a, std::shared_ptr<const doc> b);
+std::shared_ptr<doc> operator<<(std::shared_ptr<const doc> a, const std::string& words);
+
+template <typename T>
+std::shared_ptr<doc> operator<<(std::shared_ptr<const doc> a, T& b) {
+    std::stringstream str;
+    str << b;
+    return std::move(a) << str.str();
+}
+
+/**
+ * Builders for documents held by @p doc_ref.
+ */
+namespace local {
+
+doc_ref nil();
+
+doc_ref sep();
+
+doc_ref text(const char* t, size_t length);
+doc_ref text(const char* str);
+doc_ref text(const std::string& s);
+
+doc_ref line();
+
+doc_ref nest(size_t indent, doc_ref nested);
+
+doc_ref append(doc_ref a, doc_ref b);
+
+doc_ref group(doc_ref grouped);
+
+/** Concatenate all of @p docs in one document. */
+doc_ref concat(std::vector<doc_ref> docs);
+doc_ref concat(std::initializer_list<doc_ref> docs);
+
+/** Fill lines with @p docs, separated by spaces. @see _pp_fill */
+doc_ref fill(std::vector<doc_ref> docs);
+doc_ref fill(std::initializer_list<doc_ref> docs);
+
+/** A document made by @p make when it is rendered. @see pp::lazy */
+doc_ref lazy(std::function<doc_ref()> make);
+
+doc_ref words(const std::string& words);
+
+}
+
+/** Alias of append. */
+doc_ref operator+(doc_ref a, doc_ref b);
+doc_ref operator+(doc_ref a, const std::string& words);
+
+/** Aliases of append that add a separator. */
+doc_ref operator<<(doc_ref a, doc_ref b);
+doc_ref operator<<(doc_ref a, const std::string& words);
+
+template <typename T>
+doc_ref operator<<(doc_ref a, T& b) {
+    std::stringstream str;
+    str << b;
+    return std::move(a) << str.str();
+}
+
+/**
+ * Share a document built with @p doc_ref handles.
+ *
+ * The result may be used from any thread, and with the std::shared_ptr
+ * combinators. No other @p doc_ref to any part of the document may be used
+ * after this call, since their reference counts are not atomic.
+ */
+std::shared_ptr<const doc> freeze(doc_ref d);
+
+/** @} */
+
+/** @defgroup CXXPPAPI C++ Pretty-Printing API
+ *
+ * @{
+ */
+
+struct settings : public pp_settings {
+    settings();
+};
+
+struct change_settings {
+    static change_settings set_width(size_t width);
+    static change_settings set_max_indent(size_t indent);
+    static change_settings set_max_lines(size_t lines);
+    static change_settings set_max_bytes(size_t bytes);
+    static change_settings set_elision(const char* elision);
+    template <typename S>
+    static change_settings set_extension_evaluator(
+        pp_doc_type_t (*eval)(const S* settings, pp_doc_type_t type, doc** d)) {
+        change_settings s;
+        s.field = F_EXT_EVAL;
+        s.ext_eval = (pp_doc_type_t (*)(const settings*, pp_doc_type_t, doc**))eval;
+        return s;
+    }
+    template <typename S>
+    static change_settings set_extension_resolver(
+        const doc* (*resolve)(const S* settings, const doc* d, pp_ext_context* context)) {
+        change_settings s;
+        s.field = F_EXT_RESOLVE;
+        s.ext_resolve = (const doc* (*)(const settings*, const doc*, pp_ext_context*))resolve;
+        return s;
+    }
+
+private:
+    enum {
+        F_WIDTH,
+        F_MAX_INDENT,
+        F_MAX_LINES,
+        F_MAX_BYTES,
+        F_ELISION,
+        F_EXT_EVAL,
+        F_EXT_RESOLVE
+    } field;
+    union {
+        size_t width;
+        size_t max_indent;
+        size_t max_lines;
+        size_t max_bytes;
+        const char* elision;
+        pp_doc_type_t (*ext_eval)(const settings* s, pp_doc_type_t type, doc** d);
+        const doc* (*ext_resolve)(const settings* s, const doc* d, pp_ext_context* context);
+    };
+    change_settings();
+
+    friend settings& operator<<(settings& a, change_settings const& b);
+};
+
+change_settings set_width(size_t width);
+change_settings set_max_indent(size_t indent);
+change_settings set_max_lines(size_t lines);
+change_settings set_max_bytes(size_t bytes);
+change_settings set_elision(const char* elision);
+
+/**
+ * Allocate memory in an extension resolver, released once rendering is done.
+ */
+void* ext_alloc(pp_ext_context* context, size_t size);
+
+/**
+ * Copy text into a document in an extension resolver, released once rendering
+ * is done.
+ */
+const doc* ext_text(pp_ext_context* context, const char* text, size_t length);
+
+template <typename Settings>
+struct writer {
+    explicit writer(std::ostream& os)
+        : os(&os)
+    {}
+
+private:
+    Settings s;
+    std::ostream* os;
+
+    template <typename S2>
+    friend writer<S2>& operator<<(writer<S2>& w, change_settings const& s);
+    template <typename S2>
+    friend std::ostream& operator<<(writer<S2>& w, std::shared_ptr<const doc> d);
+    template <typename S2>
+    friend std::ostream& operator<<(writer<S2>& w, const doc_ref& d);
+};
+
+template <typename Settings>
+writer<Settings>& operator<<(writer<Settings>& w, change_settings const& s) {
+    w.s << s;
+    return w;
+}
+
+namespace impl {
+
+void write_out(std::ostream* os, pp_settings* s, std::shared_ptr<const doc> d);
+void write_out(std::ostream* os, pp_settings* s, const doc* d);
+
+}
+
+template <typename Settings>
+std::ostream& operator<<(writer<Settings>& w, std::shared_ptr<const doc> d) {
+    impl::write_out(w.os, static_cast<pp_settings*>(&w.s), d);
+    return *w.os;
+}
+
+template <typename Settings>
+std::ostream& operator<<(writer<Settings>& w, const doc_ref& d) {
+    impl::write_out(w.os, static_cast<pp_settings*>(&w.s), d.get());
+    return *w.os;
+}
+
+writer<settings> operator<<(std::ostream& os, change_settings s);
+std::ostream& operator<<(std::ostream& os, std::shared_ptr<doc> d);
+std::ostream& operator<<(std::ostream& os, const doc_ref& d);
+
+/**
+ * Pretty print a document to a string, sized with a single allocation.
+ */
+std::string to_string(std::shared_ptr<const doc> d, const pp_settings& s = settings());
+std::string to_string(const doc_ref& d, const pp_settings& s = settings());
+
+/** @} */
+
+}
+
+#endif
+
+#endif
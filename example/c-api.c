@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -54,21 +56,28 @@ enum {
     PP_DOC_FILTERED
 } doc_type_extensions_t;
 
+typedef struct {
+    pp_doc_type_t type;
+    pp_doc_text text;
+} pp_doc_owned_text;
+
 // Create an owned string which behaves like a text document but will be free'd
 // by the free_ext function.
 pp_doc* pp_owned_string(const char* text) {
-    pp_doc* d = pp_string(text);
+    pp_doc_owned_text* d = (pp_doc_owned_text*)malloc(sizeof(pp_doc_owned_text));
+    if (d == NULL) return NULL;
     d->type = PP_DOC_OWNED_TEXT;
-    return d;
+    _pp_text(&d->text, text, strlen(text));
+    return (pp_doc*)d;
 }
 
-// We can reuse a single pp_doc_text for times since the text values are only
-// being used to return text at pretty-print time.
-pp_doc_text _pp_time = { PP_DOC_TIME };
+// A single time document suffices since the text is made anew each time it
+// is pretty-printed.
+pp_doc _pp_time = { PP_DOC_TIME };
 
 // Create a document which displays the time when pretty-printed.
 pp_doc* pp_time() {
-    return (pp_doc*)&_pp_time;
+    return &_pp_time;
 }
 
 typedef struct {
@@ -93,37 +102,33 @@ typedef struct {
     int filter_value;
 } pp_settings_ext;
 
-pp_doc_type_t eval_ext(const pp_settings* settings, pp_doc_type_t tp, pp_doc** d) {
-    pp_settings_ext* ss = (pp_settings_ext*)settings;
-    switch (tp) {
+// Resolve extensions without modifying them, so that the documents may be
+// pretty-printed on several threads at once.
+const pp_doc* resolve_ext(const pp_settings* settings, const pp_doc* d, pp_ext_context* context) {
+    const pp_settings_ext* ss = (const pp_settings_ext*)settings;
+    switch (d->type) {
         case PP_DOC_OWNED_TEXT:
-            return PP_DOC_TEXT;
+            return (const pp_doc*)&((const pp_doc_owned_text*)d)->text;
         case PP_DOC_TIME:
             if (0) {}
+            char timestr[32];
             time_t tm = time(NULL);
-            char* timestr = ctime(&tm);
-            timestr[strlen(timestr)-1] = '\0'; // Get rid of ending newline
-            pp_doc_text* t = (pp_doc_text*)*d;
-            t->text = timestr;
-            t->length = strlen(timestr);
-            return PP_DOC_TEXT;
+            struct tm local;
+            size_t length = strftime(timestr, sizeof(timestr), "%a %b %e %H:%M:%S %Y", localtime_r(&tm, &local));
+            return pp_ext_text(context, timestr, length);
         case PP_DOC_FILTERED:
             if (0) {}
-            pp_doc_filtered* f = (pp_doc_filtered*)*d;
-            if (ss->filter_value >= f->v) {
-                *d = (pp_doc*)f->inner;
-                return (*d)->type;
-            }
-            else return PP_DOC_NIL;
+            const pp_doc_filtered* f = (const pp_doc_filtered*)d;
+            return ss->filter_value >= f->v ? f->inner : NULL;
         default:
-            return PP_DOC_NIL;
+            return NULL;
     }
 }
 
 void free_ext(pp_doc* d) {
     switch (d->type) {
         case PP_DOC_OWNED_TEXT:
-            free((char*)((pp_doc_text*)d)->text);
+            free((char*)((pp_doc_owned_text*)d)->text.text);
             break;
         case PP_DOC_FILTERED:
             pp_free_ext(free_ext, (pp_doc*)((pp_doc_filtered*)d)->inner);
@@ -142,7 +147,7 @@ void print_ext() {
     pp_settings_ext esettings = {0};
     esettings.s.width = 80;
     esettings.s.max_indent = 40;
-    esettings.s.evaluate_extension = eval_ext;
+    esettings.s.resolve_extension = resolve_ext;
     esettings.filter_value = 2;
 
     pp_doc* extensions = pp_appends(
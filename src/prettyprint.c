@@ -1,8 +1,23 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "prettyprint.h"
 #include "prettyprint_base.c"
 
@@ -14,63 +29,246 @@ pp_doc* pp_sep(void) {
     return _pp_sep;
 }
 
-pp_doc* pp_text(const char* text, size_t length) {
-    pp_doc_text* t = (pp_doc_text*)malloc(sizeof(pp_doc_text));
+/*
+ * Arenas hand out memory from a list of chunks. Reset rewinds to the first
+ * chunk so that the chunks are reused.
+ */
+
+#define PP_ARENA_CHUNK_SIZE 65536
+
+typedef union {
+    void* p;
+    size_t s;
+    long long l;
+    double d;
+} arena_align;
+
+typedef struct _pp_arena_chunk {
+    struct _pp_arena_chunk* next;
+    size_t size;
+    arena_align data[1];
+} arena_chunk;
+
+struct _pp_arena {
+    arena_chunk* first;
+    arena_chunk* current;
+    char* next;
+    char* end;
+    size_t chunk_size;
+};
+
+pp_arena* pp_arena_create(size_t chunk_size) {
+    pp_arena* a = (pp_arena*)malloc(sizeof(pp_arena));
+    if (a == NULL) return NULL;
+    a->first = a->current = NULL;
+    a->next = a->end = NULL;
+    a->chunk_size = chunk_size == 0 ? PP_ARENA_CHUNK_SIZE : chunk_size;
+    return a;
+}
+
+void pp_arena_reset(pp_arena* a) {
+    a->current = a->first;
+    a->next = a->first == NULL ? NULL : (char*)a->first->data;
+    a->end = a->first == NULL ? NULL : a->next + a->first->size;
+}
+
+void pp_arena_destroy(pp_arena* a) {
+    if (a == NULL) return;
+    arena_chunk* c = a->first;
+    while (c != NULL) {
+        arena_chunk* next = c->next;
+        free(c);
+        c = next;
+    }
+    free(a);
+}
+
+static void* arena_alloc(pp_arena* a, size_t size) {
+    size = (size + sizeof(arena_align) - 1) / sizeof(arena_align) * sizeof(arena_align);
+    if (size > (size_t)(a->end - a->next)) {
+        arena_chunk* c = a->current == NULL ? a->first : a->current->next;
+        if (c == NULL || c->size < size) {
+            // Oversized requests get a chunk to themselves.
+            size_t csize = size > a->chunk_size ? size : a->chunk_size;
+            arena_chunk* n = (arena_chunk*)malloc(offsetof(arena_chunk, data) + csize);
+            if (n == NULL) return NULL;
+            n->size = csize;
+            n->next = c;
+            if (a->current == NULL) a->first = n;
+            else a->current->next = n;
+            c = n;
+        }
+        a->current = c;
+        a->next = (char*)c->data;
+        a->end = a->next + c->size;
+    }
+    void* result = a->next;
+    a->next += size;
+    return result;
+}
+
+// Allocate a document from the arena, or with malloc if it is NULL.
+static void* doc_alloc(pp_arena* a, size_t size) {
+    return a == NULL ? malloc(size) : arena_alloc(a, size);
+}
+
+static pp_doc* doc_text(pp_arena* a, const char* text, size_t length) {
+    pp_doc_text* t = (pp_doc_text*)doc_alloc(a, sizeof(pp_doc_text));
     if (t == NULL) return NULL;
     _pp_text(t, text, length);
     return (pp_doc*)t;
 }
 
-pp_doc* pp_line(void) {
-    return _pp_line;
-}
-
-pp_doc* pp_nest(size_t indent, const pp_doc* nested) {
-    pp_doc_nest* n = (pp_doc_nest*)malloc(sizeof(pp_doc_nest));
+static pp_doc* doc_nest(pp_arena* a, size_t indent, const pp_doc* nested) {
+    pp_doc_nest* n = (pp_doc_nest*)doc_alloc(a, sizeof(pp_doc_nest));
     if (n == NULL) return NULL;
     _pp_nest(n, indent, nested);
     return (pp_doc*)n;
 }
 
-pp_doc* pp_append(const pp_doc* restrict a, const pp_doc* restrict b) {
-    pp_doc_append* d = (pp_doc_append*)malloc(sizeof(pp_doc_append));
+static pp_doc* doc_append(pp_arena* arena, const pp_doc* restrict a, const pp_doc* restrict b) {
+    pp_doc_append* d = (pp_doc_append*)doc_alloc(arena, sizeof(pp_doc_append));
     if (d == NULL) return NULL;
     _pp_append(d, a, b);
     return (pp_doc*)d;
-
 }
 
-pp_doc* pp_group(const pp_doc* i) {
-    pp_doc_group* d = (pp_doc_group*)malloc(sizeof(pp_doc_group));
+static pp_doc* doc_group(pp_arena* a, const pp_doc* i) {
+    pp_doc_group* d = (pp_doc_group*)doc_alloc(a, sizeof(pp_doc_group));
     if (d == NULL) return NULL;
     _pp_group(d, i);
     return (pp_doc*)d;
 }
 
+// Concatenations are allocated together with their array of documents, which
+// is left for the caller to fill in.
+static pp_doc_concat* doc_concat_alloc(pp_arena* a, size_t count) {
+    pp_doc_concat* d = (pp_doc_concat*)doc_alloc(a, sizeof(pp_doc_concat) + count * sizeof(const pp_doc*));
+    if (d == NULL) return NULL;
+    _pp_concat(d, (const pp_doc* const*)(d + 1), count);
+    return d;
+}
+
+static pp_doc* doc_concat(pp_arena* a, const pp_doc* const* docs, size_t count) {
+    pp_doc_concat* d = doc_concat_alloc(a, count);
+    if (d == NULL) return NULL;
+    if (count > 0) memcpy(d + 1, docs, count * sizeof(const pp_doc*));
+    return (pp_doc*)d;
+}
+
+static pp_doc* doc_fill(pp_arena* a, const pp_doc* const* docs, size_t count) {
+    pp_doc_concat* d = (pp_doc_concat*)doc_concat(a, docs, count);
+    if (d == NULL) return NULL;
+    _pp_fill(d, d->docs, count);
+    return (pp_doc*)d;
+}
+
+static pp_doc* doc_lazy(pp_arena* a, const pp_doc* (*force)(void* data, pp_ext_context* context),
+        void (*release)(void* data, const pp_doc* d), void* data) {
+    pp_doc_lazy* l = (pp_doc_lazy*)doc_alloc(a, sizeof(pp_doc_lazy));
+    if (l == NULL) return NULL;
+    _pp_lazy(l, force, release, data);
+    return (pp_doc*)l;
+}
+
+pp_doc* pp_text(const char* text, size_t length) {
+    return doc_text(NULL, text, length);
+}
+
+pp_doc* pp_line(void) {
+    return _pp_line;
+}
+
+pp_doc* pp_nest(size_t indent, const pp_doc* nested) {
+    return doc_nest(NULL, indent, nested);
+}
+
+pp_doc* pp_append(const pp_doc* restrict a, const pp_doc* restrict b) {
+    return doc_append(NULL, a, b);
+}
+
+pp_doc* pp_group(const pp_doc* i) {
+    return doc_group(NULL, i);
+}
+
+pp_doc* pp_concat(const pp_doc* const* docs, size_t count) {
+    return doc_concat(NULL, docs, count);
+}
+
+pp_doc* pp_fill(const pp_doc* const* docs, size_t count) {
+    return doc_fill(NULL, docs, count);
+}
+
+pp_doc* pp_lazy(const pp_doc* (*force)(void* data, pp_ext_context* context),
+        void (*release)(void* data, const pp_doc* d), void* data) {
+    return doc_lazy(NULL, force, release, data);
+}
+
+pp_doc* pp_arena_text(pp_arena* a, const char* text, size_t length) {
+    return doc_text(a, text, length);
+}
+
+pp_doc* pp_arena_nest(pp_arena* a, size_t indent, const pp_doc* nested) {
+    return doc_nest(a, indent, nested);
+}
+
+pp_doc* pp_arena_append(pp_arena* arena, const pp_doc* restrict a, const pp_doc* restrict b) {
+    return doc_append(arena, a, b);
+}
+
+pp_doc* pp_arena_group(pp_arena* a, const pp_doc* d) {
+    return doc_group(a, d);
+}
+
+pp_doc* pp_arena_concat(pp_arena* a, const pp_doc* const* docs, size_t count) {
+    return doc_concat(a, docs, count);
+}
+
+pp_doc* pp_arena_fill(pp_arena* a, const pp_doc* const* docs, size_t count) {
+    return doc_fill(a, docs, count);
+}
+
+pp_doc* pp_arena_lazy(pp_arena* a, const pp_doc* (*force)(void* data, pp_ext_context* context),
+        void (*release)(void* data, const pp_doc* d), void* data) {
+    return doc_lazy(a, force, release, data);
+}
+
 void pp_free(pp_doc* d) {
     pp_free_ext(NULL, d);
 }
 
 void pp_free_ext(void (*free_ext)(pp_doc* d), pp_doc* d) {
-    if (d->type >= PP_DOC_EXTENSION_START) {
-        if (free_ext != NULL)
-            free_ext(d);
-        return;
-    }
-    else {
+    // Continue with the last child iteratively so that long (right-leaning)
+    // append chains do not recurse.
+    while (d != NULL) {
+        pp_doc* next = NULL;
+        if (d->type >= PP_DOC_EXTENSION_START) {
+            if (free_ext != NULL)
+                free_ext(d);
+            return;
+        }
         switch (d->type) {
             case PP_DOC_TEXT:
+            case PP_DOC_WORDS:
+            case PP_DOC_LAZY:
                 break;
             case PP_DOC_NEST:
-                pp_free_ext(free_ext, (pp_doc*)DOCAS(d,nest)->nested);
+                next = (pp_doc*)DOCAS(d,nest)->nested;
                 break;
             case PP_DOC_APPEND:
                 pp_free_ext(free_ext, (pp_doc*)DOCAS(d,append)->a);
-                pp_free_ext(free_ext, (pp_doc*)DOCAS(d,append)->b);
+                next = (pp_doc*)DOCAS(d,append)->b;
                 break;
             case PP_DOC_GROUP:
-                pp_free_ext(free_ext, (pp_doc*)DOCAS(d,group)->grouped);
+                next = (pp_doc*)DOCAS(d,group)->grouped;
                 break;
+            case PP_DOC_CONCAT:
+            case PP_DOC_FILL: {
+                const pp_doc_concat* c = DOCAS(d,concat);
+                for (size_t i = 0; i + 1 < c->count; i++) pp_free_ext(free_ext, (pp_doc*)c->docs[i]);
+                if (c->count > 0) next = (pp_doc*)c->docs[c->count - 1];
+                break;
+            }
             case PP_DOC_NIL:
             case PP_DOC_SEP:
             case PP_DOC_LINE:
@@ -78,6 +276,7 @@ void pp_free_ext(void (*free_ext)(pp_doc* d), pp_doc* d) {
                 return;
         }
         free(d);
+        d = next;
     }
 }
 
@@ -85,69 +284,1221 @@ pp_doc* pp_string(const char* str) {
     return pp_text(str, strlen(str));
 }
 
+pp_doc* pp_arena_string(pp_arena* a, const char* str) {
+    return doc_text(a, str, strlen(str));
+}
+
+static pp_doc* words(pp_arena* a, const char* text) {
+    pp_doc_words* w = (pp_doc_words*)doc_alloc(a, sizeof(pp_doc_words));
+    if (w == NULL) return NULL;
+    _pp_words(w, text, strlen(text));
+    return (pp_doc*)w;
+}
+
 pp_doc* pp_words(const char* text) {
-    const char* start = text;
-    while (*text != '\0' && *text != ' ' && *text != '\n') text++;
-    if (*text == '\0') {
-        if (start == text) return pp_nil();
-        return pp_text(start, text - start);
-    }
-    else {
-        pp_doc* rest = pp_words(text+1);
-        if (rest == NULL) return NULL;
-
-        pp_doc* s;
-        if (*text == '\n') s = pp_line();
-        else s = pp_sep();
-        
-        pp_doc* srest = pp_append(s, rest);
-        if (srest == NULL) {
-            pp_free(rest);
-            pp_free(s);
+    return words(NULL, text);
+}
+
+pp_doc* pp_arena_words(pp_arena* a, const char* text) {
+    return words(a, text);
+}
+
+static pp_doc* appends_impl(pp_arena* a, va_list* args) {
+    va_list count_args;
+    va_copy(count_args, *args);
+    size_t count = 0;
+    while (va_arg(count_args, pp_doc*) != NULL) count++;
+    va_end(count_args);
+
+    pp_doc_concat* d = doc_concat_alloc(a, count);
+    if (d == NULL) return NULL;
+    const pp_doc** docs = (const pp_doc**)(d + 1);
+    for (size_t i = 0; i < count; i++) docs[i] = va_arg(*args, pp_doc*);
+    return (pp_doc*)d;
+}
+
+pp_doc* pp_appends_impl(size_t list_end, ...) {
+    va_list args;
+    va_start(args, list_end);
+    pp_doc* res = appends_impl(NULL, &args);
+    va_end(args);
+    return res;
+}
+
+pp_doc* pp_arena_appends_impl(pp_arena* a, ...) {
+    va_list args;
+    va_start(args, a);
+    pp_doc* res = appends_impl(a, &args);
+    va_end(args);
+    return res;
+}
+
+/*
+ * Interners hash-cons documents into an open-addressed table of the interned
+ * documents and their hashes. Documents are compared by their text, or by
+ * their fields and the addresses of their children, so a composite document
+ * is only equal to another built from the same (interned) children.
+ */
+
+typedef struct {
+    const pp_doc* doc;
+    size_t hash;
+} intern_slot;
+
+struct _pp_interner {
+    pp_arena* arena;
+    intern_slot* slots;
+    size_t count;
+    size_t capacity;
+    pp_measure_table measure;
+    // Scratch space for measuring.
+    render_stack stack;
+    measure_values values;
+};
+
+pp_interner* pp_interner_create(size_t chunk_size) {
+    pp_interner* in = (pp_interner*)calloc(1, sizeof(pp_interner));
+    if (in == NULL) return NULL;
+    in->arena = pp_arena_create(chunk_size);
+    if (in->arena == NULL) {
+        free(in);
+        return NULL;
+    }
+    in->stack.growable = 1;
+    return in;
+}
+
+void pp_interner_destroy(pp_interner* in) {
+    if (in == NULL) return;
+    pp_arena_destroy(in->arena);
+    free(in->slots);
+    free(in->measure.entries);
+    if (in->stack.owned) free(in->stack.frames);
+    free(in->values.values);
+    free(in);
+}
+
+const pp_measure_table* pp_interner_measure(const pp_interner* in) {
+    return &in->measure;
+}
+
+static size_t intern_mix(size_t h, size_t v) {
+    h = (h ^ v) * (size_t)0x100000001b3ull;
+    return h ^ (h >> 29);
+}
+
+static size_t intern_hash_text(size_t h, const char* text, size_t length) {
+    for (size_t i = 0; i < length; i++) h = (h ^ (unsigned char)text[i]) * (size_t)0x100000001b3ull;
+    return intern_mix(h, length);
+}
+
+static size_t intern_hash(const pp_doc* d) {
+    size_t h = intern_mix((size_t)0xcbf29ce484222325ull, d->type);
+    switch (d->type) {
+        case PP_DOC_TEXT:
+            return intern_hash_text(h, DOCAS(d,text)->text, DOCAS(d,text)->length);
+        case PP_DOC_WORDS:
+            return intern_hash_text(h, DOCAS(d,words)->text, DOCAS(d,words)->length);
+        case PP_DOC_NEST:
+            return intern_mix(intern_mix(h, DOCAS(d,nest)->indent), (size_t)DOCAS(d,nest)->nested);
+        case PP_DOC_APPEND:
+            return intern_mix(intern_mix(h, (size_t)DOCAS(d,append)->a), (size_t)DOCAS(d,append)->b);
+        case PP_DOC_GROUP:
+            return intern_mix(h, (size_t)DOCAS(d,group)->grouped);
+        case PP_DOC_CONCAT:
+        case PP_DOC_FILL:
+            for (size_t i = 0; i < DOCAS(d,concat)->count; i++) h = intern_mix(h, (size_t)DOCAS(d,concat)->docs[i]);
+            return intern_mix(h, DOCAS(d,concat)->count);
+        default:
+            return h;
+    }
+}
+
+static int intern_equal(const pp_doc* restrict a, const pp_doc* restrict b) {
+    if (a->type != b->type) return 0;
+    switch (a->type) {
+        case PP_DOC_TEXT:
+            return DOCAS(a,text)->length == DOCAS(b,text)->length
+                && memcmp(DOCAS(a,text)->text, DOCAS(b,text)->text, DOCAS(a,text)->length) == 0;
+        case PP_DOC_WORDS:
+            return DOCAS(a,words)->length == DOCAS(b,words)->length
+                && memcmp(DOCAS(a,words)->text, DOCAS(b,words)->text, DOCAS(a,words)->length) == 0;
+        case PP_DOC_NEST:
+            return DOCAS(a,nest)->indent == DOCAS(b,nest)->indent && DOCAS(a,nest)->nested == DOCAS(b,nest)->nested;
+        case PP_DOC_APPEND:
+            return DOCAS(a,append)->a == DOCAS(b,append)->a && DOCAS(a,append)->b == DOCAS(b,append)->b;
+        case PP_DOC_GROUP:
+            return DOCAS(a,group)->grouped == DOCAS(b,group)->grouped;
+        case PP_DOC_CONCAT:
+        case PP_DOC_FILL:
+            return DOCAS(a,concat)->count == DOCAS(b,concat)->count && (DOCAS(a,concat)->count == 0
+                    || memcmp(DOCAS(a,concat)->docs, DOCAS(b,concat)->docs,
+                        DOCAS(a,concat)->count * sizeof(const pp_doc*)) == 0);
+        default:
+            return 0;
+    }
+}
+
+// Copy a document into the arena, with its text.
+static pp_doc* intern_copy(pp_arena* restrict a, const pp_doc* restrict key) {
+    switch (key->type) {
+        case PP_DOC_TEXT: {
+            size_t length = DOCAS(key,text)->length;
+            pp_doc_text* t = (pp_doc_text*)arena_alloc(a, sizeof(pp_doc_text) + length);
+            if (t == NULL) return NULL;
+            if (length > 0) memcpy(t + 1, DOCAS(key,text)->text, length);
+            _pp_text(t, (const char*)(t + 1), length);
+            return (pp_doc*)t;
+        }
+        case PP_DOC_WORDS: {
+            size_t length = DOCAS(key,words)->length;
+            pp_doc_words* w = (pp_doc_words*)arena_alloc(a, sizeof(pp_doc_words) + length);
+            if (w == NULL) return NULL;
+            if (length > 0) memcpy(w + 1, DOCAS(key,words)->text, length);
+            _pp_words(w, (const char*)(w + 1), length);
+            return (pp_doc*)w;
+        }
+        case PP_DOC_NEST:
+            return doc_nest(a, DOCAS(key,nest)->indent, DOCAS(key,nest)->nested);
+        case PP_DOC_APPEND:
+            return doc_append(a, DOCAS(key,append)->a, DOCAS(key,append)->b);
+        case PP_DOC_GROUP:
+            return doc_group(a, DOCAS(key,group)->grouped);
+        case PP_DOC_CONCAT:
+            return doc_concat(a, DOCAS(key,concat)->docs, DOCAS(key,concat)->count);
+        case PP_DOC_FILL:
+            return doc_fill(a, DOCAS(key,fill)->docs, DOCAS(key,fill)->count);
+        default:
             return NULL;
+    }
+}
+
+static int intern_grow(pp_interner* in) {
+    size_t capacity = in->capacity == 0 ? 64 : in->capacity * 2;
+    intern_slot* slots = (intern_slot*)calloc(capacity, sizeof(intern_slot));
+    if (slots == NULL) return 0;
+    for (size_t i = 0; i < in->capacity; i++) {
+        if (in->slots[i].doc == NULL) continue;
+        size_t j = in->slots[i].hash & (capacity - 1);
+        while (slots[j].doc != NULL) j = (j + 1) & (capacity - 1);
+        slots[j] = in->slots[i];
+    }
+    free(in->slots);
+    in->slots = slots;
+    in->capacity = capacity;
+    return 1;
+}
+
+// Find the interned document equal to key, interning a copy if there is none.
+static pp_doc* intern(pp_interner* restrict in, const pp_doc* restrict key) {
+    if (2 * (in->count + 1) > in->capacity && !intern_grow(in)) return NULL;
+    size_t hash = intern_hash(key);
+    size_t i = hash & (in->capacity - 1);
+    for (; in->slots[i].doc != NULL; i = (i + 1) & (in->capacity - 1)) {
+        if (in->slots[i].hash == hash && intern_equal(in->slots[i].doc, key)) return (pp_doc*)in->slots[i].doc;
+    }
+    pp_doc* d = intern_copy(in->arena, key);
+    if (d == NULL) return NULL;
+    in->slots[i].doc = d;
+    in->slots[i].hash = hash;
+    in->count++;
+    // The children of a new document have been measured already (unless
+    // they were not interned), so measuring it only combines their
+    // measurements.
+    pp_measure_entry e;
+    if (!measure_leaf(d, &e)) {
+        in->stack.size = 0;
+        in->values.size = 0;
+        if (measure(&in->stack, &in->values, &in->measure, NULL, d) < 0) return NULL;
+    }
+    return d;
+}
+
+pp_doc* pp_intern_text(pp_interner* in, const char* text, size_t length) {
+    pp_doc_text key;
+    _pp_text(&key, text, length);
+    return intern(in, (const pp_doc*)&key);
+}
+
+pp_doc* pp_intern_string(pp_interner* in, const char* str) {
+    return pp_intern_text(in, str, strlen(str));
+}
+
+pp_doc* pp_intern_words(pp_interner* in, const char* words) {
+    pp_doc_words key;
+    _pp_words(&key, words, strlen(words));
+    return intern(in, (const pp_doc*)&key);
+}
+
+pp_doc* pp_intern_nest(pp_interner* in, size_t indent, const pp_doc* nested) {
+    pp_doc_nest key;
+    _pp_nest(&key, indent, nested);
+    return intern(in, (const pp_doc*)&key);
+}
+
+pp_doc* pp_intern_append(pp_interner* in, const pp_doc* a, const pp_doc* b) {
+    pp_doc_append key;
+    _pp_append(&key, a, b);
+    return intern(in, (const pp_doc*)&key);
+}
+
+pp_doc* pp_intern_group(pp_interner* in, const pp_doc* d) {
+    pp_doc_group key;
+    _pp_group(&key, d);
+    return intern(in, (const pp_doc*)&key);
+}
+
+pp_doc* pp_intern_concat(pp_interner* in, const pp_doc* const* docs, size_t count) {
+    pp_doc_concat key;
+    _pp_concat(&key, docs, count);
+    return intern(in, (const pp_doc*)&key);
+}
+
+pp_doc* pp_intern_fill(pp_interner* in, const pp_doc* const* docs, size_t count) {
+    pp_doc_fill key;
+    _pp_fill(&key, docs, count);
+    return intern(in, (const pp_doc*)&key);
+}
+
+#define PP_BUFFER_SIZE 8192
+
+static void write_file(void* f, const char* text, size_t length) {
+    fwrite(text, 1, length, (FILE*)f);
+}
+
+static void write_fd(void* data, const char* text, size_t length) {
+    int fd = *(int*)data;
+    while (length > 0) {
+        ssize_t n = write(fd, text, length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        text += n;
+        length -= n;
+    }
+}
+
+// Buffered writers are allocated together with their buffer and, for file
+// descriptors, the descriptor the sink writes to.
+typedef struct {
+    pp_buffered_writer b;
+    int fd;
+} buffered_alloc;
+
+static pp_buffered_writer* buffered_init(buffered_alloc* a, size_t size, void (*write)(void*, const char*, size_t), void* data) {
+    if (a == NULL) return NULL;
+    pp_writer w;
+    w.data = data;
+    w.write = write;
+    _pp_buffered_writer(&a->b, (char*)(a + 1), size, &w);
+    return &a->b;
+}
+
+pp_buffered_writer* pp_buffered_file(FILE* f, size_t size) {
+    if (size == 0) size = PP_BUFFER_SIZE;
+    buffered_alloc* a = (buffered_alloc*)malloc(sizeof(buffered_alloc) + size);
+    return buffered_init(a, size, write_file, f);
+}
+
+pp_buffered_writer* pp_buffered_fd(int fd, size_t size) {
+    if (size == 0) size = PP_BUFFER_SIZE;
+    buffered_alloc* a = (buffered_alloc*)malloc(sizeof(buffered_alloc) + size);
+    if (a != NULL) a->fd = fd;
+    return buffered_init(a, size, write_fd, a == NULL ? NULL : &a->fd);
+}
+
+void pp_buffered_free(pp_buffered_writer* b) {
+    if (b == NULL) return;
+    _pp_buffered_flush(b);
+    free(b);
+}
+
+static void pretty_to(const pp_writer* restrict sink, const pp_settings* restrict settings,
+        const pp_measure_table* restrict measure, const pp_doc* restrict document) {
+    char buffer[PP_BUFFER_SIZE];
+    pp_buffered_writer b;
+    _pp_buffered_writer(&b, buffer, sizeof(buffer), sink);
+    _pp_pretty_measured(&b.writer, settings, measure, document);
+    _pp_buffered_flush(&b);
+}
+
+void pp_pretty(FILE* restrict f, const pp_settings* restrict settings, const pp_doc* restrict document) {
+    pp_writer w;
+    w.data = f;
+    w.write = write_file;
+    pretty_to(&w, settings, NULL, document);
+}
+
+void pp_pretty_measured(FILE* restrict f, const pp_settings* restrict settings, const pp_measure_table* restrict measure,
+        const pp_doc* restrict document) {
+    pp_writer w;
+    w.data = f;
+    w.write = write_file;
+    pretty_to(&w, settings, measure, document);
+}
+
+void pp_pretty_fd(int fd, const pp_settings* restrict settings, const pp_doc* restrict document) {
+    pp_writer w;
+    w.data = &fd;
+    w.write = write_fd;
+    pretty_to(&w, settings, NULL, document);
+}
+
+int pp_pretty_multi(const pp_settings* const* restrict settings, FILE* const* restrict files, size_t count,
+        const pp_doc* restrict document) {
+    pp_buffered_writer** buffered = (pp_buffered_writer**)calloc(count, sizeof(pp_buffered_writer*));
+    const pp_writer** writers = (const pp_writer**)malloc(count * sizeof(const pp_writer*));
+    int result = -1;
+    if (buffered == NULL || writers == NULL) goto done;
+    for (size_t i = 0; i < count; i++) {
+        if ((buffered[i] = pp_buffered_file(files[i], 0)) == NULL) goto done;
+        writers[i] = &buffered[i]->writer;
+    }
+    result = _pp_pretty_multi(settings, writers, count, document);
+
+done:
+    if (buffered != NULL) {
+        for (size_t i = 0; i < count; i++) pp_buffered_free(buffered[i]);
+        free(buffered);
+    }
+    free(writers);
+    return result;
+}
+
+/*
+ * Parallel rendering splits a document at its top-level lines: those reached
+ * from the root through nests, appends and concatenations alone. They are
+ * outside any group, so they always break, and what follows them is laid out
+ * the same whatever came before. The frames between such lines (the spine of
+ * the document) are rendered in chunks on several threads into buffers, which
+ * are written out in order.
+ */
+
+// Collect the spine of d into out, with the indent of each frame.
+static int spine_collect(render_stack* restrict pending, render_stack* restrict out, const pp_settings* restrict settings,
+        const pp_doc* restrict document) {
+    if (!stack_push(pending, document, 0, 0)) return -1;
+    while (pending->size > 0) {
+        pp_render_frame f = pending->frames[--pending->size];
+        const pp_doc* d = f.doc;
+        int ok = 1;
+        switch (d->type) {
+            case PP_DOC_NEST: {
+                size_t indent = f.indent + DOCAS(d,nest)->indent;
+                if (indent > settings->max_indent) indent = settings->max_indent;
+                ok = stack_push(pending, DOCAS(d,nest)->nested, indent, 0);
+                break;
+            }
+            case PP_DOC_APPEND:
+                ok = stack_push(pending, DOCAS(d,append)->b, f.indent, 0)
+                    && stack_push(pending, DOCAS(d,append)->a, f.indent, 0);
+                break;
+            case PP_DOC_CONCAT:
+                for (size_t i = DOCAS(d,concat)->count; ok && i > 0; i--)
+                    ok = stack_push(pending, DOCAS(d,concat)->docs[i - 1], f.indent, 0);
+                break;
+            default:
+                ok = stack_push(out, d, f.indent, 0);
+                break;
         }
+        if (!ok) return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    char* text;
+    size_t length;
+    size_t capacity;
+    int failed;
+} chunk_buffer;
 
-        pp_doc* t = pp_text(start, text - start);
+static void chunk_write(void* data, const char* text, size_t length) {
+    chunk_buffer* b = (chunk_buffer*)data;
+    if (b->failed || length == 0) return;
+    if (length > b->capacity - b->length) {
+        size_t capacity = b->capacity == 0 ? PP_BUFFER_SIZE : b->capacity * 2;
+        while (capacity - b->length < length) capacity *= 2;
+        char* t = (char*)realloc(b->text, capacity);
         if (t == NULL) {
-            pp_free(srest);
+            b->failed = 1;
+            return;
+        }
+        b->text = t;
+        b->capacity = capacity;
+    }
+    memcpy(b->text + b->length, text, length);
+    b->length += length;
+}
+
+typedef struct {
+    const pp_settings* settings;
+    const pp_render_frame* frames;
+    // The first frame of each chunk, and the end of the last.
+    const size_t* starts;
+    size_t count;
+    chunk_buffer* buffers;
+    // The next chunk to render, taken atomically.
+    size_t next;
+    int failed;
+} parallel_render;
+
+// Render the spine frames from start to end into b.
+static int render_chunk(const pp_settings* restrict settings, const pp_render_frame* restrict frames, size_t start,
+        size_t end, chunk_buffer* restrict b) {
+    pp_writer w = { chunk_write, b };
+    pp_render_frame stack[64];
+    render_stack s = { stack, 0, sizeof(stack) / sizeof(stack[0]), 1, 0 };
+    pp_ext_context ext = { NULL, NULL, NULL, NULL, 0, 0, NULL, NULL };
+    render_state st;
+    render_init(&st, &w, settings, NULL, &ext);
+    // Chunks are rendered whole; output limits apply to a render from the
+    // start of the document only.
+    st.bytes_left = (size_t)-1;
+    st.lines_left = (size_t)-1;
+    // Every chunk but the first starts with a top-level line, which sets the
+    // remaining width.
+    int ok = 1;
+    for (size_t j = end - 1; ok && j > start; j--) ok = stack_push(&s, frames[j].doc, frames[j].indent, 0);
+    if (!ok || render(&s, &st, frames[start]) < 0 || b->failed) ok = 0;
+    if (s.owned) free(s.frames);
+    ext_context_free(&ext);
+    return ok ? 0 : -1;
+}
+
+static void* parallel_worker(void* data) {
+    parallel_render* p = (parallel_render*)data;
+    for (;;) {
+        size_t i = __sync_fetch_and_add(&p->next, 1);
+        if (i >= p->count) return NULL;
+        if (render_chunk(p->settings, p->frames, p->starts[i], p->starts[i + 1], &p->buffers[i]) < 0)
+            __sync_fetch_and_or(&p->failed, 1);
+    }
+}
+
+int _pp_pretty_parallel(const pp_writer* restrict writer, const pp_settings* restrict settings,
+        const pp_doc* restrict document, size_t threads) {
+    if (threads == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (size_t)n : 1;
+    }
+    // Extensions evaluated in place may not be evaluated on several threads.
+    // A render with output limits stops early, which only a serial render
+    // can do.
+    if (threads == 1 || (settings->evaluate_extension != NULL && settings->resolve_extension == NULL) ||
+            settings->max_lines != 0 || settings->max_bytes != 0) {
+        _pp_pretty(writer, settings, document);
+        return 0;
+    }
+
+    int result = -1;
+    size_t count = 0;
+    render_stack pending = { NULL, 0, 0, 1, 0 };
+    render_stack spine = { NULL, 0, 0, 1, 0 };
+    size_t* starts = NULL;
+    chunk_buffer* buffers = NULL;
+    pthread_t* workers = NULL;
+    if (spine_collect(&pending, &spine, settings, document) < 0) goto done;
+
+    // Divide the spine at top-level lines into a few chunks per thread, of
+    // roughly equal numbers of frames, so that a thread that finishes early
+    // takes more. On one processor, 1 to 16 chunks per thread cost the same
+    // within noise; the cost of holding the output doesn't depend on it.
+    size_t target = spine.size / (threads * 4) + 1;
+    starts = (size_t*)malloc((threads * 4 + 2) * sizeof(size_t));
+    if (starts == NULL) goto done;
+    starts[count++] = 0;
+    for (size_t i = 1; i < spine.size; i++) {
+        if (spine.frames[i].doc->type == PP_DOC_LINE && i - starts[count - 1] >= target && count < threads * 4)
+            starts[count++] = i;
+    }
+    starts[count] = spine.size;
+    if (count == 1) {
+        _pp_pretty(writer, settings, document);
+        result = 0;
+        goto done;
+    }
+
+    buffers = (chunk_buffer*)calloc(count, sizeof(chunk_buffer));
+    workers = (pthread_t*)malloc((threads - 1) * sizeof(pthread_t));
+    if (buffers == NULL || workers == NULL) goto done;
+    parallel_render p = { settings, spine.frames, starts, count, buffers, 0, 0 };
+    // The calling thread renders too, so chunks are rendered even if no
+    // threads can be started.
+    size_t started = 0;
+    while (started < threads - 1 && started + 1 < count
+            && pthread_create(&workers[started], NULL, parallel_worker, &p) == 0)
+        started++;
+    parallel_worker(&p);
+    for (size_t i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    if (p.failed) goto done;
+    for (size_t i = 0; i < count; i++) writer->write(writer->data, buffers[i].text, buffers[i].length);
+    result = 0;
+
+done:
+    if (buffers != NULL) {
+        for (size_t i = 0; i < count; i++) free(buffers[i].text);
+        free(buffers);
+    }
+    free(workers);
+    free(starts);
+    free(pending.frames);
+    free(spine.frames);
+    return result;
+}
+
+int pp_pretty_parallel(FILE* restrict f, const pp_settings* restrict settings, const pp_doc* restrict document,
+        size_t threads) {
+    pp_writer w;
+    w.data = f;
+    w.write = write_file;
+    char buffer[PP_BUFFER_SIZE];
+    pp_buffered_writer b;
+    _pp_buffered_writer(&b, buffer, sizeof(buffer), &w);
+    int result = _pp_pretty_parallel(&b.writer, settings, document, threads);
+    _pp_buffered_flush(&b);
+    return result;
+}
+
+/*
+ * Parallel measurement divides a document breadth first into subtrees near
+ * its root, which threads take in turn and measure into tables of their own.
+ * The same threads then merge their tables into one large enough for all of
+ * them, claiming slots with compare-and-swap, and the few documents above the
+ * subtrees are measured last, finding their children already measured.
+ */
+
+typedef struct {
+    // The subtrees to measure (and then the tables to merge), and the next
+    // to take, atomically.
+    const pp_render_frame* tasks;
+    size_t count;
+    size_t next;
+    // The table of each thread, and the table they are merged into.
+    pp_measure_table* tables;
+    pp_measure_table* merged;
+    int failed;
+} parallel_measure;
+
+typedef struct {
+    parallel_measure* p;
+    size_t index;
+} measure_worker;
+
+static void* measure_subtrees(void* data) {
+    measure_worker* w = (measure_worker*)data;
+    parallel_measure* p = w->p;
+    pp_render_frame frames[64];
+    render_stack s = { frames, 0, sizeof(frames) / sizeof(frames[0]), 1, 0 };
+    measure_values v = { NULL, 0, 0 };
+    for (;;) {
+        size_t i = __sync_fetch_and_add(&p->next, 1);
+        if (i >= p->count) break;
+        if (measure(&s, &v, &p->tables[w->index], NULL, p->tasks[i].doc) < 0) {
+            __sync_fetch_and_or(&p->failed, 1);
+            break;
+        }
+        v.size = 0;
+    }
+    if (s.owned) free(s.frames);
+    free(v.values);
+    return NULL;
+}
+
+static void* measure_merge(void* data) {
+    parallel_measure* p = ((measure_worker*)data)->p;
+    pp_measure_table* m = p->merged;
+    size_t added = 0;
+    for (;;) {
+        size_t k = __sync_fetch_and_add(&p->next, 1);
+        if (k >= p->count) break;
+        const pp_measure_table* t = &p->tables[k];
+        for (size_t i = 0; i < t->capacity; i++) {
+            const pp_measure_entry* e = &t->entries[i];
+            if (e->doc == NULL) continue;
+            // Subtrees shared between documents may have been measured by
+            // more than one thread, with the same result.
+            for (size_t j = measure_hash(e->doc, m->capacity);; j = (j + 1) & (m->capacity - 1)) {
+                const pp_doc* found = __sync_val_compare_and_swap(&m->entries[j].doc, (const pp_doc*)NULL, e->doc);
+                if (found == NULL) {
+                    m->entries[j].width = e->width;
+                    m->entries[j].trailing = e->trailing;
+                    m->entries[j].dynamic = e->dynamic;
+                    added++;
+                    break;
+                }
+                if (found == e->doc) break;
+            }
+        }
+    }
+    __sync_fetch_and_add(&m->count, added);
+    return NULL;
+}
+
+// Run f on the calling thread and up to threads - 1 others, each with its own
+// index (and so table). Returns the number of threads that ran.
+static size_t measure_run(void* (*f)(void*), parallel_measure* p, measure_worker* workers, pthread_t* ids,
+        size_t threads) {
+    size_t started = 0;
+    for (size_t i = 0; i < threads; i++) {
+        workers[i].p = p;
+        workers[i].index = i;
+    }
+    while (started + 1 < threads && pthread_create(&ids[started], NULL, f, &workers[started + 1]) == 0)
+        started++;
+    f(&workers[0]);
+    for (size_t i = 0; i < started; i++) pthread_join(ids[i], NULL);
+    return started + 1;
+}
+
+pp_measure_table* pp_measure_parallel(const pp_doc* document, size_t threads) {
+    if (threads == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (size_t)n : 1;
+    }
+    if (threads == 1) return pp_measure(document);
+
+    // Expand documents from the root until there are a few subtrees per
+    // thread, giving up on documents (such as long chains of appends) too
+    // narrow to divide. Documents without children aren't measured. On one
+    // processor, 2 to 16 subtrees per thread take as long as pp_measure
+    // within noise.
+    render_stack pending = { NULL, 0, 0, 1, 0 };
+    size_t head = 0;
+    size_t target = threads * 8;
+    pp_measure_entry leaf;
+    if (!measure_leaf(document, &leaf) && !stack_push(&pending, document, 0, 0)) return NULL;
+    while (head < pending.size && pending.size - head < target && head < target * 16) {
+        const pp_doc* d = pending.frames[head++].doc;
+        const pp_doc* children[2] = { NULL, NULL };
+        const pp_doc* const* docs = children;
+        size_t count = 1;
+        switch (d->type) {
+            case PP_DOC_NEST:
+                children[0] = DOCAS(d,nest)->nested;
+                break;
+            case PP_DOC_APPEND:
+                children[0] = DOCAS(d,append)->a;
+                children[1] = DOCAS(d,append)->b;
+                count = 2;
+                break;
+            case PP_DOC_GROUP:
+                children[0] = DOCAS(d,group)->grouped;
+                break;
+            default:
+                docs = DOCAS(d,concat)->docs;
+                count = DOCAS(d,concat)->count;
+                break;
+        }
+        int ok = 1;
+        for (size_t i = 0; ok && i < count; i++) {
+            if (!measure_leaf(docs[i], &leaf)) ok = stack_push(&pending, docs[i], 0, 0);
+        }
+        if (!ok) {
+            free(pending.frames);
             return NULL;
         }
+    }
+    if (pending.size - head < 2) {
+        free(pending.frames);
+        return pp_measure(document);
+    }
+
+    pp_measure_table* m = (pp_measure_table*)calloc(1, sizeof(pp_measure_table));
+    pp_measure_table* tables = (pp_measure_table*)calloc(threads, sizeof(pp_measure_table));
+    measure_worker* workers = (measure_worker*)malloc(threads * sizeof(measure_worker));
+    pthread_t* ids = (pthread_t*)malloc((threads - 1) * sizeof(pthread_t));
+    int result = -1;
+    if (m == NULL || tables == NULL || workers == NULL || ids == NULL) goto done;
+    parallel_measure p = { pending.frames + head, pending.size - head, 0, tables, m, 0 };
+    size_t ran = measure_run(measure_subtrees, &p, workers, ids, threads);
+    if (p.failed) goto done;
+
+    // Size the merged table so that neither merging nor measuring the
+    // documents above the subtrees grows it.
+    size_t count = head;
+    for (size_t i = 0; i < ran; i++) count += tables[i].count;
+    size_t capacity = 64;
+    while (capacity < 2 * (count + 1)) capacity *= 2;
+    m->entries = (pp_measure_entry*)calloc(capacity, sizeof(pp_measure_entry));
+    if (m->entries == NULL) goto done;
+    m->capacity = capacity;
+    p.next = 0;
+    p.count = ran;
+    measure_run(measure_merge, &p, workers, ids, ran);
+
+    pp_render_frame frames[64];
+    render_stack s = { frames, 0, sizeof(frames) / sizeof(frames[0]), 1, 0 };
+    measure_values v = { NULL, 0, 0 };
+    result = measure(&s, &v, m, NULL, document);
+    if (s.owned) free(s.frames);
+    free(v.values);
+
+done:
+    if (tables != NULL) {
+        for (size_t i = 0; i < threads; i++) free(tables[i].entries);
+        free(tables);
+    }
+    free(workers);
+    free(ids);
+    free(pending.frames);
+    if (result < 0) {
+        pp_measure_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+/*
+ * Layouts keep the output of each chunk of the spine (the frames from a
+ * top-level line to the next) separately. Replacing a document copies the
+ * documents containing it, so that the frames of the spine that didn't change
+ * keep their documents, and only the chunks from the first changed frame to
+ * the last are rendered again. Each chunk also records the range of addresses
+ * of its documents, so that finding the document to replace only searches the
+ * chunks that may contain it (documents built together are usually allocated
+ * together).
+ */
+
+typedef struct {
+    // The first frame of the chunk in the spine.
+    size_t start;
+    chunk_buffer out;
+    // The offset of each line starting in the chunk, and the index of the
+    // first of them in the whole output.
+    size_t* lines;
+    size_t line_count;
+    size_t first_line;
+    // The lowest and highest addresses of the documents of the chunk, other
+    // than the shared nil, separator and line.
+    uintptr_t low;
+    uintptr_t high;
+} layout_chunk;
+
+struct _pp_layout {
+    const pp_settings* settings;
+    const pp_doc* document;
+    // The copies made by replacements.
+    pp_arena* arena;
+    render_stack spine;
+    layout_chunk* chunks;
+    size_t count;
+};
+
+static void layout_chunks_free(layout_chunk* chunks, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(chunks[i].out.text);
+        free(chunks[i].lines);
+    }
+    free(chunks);
+}
+
+static int layout_shared(const pp_doc* d) {
+    return d == _pp_nil || d == _pp_sep || d == _pp_line;
+}
+
+static int layout_may_contain(const layout_chunk* c, const pp_doc* d) {
+    return layout_shared(d) || ((uintptr_t)d >= c->low && (uintptr_t)d <= c->high);
+}
+
+// Push a document to search, with fill set if it is part of the spine.
+static int layout_push(render_stack* restrict s, const pp_doc* restrict d, int spine) {
+    if (!stack_push(s, d, 0, 0)) return 0;
+    s->frames[s->size - 1].fill = spine;
+    return 1;
+}
+
+// Push the children of d, returning 0 if the stack could not grow. Extensions
+// and lazy documents have none.
+static int layout_push_children(render_stack* restrict s, const pp_doc* restrict d, int spine) {
+    switch (d->type) {
+        case PP_DOC_NEST:
+            return layout_push(s, DOCAS(d,nest)->nested, spine);
+        case PP_DOC_APPEND:
+            return layout_push(s, DOCAS(d,append)->b, spine) && layout_push(s, DOCAS(d,append)->a, spine);
+        case PP_DOC_GROUP:
+            return layout_push(s, DOCAS(d,group)->grouped, spine);
+        case PP_DOC_CONCAT:
+        case PP_DOC_FILL:
+            for (size_t i = DOCAS(d,concat)->count; i > 0; i--) {
+                if (!layout_push(s, DOCAS(d,concat)->docs[i - 1], spine)) return 0;
+            }
+            return 1;
+        default:
+            return 1;
+    }
+}
+
+// Whether d is part of the spine above its frames.
+static int spine_inner(const pp_doc* d) {
+    return d->type == PP_DOC_NEST || d->type == PP_DOC_APPEND || d->type == PP_DOC_CONCAT;
+}
+
+static int layout_bounds(const render_stack* restrict spine, layout_chunk* restrict c, size_t end) {
+    pp_render_frame frames[64];
+    render_stack s = { frames, 0, sizeof(frames) / sizeof(frames[0]), 1, 0 };
+    int ok = 1;
+    c->low = UINTPTR_MAX;
+    c->high = 0;
+    for (size_t i = c->start; ok && i < end; i++) {
+        ok = stack_push(&s, spine->frames[i].doc, 0, 0);
+        while (ok && s.size > 0) {
+            const pp_doc* d = s.frames[--s.size].doc;
+            if (!layout_shared(d)) {
+                if ((uintptr_t)d < c->low) c->low = (uintptr_t)d;
+                if ((uintptr_t)d > c->high) c->high = (uintptr_t)d;
+            }
+            ok = layout_push_children(&s, d, 0);
+        }
+    }
+    if (s.owned) free(s.frames);
+    return ok ? 0 : -1;
+}
 
-        pp_doc* ret = pp_append(t, srest);
-        if (ret == NULL) {
-            pp_free(t);
-            pp_free(srest);
+// Render the frames of chunk c, ending at end, and find where its lines
+// start. Every chunk but the first starts with a line break.
+static int layout_render(const pp_settings* restrict settings, const render_stack* restrict spine,
+        layout_chunk* restrict c, size_t end) {
+    if (render_chunk(settings, spine->frames, c->start, end, &c->out) < 0 || layout_bounds(spine, c, end) < 0) return -1;
+    const char* text = c->out.text;
+    const char* text_end = text + c->out.length;
+    size_t n = c->start == 0 ? 1 : 0;
+    for (const char* p = text; p != text_end && (p = (const char*)memchr(p, '\n', text_end - p)) != NULL; p++) n++;
+    c->lines = (size_t*)malloc((n > 0 ? n : 1) * sizeof(size_t));
+    if (c->lines == NULL) return -1;
+    if (c->start == 0) c->lines[c->line_count++] = 0;
+    for (const char* p = text; p != text_end && (p = (const char*)memchr(p, '\n', text_end - p)) != NULL; p++)
+        c->lines[c->line_count++] = p + 1 - text;
+    return 0;
+}
+
+// Render the frames of the spine from start to end, divided at top-level
+// lines, into new chunks.
+static layout_chunk* layout_render_range(const pp_settings* restrict settings, const render_stack* restrict spine,
+        size_t start, size_t end, size_t* restrict count) {
+    size_t n = 0;
+    for (size_t i = start; i < end; i++) {
+        if (i == start || spine->frames[i].doc->type == PP_DOC_LINE) n++;
+    }
+    layout_chunk* chunks = (layout_chunk*)calloc(n > 0 ? n : 1, sizeof(layout_chunk));
+    if (chunks == NULL) return NULL;
+    n = 0;
+    for (size_t i = start; i < end; i++) {
+        if (i == start || spine->frames[i].doc->type == PP_DOC_LINE) chunks[n++].start = i;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (layout_render(settings, spine, &chunks[i], i + 1 < n ? chunks[i + 1].start : end) < 0) {
+            layout_chunks_free(chunks, n);
             return NULL;
         }
-        return ret;
     }
+    *count = n;
+    return chunks;
 }
 
-static pp_doc* appends_impl(va_list args) {
-    pp_doc* d = va_arg(args, pp_doc*);
-    if (d == NULL) return pp_nil();
+static void layout_number(pp_layout* l) {
+    size_t line = 0;
+    for (size_t i = 0; i < l->count; i++) {
+        l->chunks[i].first_line = line;
+        line += l->chunks[i].line_count;
+    }
+}
 
-    pp_doc* rest = appends_impl(args);
-    if (rest == NULL) return NULL;
-    return pp_append(d, rest);
+pp_layout* pp_layout_create(const pp_settings* restrict settings, const pp_doc* restrict document) {
+    pp_layout* l = (pp_layout*)calloc(1, sizeof(pp_layout));
+    if (l == NULL) return NULL;
+    l->settings = settings;
+    l->document = document;
+    l->spine.growable = 1;
+    render_stack pending = { NULL, 0, 0, 1, 0 };
+    int ok = spine_collect(&pending, &l->spine, settings, document) == 0
+        && (l->chunks = layout_render_range(settings, &l->spine, 0, l->spine.size, &l->count)) != NULL;
+    free(pending.frames);
+    if (!ok) {
+        pp_layout_free(l);
+        return NULL;
+    }
+    layout_number(l);
+    return l;
 }
 
-pp_doc* pp_appends_impl(size_t list_end, ...) {
-    va_list args;
-    va_start(args, list_end);
-    pp_doc* res = appends_impl(args);
-    va_end(args);
-    return res;
+void pp_layout_free(pp_layout* l) {
+    if (l == NULL) return;
+    if (l->chunks != NULL) layout_chunks_free(l->chunks, l->count);
+    free(l->spine.frames);
+    pp_arena_destroy(l->arena);
+    free(l);
 }
 
-static void write_file(void* f, const char* text, size_t length) {
-    fprintf((FILE*)f, "%.*s", length, text);
+/*
+ * Copy the documents of the layout's document that contain old (other than
+ * within extensions and lazy documents) into its arena, with old replaced.
+ * Children are rebuilt before their parents as in measure, with the rebuilt
+ * children on top of the value stack. The spine is walked in the order of its
+ * frames, and only the frames of chunks that may contain old are searched.
+ *
+ * Returns the document itself if it doesn't contain old, or NULL if memory
+ * could not be allocated.
+ */
+static const pp_doc* layout_rebuild(pp_layout* restrict l, const pp_doc* old, const pp_doc* replacement) {
+    pp_arena* a = l->arena;
+    pp_render_frame frames[64];
+    render_stack s = { frames, 0, sizeof(frames) / sizeof(frames[0]), 1, 0 };
+    render_stack values = { NULL, 0, 0, 1, 0 };
+    render_stack pending = { NULL, 0, 0, 1, 0 };
+    render_stack replaced = { NULL, 0, 0, 1, 0 };
+    const pp_doc* result = NULL;
+    // The next frame of the spine, and its chunk.
+    size_t frame = 0;
+    size_t chunk = 0;
+    if (!layout_push(&s, l->document, 1)) goto done;
+    while (s.size > 0) {
+        pp_render_frame f = s.frames[--s.size];
+        const pp_doc* d = f.doc;
+        if (!f.flat) {
+            int spine = f.fill && spine_inner(d);
+            int search = d != old && (d->type == PP_DOC_NEST || d->type == PP_DOC_APPEND || d->type == PP_DOC_GROUP
+                    || d->type == PP_DOC_CONCAT || d->type == PP_DOC_FILL);
+            if (f.fill && d == old && spine_inner(d)) {
+                // Replaced parts of the spine are passed over.
+                replaced.size = 0;
+                if (spine_collect(&pending, &replaced, l->settings, d) < 0) goto done;
+                frame += replaced.size;
+            }
+            else if (f.fill && !spine) {
+                while (chunk + 1 < l->count && l->chunks[chunk + 1].start <= frame) chunk++;
+                frame++;
+                search = search && l->count > 0 && layout_may_contain(&l->chunks[chunk], old);
+            }
+            if (search) {
+                if (!stack_push(&s, d, 0, 1) || !layout_push_children(&s, d, spine)) goto done;
+            }
+            else if (!stack_push(&values, d == old ? replacement : d, 0, 0)) goto done;
+            continue;
+        }
+
+        size_t children = 1;
+        if (d->type == PP_DOC_APPEND) children = 2;
+        else if (d->type == PP_DOC_CONCAT || d->type == PP_DOC_FILL) children = DOCAS(d,concat)->count;
+        values.size -= children;
+        const pp_render_frame* v = children > 0 ? &values.frames[values.size] : NULL;
+        switch (d->type) {
+            case PP_DOC_NEST:
+                if (v[0].doc != DOCAS(d,nest)->nested) d = doc_nest(a, DOCAS(d,nest)->indent, v[0].doc);
+                break;
+            case PP_DOC_APPEND:
+                if (v[0].doc != DOCAS(d,append)->a || v[1].doc != DOCAS(d,append)->b) d = doc_append(a, v[0].doc, v[1].doc);
+                break;
+            case PP_DOC_GROUP:
+                if (v[0].doc != DOCAS(d,group)->grouped) d = doc_group(a, v[0].doc);
+                break;
+            default: {
+                int changed = 0;
+                for (size_t i = 0; i < children; i++) changed |= v[i].doc != DOCAS(d,concat)->docs[i];
+                if (!changed) break;
+                pp_doc_concat* c = doc_concat_alloc(a, children);
+                if (c != NULL) {
+                    const pp_doc** docs = (const pp_doc**)(c + 1);
+                    for (size_t i = 0; i < children; i++) docs[i] = v[i].doc;
+                    if (d->type == PP_DOC_FILL) _pp_fill(c, c->docs, children);
+                }
+                d = (const pp_doc*)c;
+                break;
+            }
+        }
+        if (d == NULL || !stack_push(&values, d, 0, 0)) goto done;
+    }
+    result = values.frames[0].doc;
+
+done:
+    if (s.owned) free(s.frames);
+    free(values.frames);
+    free(pending.frames);
+    free(replaced.frames);
+    return result;
 }
 
-void pp_pretty(FILE* restrict f, const pp_settings* restrict settings, const pp_doc* restrict document) {
+static int frame_equal(const pp_render_frame* restrict a, const pp_render_frame* restrict b) {
+    return a->doc == b->doc && a->indent == b->indent;
+}
+
+int pp_layout_replace(pp_layout* restrict l, const pp_doc* old, const pp_doc* replacement) {
+    if (l->arena == NULL && (l->arena = pp_arena_create(0)) == NULL) return -1;
+    const pp_doc* document = layout_rebuild(l, old, replacement);
+    if (document == NULL) return -1;
+    if (document == l->document) return 0;
+
+    render_stack pending = { NULL, 0, 0, 1, 0 };
+    render_stack spine = { NULL, 0, 0, 1, 0 };
+    int ok = spine_collect(&pending, &spine, l->settings, document) == 0;
+    free(pending.frames);
+    if (!ok) {
+        free(spine.frames);
+        return -1;
+    }
+
+    // Find the frames that are the same before and after the replacement,
+    // from the start and from the end.
+    size_t before = l->spine.size;
+    size_t after = spine.size;
+    size_t prefix = 0;
+    size_t suffix = 0;
+    while (prefix < before && prefix < after && frame_equal(&l->spine.frames[prefix], &spine.frames[prefix])) prefix++;
+    while (suffix < before - prefix && suffix < after - prefix
+            && frame_equal(&l->spine.frames[before - 1 - suffix], &spine.frames[after - 1 - suffix]))
+        suffix++;
+
+    // Chunks starting before the first changed frame, and those starting
+    // with an unchanged line after the last, are kept (the latter moving with
+    // the frames before them).
+    size_t first = 0;
+    while (first + 1 < l->count && l->chunks[first + 1].start < prefix) first++;
+    size_t last = first + 1;
+    while (last < l->count && l->chunks[last].start < before - suffix) last++;
+    if (l->count == 0) last = 0;
+    size_t start = l->count == 0 ? 0 : l->chunks[first].start;
+    size_t end = last < l->count ? l->chunks[last].start - before + after : after;
+    // A kept chunk that would become the first is rendered again, since the
+    // first line of the output is recorded with the first chunk.
+    if (end == 0 && last < l->count) {
+        last++;
+        end = last < l->count ? l->chunks[last].start - before + after : after;
+    }
+
+    size_t count = 0;
+    layout_chunk* rendered = layout_render_range(l->settings, &spine, start, end, &count);
+    layout_chunk* chunks = NULL;
+    if (rendered != NULL)
+        chunks = (layout_chunk*)malloc((l->count - (last - first) + count + 1) * sizeof(layout_chunk));
+    if (chunks == NULL) {
+        if (rendered != NULL) layout_chunks_free(rendered, count);
+        free(spine.frames);
+        return -1;
+    }
+    memcpy(chunks, l->chunks, first * sizeof(layout_chunk));
+    if (count > 0) memcpy(chunks + first, rendered, count * sizeof(layout_chunk));
+    for (size_t i = last; i < l->count; i++) {
+        layout_chunk* c = &chunks[first + count + i - last];
+        *c = l->chunks[i];
+        c->start = c->start - before + after;
+    }
+    for (size_t i = first; i < last; i++) {
+        free(l->chunks[i].out.text);
+        free(l->chunks[i].lines);
+    }
+    free(l->chunks);
+    free(rendered);
+    free(l->spine.frames);
+    l->chunks = chunks;
+    l->count = l->count - (last - first) + count;
+    l->spine = spine;
+    l->document = document;
+    layout_number(l);
+    return 1;
+}
+
+const pp_doc* pp_layout_document(const pp_layout* l) {
+    return l->document;
+}
+
+size_t pp_layout_lines(const pp_layout* l) {
+    if (l->count == 0) return 1;
+    return l->chunks[l->count - 1].first_line + l->chunks[l->count - 1].line_count;
+}
+
+const char* pp_layout_line(const pp_layout* restrict l, size_t line, size_t* restrict length) {
+    *length = 0;
+    if (l->count == 0) return "";
+    // Find the last chunk whose first line is at most line.
+    size_t lo = 0;
+    size_t hi = l->count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (l->chunks[mid].first_line <= line) lo = mid;
+        else hi = mid;
+    }
+    const layout_chunk* c = &l->chunks[lo];
+    size_t i = line - c->first_line;
+    if (c->out.text == NULL) return "";
+    size_t end = i + 1 < c->line_count ? c->lines[i + 1] - 1 : c->out.length;
+    *length = end - c->lines[i];
+    return c->out.text + c->lines[i];
+}
+
+void _pp_layout_write(const pp_writer* restrict writer, const pp_layout* restrict l) {
+    for (size_t i = 0; i < l->count; i++) {
+        if (l->chunks[i].out.length > 0) writer->write(writer->data, l->chunks[i].out.text, l->chunks[i].out.length);
+    }
+}
+
+void pp_layout_write(FILE* restrict f, const pp_layout* restrict l) {
+    pp_writer w;
+    w.data = f;
+    w.write = write_file;
+    char buffer[PP_BUFFER_SIZE];
+    pp_buffered_writer b;
+    _pp_buffered_writer(&b, buffer, sizeof(buffer), &w);
+    _pp_layout_write(&b.writer, l);
+    _pp_buffered_flush(&b);
+}
+
+void pp_pretty_serialized(FILE* restrict f, const pp_settings* restrict settings, const void* restrict data) {
+    pp_writer w;
+    w.data = f;
+    w.write = write_file;
+    char buffer[PP_BUFFER_SIZE];
+    pp_buffered_writer b;
+    _pp_buffered_writer(&b, buffer, sizeof(buffer), &w);
+    _pp_pretty_serialized(&b.writer, settings, data);
+    _pp_buffered_flush(&b);
+}
+
+void pp_pretty_compiled(FILE* restrict f, const pp_settings* restrict settings, const pp_program* restrict program) {
     pp_writer w;
     w.data = f;
     w.write = write_file;
-    _pp_pretty(&w, settings, document);
+    char buffer[PP_BUFFER_SIZE];
+    pp_buffered_writer b;
+    _pp_buffered_writer(&b, buffer, sizeof(buffer), &w);
+    _pp_pretty_compiled(&b.writer, settings, program);
+    _pp_buffered_flush(&b);
+}
+
+int pp_doc_serialize(FILE* restrict f, const pp_settings* restrict settings, const pp_doc* restrict document) {
+    serial_out o;
+    if (!serial_build(&o, settings, document)) return -1;
+    serial_header h;
+    serial_header_of(&o, &h);
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1
+        && fwrite(o.nodes, sizeof(serial_node), o.count, f) == o.count
+        && fwrite(o.pool, 1, o.pool_used, f) == o.pool_used;
+    serial_out_free(&o);
+    return ok ? 0 : -1;
 }
 
+pp_mapped_doc* pp_doc_map(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    pp_mapped_doc* m = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(serial_header)) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            if (pp_doc_validate(data, st.st_size) == 0) m = (pp_mapped_doc*)malloc(sizeof(pp_mapped_doc));
+            if (m != NULL) {
+                m->data = data;
+                m->size = st.st_size;
+            }
+            else munmap(data, st.st_size);
+        }
+    }
+    close(fd);
+    return m;
+}
+
+void pp_doc_unmap(pp_mapped_doc* m) {
+    if (m == NULL) return;
+    munmap((void*)m->data, m->size);
+    free(m);
+}
@@ -1,5 +1,9 @@
 #include "prettyprint.h"
 
+// This file is included by the C and C++ libraries, which must include
+// <stdlib.h> and <string.h> (and, for the C library, <stdint.h>) beforehand,
+// as well as <emmintrin.h> where __SSE2__ is defined.
+
 #define DOCAS(d,n) ((const pp_doc_##n*)(d))
 
 #if PRETTYPRINT_USE_CPP == 0
@@ -40,114 +44,2123 @@ void _pp_group(pp_doc_group* RESTRICT result, const pp_doc* RESTRICT d) {
     result->grouped = d;
 }
 
-static int can_flatten(const pp_settings* RESTRICT settings, const pp_doc* RESTRICT d, size_t* RESTRICT remaining) {
-    // Evaluate extensions
-    pp_doc_type_t tp = d->type;
-    while (tp >= PP_DOC_EXTENSION_START) {
-        if (settings->evaluate_extension == NULL) return 0;
-        tp = settings->evaluate_extension(settings, tp, (pp_doc**)&d);
+void _pp_concat(pp_doc_concat* RESTRICT result, const pp_doc* const* RESTRICT docs, size_t count) {
+    result->type = PP_DOC_CONCAT;
+    result->count = count;
+    result->docs = docs;
+}
+
+void _pp_fill(pp_doc_fill* RESTRICT result, const pp_doc* const* RESTRICT docs, size_t count) {
+    result->type = PP_DOC_FILL;
+    result->count = count;
+    result->docs = docs;
+}
+
+void _pp_words(pp_doc_words* RESTRICT result, const char* RESTRICT text, size_t length) {
+    result->type = PP_DOC_WORDS;
+    result->text = text;
+    result->length = length;
+}
+
+void _pp_lazy(pp_doc_lazy* result, const pp_doc* (*force)(void* data, pp_ext_context* context),
+        void (*release)(void* data, const pp_doc* d), void* data) {
+    result->type = PP_DOC_LAZY;
+    result->force = force;
+    result->release = release;
+    result->data = data;
+}
+
+void _pp_buffered_flush(pp_buffered_writer* b) {
+    if (b->used == 0) return;
+    b->sink.write(b->sink.data, b->buffer, b->used);
+    b->used = 0;
+}
+
+static void buffered_write(void* data, const char* RESTRICT text, size_t length) {
+    pp_buffered_writer* b = (pp_buffered_writer*)data;
+    if (length > b->size - b->used) {
+        _pp_buffered_flush(b);
+        // Pass large writes straight through rather than copying them.
+        if (length >= b->size) {
+            b->sink.write(b->sink.data, text, length);
+            return;
+        }
+    }
+    memcpy(b->buffer + b->used, text, length);
+    b->used += length;
+}
+
+void _pp_buffered_writer(pp_buffered_writer* RESTRICT result, char* RESTRICT buffer, size_t size, const pp_writer* RESTRICT sink) {
+    result->writer.write = buffered_write;
+    result->writer.data = result;
+    result->sink = *sink;
+    result->buffer = buffer;
+    result->size = size;
+    result->used = 0;
+}
+
+/*
+ * Rendering is driven by an explicit stack of frames rather than recursion, so
+ * the depth of a document (right-leaning append chains in particular) is
+ * bounded only by the memory available to the stack.
+ */
+
+typedef struct {
+    pp_render_frame* frames;
+    size_t size;
+    size_t capacity;
+    // Whether the stack may be moved to (larger) heap storage when full.
+    int growable;
+    // Whether frames is heap storage owned by the stack.
+    int owned;
+} render_stack;
+
+static int stack_push(render_stack* RESTRICT s, const pp_doc* RESTRICT d, size_t indent, int flat) {
+    if (s->size == s->capacity) {
+        if (!s->growable) return 0;
+        size_t capacity = s->capacity < 16 ? 64 : s->capacity * 2;
+        pp_render_frame* frames = (pp_render_frame*)malloc(capacity * sizeof(pp_render_frame));
+        if (frames == NULL) return 0;
+        if (s->size > 0) memcpy(frames, s->frames, s->size * sizeof(pp_render_frame));
+        if (s->owned) free(s->frames);
+        s->frames = frames;
+        s->capacity = capacity;
+        s->owned = 1;
+    }
+    pp_render_frame* f = &s->frames[s->size++];
+    f->doc = d;
+    f->indent = indent;
+    f->flat = flat;
+    f->fill = 0;
+    f->pos = 0;
+    return 1;
+}
+
+/*
+ * Concatenations and fills are visited a document at a time: a frame with a
+ * nonzero pos holds the (evaluated) concatenation or fill and the next
+ * document in it to visit, and stays on the stack until its last document is
+ * popped. Frames popped from a fill have fill set, since a line precedes
+ * every document of a fill but the first.
+ */
+static int stack_push_rest(render_stack* RESTRICT s, const pp_doc* RESTRICT d, size_t indent, int flat, int fill) {
+    if (!stack_push(s, d, indent, flat)) return 0;
+    s->frames[s->size - 1].fill = fill;
+    s->frames[s->size - 1].pos = 1;
+    return 1;
+}
+
+static pp_render_frame stack_pop(render_stack* s) {
+    pp_render_frame* top = &s->frames[s->size - 1];
+    if (top->pos == 0) {
+        s->size--;
+        return *top;
+    }
+    pp_render_frame f = *top;
+    const pp_doc_concat* c = DOCAS(top->doc,concat);
+    f.doc = c->docs[top->pos];
+    f.pos = 0;
+    if (++top->pos == c->count) s->size--;
+    return f;
+}
+
+static const pp_measure_entry line_measure = { NULL, 1, 0, 0 };
+
+// Hash a document by address into a power-of-two capacity. Documents near
+// each other in memory hash near each other, so that looking up the subtrees
+// of a document, which are usually allocated together, stays in the cache.
+static size_t measure_hash(const pp_doc* d, size_t capacity) {
+    return ((size_t)d >> 4) & (capacity - 1);
+}
+
+/*
+ * Extension contexts hand out memory from a list of blocks, each starting
+ * with a pointer to the next, which are freed together when the context is.
+ */
+
+#define EXT_BLOCK_SIZE 4096
+
+typedef union {
+    void* p;
+    size_t s;
+    long long l;
+    double d;
+} ext_align;
+
+void* pp_ext_alloc(pp_ext_context* c, size_t size) {
+    size = (size + sizeof(ext_align) - 1) / sizeof(ext_align) * sizeof(ext_align);
+    if (size > (size_t)(c->end - c->next)) {
+        size_t bsize = size > EXT_BLOCK_SIZE ? size : EXT_BLOCK_SIZE;
+        ext_align* b = (ext_align*)malloc(sizeof(ext_align) + bsize);
+        if (b == NULL) return NULL;
+        b->p = c->blocks;
+        c->blocks = b;
+        c->next = (char*)(b + 1);
+        c->end = c->next + bsize;
+    }
+    void* result = c->next;
+    c->next += size;
+    return result;
+}
+
+pp_doc* pp_ext_text(pp_ext_context* RESTRICT c, const char* RESTRICT text, size_t length) {
+    pp_doc_text* t = (pp_doc_text*)pp_ext_alloc(c, sizeof(pp_doc_text) + length);
+    if (t == NULL) return NULL;
+    if (length > 0) memcpy(t + 1, text, length);
+    _pp_text(t, (const char*)(t + 1), length);
+    return (pp_doc*)t;
+}
+
+/*
+ * Contexts also remember what extensions resolved to when looking ahead (to
+ * see whether a group fits), in an open-addressed table keyed by the
+ * extension's address, so that an extension is resolved once however many
+ * enclosing groups examine it. The entry is removed when the extension is
+ * printed, which keeps the table no larger than the lookahead.
+ */
+
+typedef struct {
+    const pp_doc* key;
+    const pp_doc* doc;
+    pp_doc_type_t type;
+} ext_memo_entry;
+
+static size_t memo_hash(const pp_doc* d, size_t capacity) {
+    return ((size_t)d >> 4) & (capacity - 1);
+}
+
+static const ext_memo_entry* ext_memo_find(const pp_ext_context* RESTRICT c, const pp_doc* RESTRICT d) {
+    if (c->memo_count == 0) return NULL;
+    const ext_memo_entry* memo = (const ext_memo_entry*)c->memo;
+    for (size_t i = memo_hash(d, c->memo_capacity);; i = (i + 1) & (c->memo_capacity - 1)) {
+        if (memo[i].key == d) return &memo[i];
+        if (memo[i].key == NULL) return NULL;
+    }
+}
+
+// Remember a resolution, if there is memory for it; otherwise the extension
+// is simply resolved again.
+static void ext_memo_insert(pp_ext_context* RESTRICT c, const pp_doc* key, const pp_doc* doc, pp_doc_type_t type) {
+    if (2 * (c->memo_count + 1) > c->memo_capacity) {
+        size_t capacity = c->memo_capacity == 0 ? 64 : c->memo_capacity * 2;
+        ext_memo_entry* memo = (ext_memo_entry*)calloc(capacity, sizeof(ext_memo_entry));
+        if (memo == NULL) return;
+        const ext_memo_entry* old = (const ext_memo_entry*)c->memo;
+        for (size_t i = 0; i < c->memo_capacity; i++) {
+            if (old[i].key == NULL) continue;
+            size_t j = memo_hash(old[i].key, capacity);
+            while (memo[j].key != NULL) j = (j + 1) & (capacity - 1);
+            memo[j] = old[i];
+        }
+        free(c->memo);
+        c->memo = memo;
+        c->memo_capacity = capacity;
+    }
+    ext_memo_entry* memo = (ext_memo_entry*)c->memo;
+    size_t i = memo_hash(key, c->memo_capacity);
+    while (memo[i].key != NULL) i = (i + 1) & (c->memo_capacity - 1);
+    memo[i].key = key;
+    memo[i].doc = doc;
+    memo[i].type = type;
+    c->memo_count++;
+}
+
+// Remove an entry, moving later entries of its run back into the gap.
+static void ext_memo_remove(pp_ext_context* RESTRICT c, const ext_memo_entry* RESTRICT e) {
+    ext_memo_entry* memo = (ext_memo_entry*)c->memo;
+    size_t mask = c->memo_capacity - 1;
+    size_t i = (size_t)(e - memo);
+    for (size_t j = (i + 1) & mask; memo[j].key != NULL; j = (j + 1) & mask) {
+        // Entries whose home slot is cyclically within (i, j] stay put.
+        size_t k = memo_hash(memo[j].key, c->memo_capacity);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+        memo[i] = memo[j];
+        i = j;
+    }
+    memo[i].key = NULL;
+    c->memo_count--;
+}
+
+// A lazy document to release when the context is freed, allocated from the
+// context.
+typedef struct lazy_release {
+    struct lazy_release* next;
+    void (*release)(void* data, const pp_doc* d);
+    void* data;
+    const pp_doc* doc;
+} lazy_release;
+
+// Produce a lazy document, arranging for it to be released with the context.
+// If there is no memory for that, the document is not produced and is nil.
+static const pp_doc* lazy_force(pp_ext_context* RESTRICT c, const pp_doc_lazy* RESTRICT l) {
+    lazy_release* r = NULL;
+    if (l->release != NULL && (r = (lazy_release*)pp_ext_alloc(c, sizeof(lazy_release))) == NULL) return _pp_nil;
+    const pp_doc* d = l->force(l->data, c);
+    if (d == NULL) d = _pp_nil;
+    if (r != NULL) {
+        r->next = (lazy_release*)c->releases;
+        r->release = l->release;
+        r->data = l->data;
+        r->doc = d;
+        c->releases = r;
+    }
+    return d;
+}
+
+static void ext_context_free(pp_ext_context* c) {
+    // Documents produced later may be parts of those produced earlier, so
+    // they are released first.
+    for (lazy_release* r = (lazy_release*)c->releases; r != NULL; r = r->next) r->release(r->data, r->doc);
+    c->releases = NULL;
+    while (c->blocks != NULL) {
+        ext_align* b = (ext_align*)c->blocks;
+        c->blocks = b->p;
+        free(b);
+    }
+    c->next = c->end = NULL;
+    free(c->memo);
+    c->memo = NULL;
+    c->memo_count = c->memo_capacity = 0;
+}
+
+// Evaluate extensions and produce lazy documents, returning the resulting type
+// and updating *d. Documents that cannot be evaluated are treated as nil.
+// Extensions the context's parent has evaluated are not evaluated again. What
+// is evaluated when looking ahead is memoized, and the memo entry is consumed
+// by the first resolve that is not looking ahead.
+static pp_doc_type_t resolve(const pp_settings* RESTRICT settings, pp_ext_context* RESTRICT ext,
+        const pp_doc** RESTRICT d, int ahead) {
+    pp_doc_type_t tp = (*d)->type;
+    if (tp < PP_DOC_EXTENSION_START && tp != PP_DOC_LAZY) return tp;
+    const pp_doc* key = *d;
+    const ext_memo_entry* e = ext->parent != NULL ? ext_memo_find(ext->parent, key) : NULL;
+    if (e != NULL) {
+        *d = e->doc;
+        return e->type;
+    }
+    if ((e = ext_memo_find(ext, key)) != NULL) {
+        *d = e->doc;
+        tp = e->type;
+        if (!ahead) ext_memo_remove(ext, e);
+        return tp;
+    }
+    while (tp >= PP_DOC_EXTENSION_START || tp == PP_DOC_LAZY) {
+        if (tp == PP_DOC_LAZY) {
+            *d = lazy_force(ext, DOCAS(*d,lazy));
+            tp = (*d)->type;
+        }
+        else if (settings->resolve_extension != NULL) {
+            *d = settings->resolve_extension(settings, *d, ext);
+            if (*d == NULL) *d = _pp_nil;
+            tp = (*d)->type;
+        }
+        else if (settings->evaluate_extension != NULL) tp = settings->evaluate_extension(settings, tp, (pp_doc**)d);
+        else {
+            tp = PP_DOC_NIL;
+            break;
+        }
+    }
+    if (ahead) ext_memo_insert(ext, key, *d, tp);
+    return tp;
+}
+
+/*
+ * Measurements record, for each subtree, its flat width and how much of that
+ * width is trailing separators. Separators only take up room when something
+ * follows them on the line, so a subtree fits in r columns exactly when its
+ * width less its trailing separators is at most r.
+ */
+
+static int has_children(pp_doc_type_t type) {
+    return (type >= PP_DOC_NEST && type <= PP_DOC_CONCAT) || type == PP_DOC_FILL;
+}
+
+static const pp_measure_entry* measure_find(const pp_measure_table* RESTRICT m, const pp_doc* RESTRICT d) {
+    if (m == NULL || m->capacity == 0) return NULL;
+    for (size_t i = measure_hash(d, m->capacity);; i = (i + 1) & (m->capacity - 1)) {
+        const pp_measure_entry* e = &m->entries[i];
+        if (e->doc == d) return e;
+        if (e->doc == NULL) return NULL;
+    }
+}
+
+/*
+ * Determine whether d fits in remaining columns when flattened. The frames
+ * above the current top of the stack are used as scratch space, and the stack
+ * is restored before returning.
+ *
+ * Returns 1 if it fits, 0 if not, and -1 if the stack could not grow.
+ */
+static int can_flatten(render_stack* RESTRICT s, const pp_settings* RESTRICT settings, pp_ext_context* RESTRICT ext,
+        const pp_measure_table* RESTRICT m, const pp_doc* d, size_t remaining) {
+    size_t base = s->size;
+    int result = 1;
+    // The document being examined is kept out of the stack; only the second
+    // halves of appends and the rest of concatenations and fills are deferred.
+    while (result == 1) {
+        // Only documents with children are in the table; leaves are cheaper
+        // to measure than to look up.
+        const pp_measure_entry* e = m != NULL && has_children(d->type) ? measure_find(m, d) : NULL;
+        pp_doc_type_t tp;
+        if (e != NULL && !e->dynamic) {
+            if (e->width - e->trailing > remaining) result = 0;
+            else remaining = e->width > remaining ? 0 : remaining - e->width;
+        }
+        else switch (tp = resolve(settings, ext, &d, 1)) {
+            case PP_DOC_NIL:
+                break;
+            case PP_DOC_SEP:
+                if (remaining > 0) remaining -= 1;
+                break;
+            case PP_DOC_TEXT:
+                if (remaining < DOCAS(d,text)->length) result = 0;
+                else remaining -= DOCAS(d,text)->length;
+                break;
+            case PP_DOC_LINE:
+                if (remaining < 1) result = 0;
+                else remaining -= 1;
+                break;
+            case PP_DOC_WORDS: {
+                // Every character takes a column until the line is full,
+                // after which only separators fit.
+                const pp_doc_words* w = DOCAS(d,words);
+                if (w->length <= remaining) {
+                    remaining -= w->length;
+                    break;
+                }
+                for (size_t i = remaining; i < w->length; i++) {
+                    if (w->text[i] != ' ') {
+                        result = 0;
+                        break;
+                    }
+                }
+                remaining = 0;
+                break;
+            }
+            case PP_DOC_NEST:
+                d = DOCAS(d,nest)->nested;
+                continue;
+            case PP_DOC_APPEND:
+                if (!stack_push(s, DOCAS(d,append)->b, 0, 1)) result = -1;
+                d = DOCAS(d,append)->a;
+                continue;
+            case PP_DOC_GROUP:
+                d = DOCAS(d,group)->grouped;
+                continue;
+            case PP_DOC_CONCAT:
+            case PP_DOC_FILL:
+                if (DOCAS(d,concat)->count == 0) break;
+                if (DOCAS(d,concat)->count > 1 && !stack_push_rest(s, d, 0, 1, tp == PP_DOC_FILL)) result = -1;
+                d = DOCAS(d,concat)->docs[0];
+                continue;
+            default:
+                result = 0;
+                break;
+        }
+        if (result != 1 || s->size == base) break;
+        pp_render_frame next = stack_pop(s);
+        d = next.doc;
+        // The line before a document of a fill is flat.
+        if (next.fill) {
+            if (remaining < 1) result = 0;
+            else remaining -= 1;
+        }
+    }
+    s->size = base;
+    return result;
+}
+
+typedef struct {
+    const pp_writer* writer;
+    const pp_settings* settings;
+    const pp_measure_table* measure;
+    size_t remaining;
+    // The context of extension resolvers, or NULL when extensions have been
+    // resolved already.
+    pp_ext_context* ext;
+    // The bytes that may still be written and the line breaks that may still
+    // be taken before output is cut (both (size_t)-1 when unlimited), and
+    // whether it has been.
+    size_t bytes_left;
+    size_t lines_left;
+    int stopped;
+} render_state;
+
+static void render_init(render_state* RESTRICT st, const pp_writer* writer, const pp_settings* settings,
+        const pp_measure_table* measure, pp_ext_context* ext) {
+    st->writer = writer;
+    st->settings = settings;
+    st->measure = measure;
+    st->remaining = settings->width;
+    st->ext = ext;
+    st->bytes_left = settings->max_bytes != 0 ? settings->max_bytes : (size_t)-1;
+    st->lines_left = settings->max_lines != 0 ? settings->max_lines - 1 : (size_t)-1;
+    st->stopped = 0;
+}
+
+#define do_write(st,c,l) (st)->writer->write((st)->writer->data,c,l)
+
+// Cut the output: write the elision, and nothing after it.
+static void emit_stop(render_state* RESTRICT st) {
+    if (st->stopped) return;
+    st->stopped = 1;
+    st->bytes_left = 0;
+    st->lines_left = 0;
+    if (st->settings->elision != NULL) do_write(st, st->settings->elision, strlen(st->settings->elision));
+}
+
+static void emit_write(render_state* RESTRICT st, const char* RESTRICT text, size_t length) {
+    if (length > st->bytes_left) {
+        if (st->stopped) return;
+        if (st->bytes_left > 0) do_write(st, text, st->bytes_left);
+        emit_stop(st);
+        return;
+    }
+    st->bytes_left -= length;
+    do_write(st, text, length);
+}
+
+// A newline followed by spaces, so that a line break and its indentation
+// (or any run of spaces) can be written with one call.
+#define SPACES_16 "                "
+#define SPACES_64 SPACES_16 SPACES_16 SPACES_16 SPACES_16
+static const char newline_spaces[] = "\n" SPACES_64 SPACES_64 SPACES_64 SPACES_64;
+#define SPACES (newline_spaces + 1)
+#define MAX_SPACES (sizeof(newline_spaces) - 2)
+
+static void emit_line(render_state* RESTRICT st, size_t indent, int flat) {
+    if (flat) {
+        emit_write(st, SPACES, 1);
+        if (st->remaining > 0) st->remaining -= 1;
     }
+    else {
+        if (st->lines_left == 0) {
+            emit_stop(st);
+            return;
+        }
+        st->lines_left -= 1;
+        size_t n = indent < MAX_SPACES ? indent : MAX_SPACES;
+        emit_write(st, newline_spaces, n + 1);
+        for (size_t i = n; i < indent; i += n) {
+            n = indent - i < MAX_SPACES ? indent - i : MAX_SPACES;
+            emit_write(st, SPACES, n);
+        }
+        st->remaining = st->settings->width - indent;
+    }
+}
+
+static void emit_sep(render_state* RESTRICT st, size_t indent) {
+    if (st->settings->width - indent != st->remaining && st->remaining != 0) {
+        emit_write(st, SPACES, 1);
+        st->remaining -= 1;
+    }
+}
 
+static void emit_text(render_state* RESTRICT st, size_t indent, int flat, const char* RESTRICT text, size_t length) {
+    size_t len = length;
+    if (len > st->remaining) emit_line(st, indent, flat);
+    // Text that is too long for a line is wrapped; stop wrapping if a line has
+    // no room at all, since no progress could be made.
+    while (len > st->remaining && st->remaining > 0) {
+        emit_write(st, text + (length - len), st->remaining);
+        len -= st->remaining;
+        st->remaining = 0;
+        emit_line(st, indent, flat);
+    }
+    emit_write(st, text + (length - len), len);
+    st->remaining = len > st->remaining ? 0 : st->remaining - len;
+}
+
+/*
+ * Find the end of the word starting at p: the first space or newline before
+ * end, or end. Words are scanned a vector (or a machine word) at a time.
+ */
+static const char* words_end(const char* RESTRICT p, const char* RESTRICT end) {
+#if defined(__SSE2__) && defined(__GNUC__)
+    const __m128i spaces = _mm_set1_epi8(' ');
+    const __m128i newlines = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, spaces), _mm_cmpeq_epi8(v, newlines)));
+        if (mask != 0) return p + __builtin_ctz((unsigned)mask);
+    }
+#else
+    const size_t ones = (size_t)-1 / 255;
+    for (; (size_t)(end - p) >= sizeof(size_t); p += sizeof(size_t)) {
+        size_t v;
+        memcpy(&v, p, sizeof(v));
+        size_t sp = v ^ (ones * ' ');
+        size_t nl = v ^ (ones * '\n');
+        // Nonzero if any byte of sp or nl is zero.
+        if ((((sp - ones) & ~sp) | ((nl - ones) & ~nl)) & (ones << 7)) break;
+    }
+#endif
+    while (p != end && *p != ' ' && *p != '\n') p++;
+    return p;
+}
+
+static void emit_words(render_state* RESTRICT st, size_t indent, int flat, const char* RESTRICT text, size_t length) {
+    const char* end = text + length;
+    for (;;) {
+        const char* word_end = words_end(text, end);
+        // Empty words write nothing, so they are skipped.
+        if (word_end != text) emit_text(st, indent, flat, text, word_end - text);
+        if (word_end == end) return;
+        if (*word_end == '\n') emit_line(st, indent, flat);
+        else emit_sep(st, indent);
+        text = word_end + 1;
+    }
+}
+
+static int render(render_stack* RESTRICT s, render_state* RESTRICT st, pp_render_frame f) {
+    const pp_settings* settings = st->settings;
+    // The current frame f is kept out of the stack; only the second halves of
+    // appends and the rest of concatenations and fills are deferred.
+    for (;;) {
+        const pp_doc* d = f.doc;
+        switch (resolve(settings, st->ext, &d, 0)) {
+            case PP_DOC_NIL:
+                break;
+            case PP_DOC_SEP:
+                emit_sep(st, f.indent);
+                break;
+            case PP_DOC_TEXT:
+                emit_text(st, f.indent, f.flat, DOCAS(d,text)->text, DOCAS(d,text)->length);
+                break;
+            case PP_DOC_LINE:
+                emit_line(st, f.indent, f.flat);
+                break;
+            case PP_DOC_WORDS:
+                emit_words(st, f.indent, f.flat, DOCAS(d,words)->text, DOCAS(d,words)->length);
+                break;
+            case PP_DOC_NEST:
+                f.indent += DOCAS(d,nest)->indent;
+                if (f.indent > settings->max_indent) f.indent = settings->max_indent;
+                f.doc = DOCAS(d,nest)->nested;
+                continue;
+            case PP_DOC_APPEND:
+                if (!stack_push(s, DOCAS(d,append)->b, f.indent, f.flat)) return -1;
+                f.doc = DOCAS(d,append)->a;
+                continue;
+            case PP_DOC_GROUP:
+                f.doc = DOCAS(d,group)->grouped;
+                // Groups within a flat group are known to fit (the enclosing
+                // check covered them), so only broken groups are measured.
+                // The check stops as soon as the group is known not to fit,
+                // so it looks ahead at most a line's worth of text.
+                if (!f.flat) {
+                    f.flat = can_flatten(s, settings, st->ext, st->measure, f.doc, st->remaining);
+                    if (f.flat < 0) return -1;
+                }
+                continue;
+            case PP_DOC_CONCAT:
+                if (DOCAS(d,concat)->count == 0) break;
+                if (DOCAS(d,concat)->count > 1 && !stack_push_rest(s, d, f.indent, f.flat, 0)) return -1;
+                f.doc = DOCAS(d,concat)->docs[0];
+                continue;
+            case PP_DOC_FILL:
+                if (DOCAS(d,fill)->count == 0) break;
+                if (DOCAS(d,fill)->count > 1 && !stack_push_rest(s, d, f.indent, f.flat, 1)) return -1;
+                f.doc = DOCAS(d,fill)->docs[0];
+                // Each document of a fill is laid out as a group.
+                if (!f.flat) {
+                    f.flat = can_flatten(s, settings, st->ext, st->measure, f.doc, st->remaining);
+                    if (f.flat < 0) return -1;
+                }
+                continue;
+            default:
+                break;
+        }
+        // Once output is cut, the rest of the document is not visited.
+        if (s->size == 0 || st->stopped) return 0;
+        f = stack_pop(s);
+        if (f.fill) {
+            // The line before a document of a fill is a space if the document
+            // fits flat after it. Only the document is measured, so filling
+            // is linear in the length of the fill.
+            f.fill = 0;
+            if (!f.flat) {
+                int fits = st->remaining > 0 ? can_flatten(s, settings, st->ext, st->measure, f.doc, st->remaining - 1) : 0;
+                if (fits < 0) return -1;
+                emit_line(st, f.indent, fits);
+                f.flat = fits ? 1 : can_flatten(s, settings, st->ext, st->measure, f.doc, st->remaining);
+                if (f.flat < 0) return -1;
+            }
+            else emit_line(st, f.indent, 1);
+        }
+    }
+}
+
+#undef do_write
+
+void _pp_pretty_measured(const pp_writer* RESTRICT writer, const pp_settings* RESTRICT settings,
+        const pp_measure_table* RESTRICT measure, const pp_doc* RESTRICT document) {
+    // Shallow documents never leave this buffer.
+    pp_render_frame frames[64];
+    render_stack s = { frames, 0, sizeof(frames) / sizeof(frames[0]), 1, 0 };
+    pp_ext_context ext = { NULL, NULL, NULL, NULL, 0, 0, measure != NULL ? &measure->ext : NULL, NULL };
+    render_state st;
+    render_init(&st, writer, settings, measure, &ext);
+    if (measure != NULL && document == measure->document) document = measure->resolved;
+    pp_render_frame f = { document, 0, 0, 0, 0 };
+    render(&s, &st, f);
+    if (s.owned) free(s.frames);
+    ext_context_free(&ext);
+}
+
+void _pp_pretty(const pp_writer* RESTRICT writer, const pp_settings* RESTRICT settings, const pp_doc* RESTRICT document) {
+    _pp_pretty_measured(writer, settings, NULL, document);
+}
+
+#if PRETTYPRINT_USE_CPP == 0
+
+// Measuring, rendering with a caller's stack or at several widths, streaming,
+// serialization and compilation are part of the C API only.
+
+static pp_measure_entry* measure_insert(pp_measure_table* RESTRICT m, const pp_doc* RESTRICT d) {
+    if (2 * (m->count + 1) > m->capacity) {
+        size_t capacity = m->capacity == 0 ? 64 : m->capacity * 2;
+        pp_measure_entry* entries = (pp_measure_entry*)calloc(capacity, sizeof(pp_measure_entry));
+        if (entries == NULL) return NULL;
+        for (size_t i = 0; i < m->capacity; i++) {
+            if (m->entries[i].doc == NULL) continue;
+            size_t j = measure_hash(m->entries[i].doc, capacity);
+            while (entries[j].doc != NULL) j = (j + 1) & (capacity - 1);
+            entries[j] = m->entries[i];
+        }
+        free(m->entries);
+        m->entries = entries;
+        m->capacity = capacity;
+    }
+    size_t i = measure_hash(d, m->capacity);
+    while (m->entries[i].doc != NULL && m->entries[i].doc != d) i = (i + 1) & (m->capacity - 1);
+    if (m->entries[i].doc == NULL) m->count++;
+    m->entries[i].doc = d;
+    return &m->entries[i];
+}
+
+// Measure b following a, storing the result in a.
+static void measure_append(pp_measure_entry* RESTRICT a, const pp_measure_entry* RESTRICT b) {
+    a->trailing = b->trailing < b->width ? b->trailing : a->trailing + b->width;
+    a->width += b->width;
+    a->dynamic |= b->dynamic;
+}
+
+// The number of separators at the end of words, which are its trailing
+// measurement.
+static size_t words_trailing(const pp_doc_words* w) {
+    size_t n = 0;
+    while (n < w->length && w->text[w->length - 1 - n] == ' ') n++;
+    return n;
+}
+
+// Measure a document without children, returning 0 if it has children.
+static int measure_leaf(const pp_doc* RESTRICT d, pp_measure_entry* RESTRICT e) {
+    e->doc = d;
+    e->width = e->trailing = 0;
+    e->dynamic = 0;
+    if (d->type >= PP_DOC_EXTENSION_START || d->type == PP_DOC_LAZY) {
+        // Extensions may evaluate differently on every render, and lazy
+        // documents are not produced until they are rendered.
+        e->dynamic = 1;
+        return 1;
+    }
     switch (d->type) {
-        case PP_DOC_NIL:
-            return 1;
         case PP_DOC_SEP:
-            if (*remaining > 0) *remaining -= 1;
+            e->width = e->trailing = 1;
             return 1;
         case PP_DOC_TEXT:
-            if (*remaining < DOCAS(d,text)->length) return 0;
-            *remaining -= DOCAS(d,text)->length;
+            e->width = DOCAS(d,text)->length;
             return 1;
         case PP_DOC_LINE:
-            if (*remaining < 1) return 0;
-            *remaining -= 1;
+            e->width = 1;
+            return 1;
+        case PP_DOC_WORDS:
+            // Words, separators and lines all take a column apiece.
+            e->width = DOCAS(d,words)->length;
+            e->trailing = words_trailing(DOCAS(d,words));
             return 1;
         case PP_DOC_NEST:
-            return can_flatten(settings, DOCAS(d,nest)->nested, remaining);
         case PP_DOC_APPEND:
-            if (!can_flatten(settings, DOCAS(d,append)->a, remaining)) return 0;
-            return can_flatten(settings, DOCAS(d,append)->b, remaining);
         case PP_DOC_GROUP:
-            return can_flatten(settings, DOCAS(d,group)->grouped, remaining);
-        default:
+        case PP_DOC_CONCAT:
+        case PP_DOC_FILL:
             return 0;
+        case PP_DOC_NIL:
+        default:
+            return 1;
     }
 }
 
-static void pretty(const pp_writer* RESTRICT writer, const pp_settings* RESTRICT settings, const pp_doc* RESTRICT d, 
-        size_t* RESTRICT remaining, size_t indent, int group) {
-    // Evaluate extensions
-    pp_doc_type_t tp = d->type;
-    while (tp >= PP_DOC_EXTENSION_START) {
-        if (settings->evaluate_extension == NULL) return;
-        tp = settings->evaluate_extension(settings, tp, (pp_doc**)&d);
+typedef struct {
+    pp_measure_entry* values;
+    size_t size;
+    size_t capacity;
+} measure_values;
+
+static int values_push(measure_values* RESTRICT v, const pp_measure_entry* RESTRICT e) {
+    if (v->size == v->capacity) {
+        size_t capacity = v->capacity == 0 ? 64 : v->capacity * 2;
+        pp_measure_entry* values = (pp_measure_entry*)malloc(capacity * sizeof(pp_measure_entry));
+        if (values == NULL) return 0;
+        if (v->size > 0) memcpy(values, v->values, v->size * sizeof(pp_measure_entry));
+        free(v->values);
+        v->values = values;
+        v->capacity = capacity;
     }
+    v->values[v->size++] = *e;
+    return 1;
+}
 
-#define do_write(c,l) writer->write(writer->data,c,l)
-    switch (tp) {
-        case PP_DOC_NIL:
+/*
+ * With pure extensions, a document whose children resolved to other documents
+ * is copied, with them in their place, into the table's context. Renders of
+ * the measured document print the copy, which has no pure extensions left to
+ * resolve. The copy is remembered in the context so that other references to
+ * the document use it.
+ */
+static const pp_doc* measure_copy(pp_measure_table* RESTRICT m, const pp_doc* d, const pp_measure_entry* RESTRICT children) {
+    pp_doc* copy = NULL;
+    switch (d->type) {
+        case PP_DOC_NEST:
+            if (children[0].doc == DOCAS(d,nest)->nested) return d;
+            if ((copy = (pp_doc*)pp_ext_alloc(&m->ext, sizeof(pp_doc_nest))) == NULL) return NULL;
+            _pp_nest((pp_doc_nest*)copy, DOCAS(d,nest)->indent, children[0].doc);
             break;
-        case PP_DOC_SEP:
-            if (settings->width - indent != *remaining && *remaining != 0) {
-                do_write(" ", 1);
-                *remaining -= 1;
-            }
+        case PP_DOC_APPEND:
+            if (children[0].doc == DOCAS(d,append)->a && children[1].doc == DOCAS(d,append)->b) return d;
+            if ((copy = (pp_doc*)pp_ext_alloc(&m->ext, sizeof(pp_doc_append))) == NULL) return NULL;
+            _pp_append((pp_doc_append*)copy, children[0].doc, children[1].doc);
             break;
-        case PP_DOC_TEXT:
-            {
-                if (DOCAS(d,text)->length > *remaining) {
-                    pretty(writer, settings, _pp_line, remaining, indent, group);
-                }
-                const pp_doc_text* t = DOCAS(d,text);
-                size_t len = t->length;
-                while (len > *remaining) {
-                    do_write(t->text + (t->length - len), *remaining);
-                    len -= *remaining;
-                    *remaining = 0;
-                    pretty(writer, settings, _pp_line, remaining, indent, group);
-                }
-                do_write(t->text + (t->length - len), len);
-                *remaining -= len;
-            }
+        case PP_DOC_GROUP:
+            if (children[0].doc == DOCAS(d,group)->grouped) return d;
+            if ((copy = (pp_doc*)pp_ext_alloc(&m->ext, sizeof(pp_doc_group))) == NULL) return NULL;
+            _pp_group((pp_doc_group*)copy, children[0].doc);
             break;
-        case PP_DOC_LINE:
-            if (group) {
-                do_write(" ", 1);
-                *remaining -= 1;
+        case PP_DOC_CONCAT:
+        case PP_DOC_FILL: {
+            size_t count = DOCAS(d,concat)->count;
+            size_t i = 0;
+            while (i < count && children[i].doc == DOCAS(d,concat)->docs[i]) i++;
+            if (i == count) return d;
+            copy = (pp_doc*)pp_ext_alloc(&m->ext, sizeof(pp_doc_concat) + count * sizeof(const pp_doc*));
+            if (copy == NULL) return NULL;
+            const pp_doc** docs = (const pp_doc**)((pp_doc_concat*)copy + 1);
+            for (i = 0; i < count; i++) docs[i] = children[i].doc;
+            if (d->type == PP_DOC_FILL) _pp_fill((pp_doc_fill*)copy, docs, count);
+            else _pp_concat((pp_doc_concat*)copy, docs, count);
+            break;
+        }
+        default:
+            return d;
+    }
+    ext_memo_insert(&m->ext, d, copy, copy->type);
+    return copy;
+}
+
+/*
+ * Measure d and all of its subtrees into m. Children are measured before
+ * their parents using an explicit stack; frames with flat set are parents
+ * whose children have been measured, and whose measurements are on top of
+ * the value stack. Only documents with children are stored, since the rest
+ * are as cheap to measure as to look up.
+ */
+static int measure(render_stack* RESTRICT s, measure_values* RESTRICT v, pp_measure_table* RESTRICT m,
+        const pp_settings* RESTRICT settings, const pp_doc* RESTRICT document) {
+    if (!stack_push(s, document, 0, 0)) return -1;
+    while (s->size > 0) {
+        pp_render_frame f = s->frames[--s->size];
+        const pp_doc* d = f.doc;
+        pp_measure_entry e;
+        if (!f.flat) {
+            // Pure extensions are measured as what they resolve to, and
+            // documents containing them as their copies.
+            if (settings != NULL && d->type >= PP_DOC_EXTENSION_START) resolve(settings, &m->ext, &d, 1);
+            if (settings != NULL && has_children(d->type)) {
+                const ext_memo_entry* copy = ext_memo_find(&m->ext, d);
+                if (copy != NULL) d = copy->doc;
             }
-            else {
-                do_write("\n", 1);
-                for (size_t i = 0; i < indent; i++) do_write(" ", 1);
-                *remaining = settings->width - indent;
+            if (!measure_leaf(d, &e)) {
+                const pp_measure_entry* found = measure_find(m, d);
+                if (found == NULL) {
+                    int ok = stack_push(s, d, 0, 1);
+                    switch (d->type) {
+                        case PP_DOC_NEST:
+                            ok = ok && stack_push(s, DOCAS(d,nest)->nested, 0, 0);
+                            break;
+                        case PP_DOC_APPEND:
+                            ok = ok && stack_push(s, DOCAS(d,append)->b, 0, 0);
+                            ok = ok && stack_push(s, DOCAS(d,append)->a, 0, 0);
+                            break;
+                        case PP_DOC_GROUP:
+                            ok = ok && stack_push(s, DOCAS(d,group)->grouped, 0, 0);
+                            break;
+                        case PP_DOC_CONCAT:
+                        case PP_DOC_FILL:
+                            for (size_t i = DOCAS(d,concat)->count; ok && i > 0; i--)
+                                ok = stack_push(s, DOCAS(d,concat)->docs[i - 1], 0, 0);
+                            break;
+                        default:
+                            break;
+                    }
+                    if (!ok) return -1;
+                    continue;
+                }
+                e = *found;
             }
-            break;
-        case PP_DOC_NEST:
-            {
-                if (0) {}
-                const pp_doc_nest* n = DOCAS(d,nest);
-                size_t newindent = indent + n->indent;
-                if (newindent > settings->max_indent) newindent = settings->max_indent;
-                pretty(writer, settings, n->nested, remaining, newindent, group);
+        }
+        else {
+            size_t children = 1;
+            if (d->type == PP_DOC_APPEND) children = 2;
+            else if (d->type == PP_DOC_CONCAT || d->type == PP_DOC_FILL) children = DOCAS(d,concat)->count;
+            e.width = e.trailing = 0;
+            e.dynamic = 0;
+            v->size -= children;
+            for (size_t i = 0; i < children; i++) {
+                // Fills are measured flat, with a line between documents.
+                if (i > 0 && d->type == PP_DOC_FILL) measure_append(&e, &line_measure);
+                measure_append(&e, &v->values[v->size + i]);
             }
+            if (settings != NULL && (d = measure_copy(m, d, &v->values[v->size])) == NULL) return -1;
+            pp_measure_entry* slot = measure_insert(m, d);
+            if (slot == NULL) return -1;
+            e.doc = d;
+            *slot = e;
+        }
+        if (!values_push(v, &e)) return -1;
+    }
+    return 0;
+}
+
+void pp_measure_free(pp_measure_table* m) {
+    if (m == NULL) return;
+    free(m->entries);
+    ext_context_free(&m->ext);
+    free(m);
+}
+
+pp_measure_table* pp_measure_resolved(const pp_settings* RESTRICT settings, const pp_doc* RESTRICT document) {
+    pp_measure_table* m = (pp_measure_table*)calloc(1, sizeof(pp_measure_table));
+    if (m == NULL) return NULL;
+    pp_render_frame frames[64];
+    render_stack s = { frames, 0, sizeof(frames) / sizeof(frames[0]), 1, 0 };
+    measure_values v = { NULL, 0, 0 };
+    int result = measure(&s, &v, m, settings->pure_extensions ? settings : NULL, document);
+    if (s.owned) free(s.frames);
+    if (result >= 0 && settings->pure_extensions) {
+        m->document = document;
+        m->resolved = v.values[0].doc;
+        // Renders of the document print its copy, so what its extensions
+        // resolved to is not looked up again.
+        free(m->ext.memo);
+        m->ext.memo = NULL;
+        m->ext.memo_count = m->ext.memo_capacity = 0;
+    }
+    free(v.values);
+    if (result < 0) {
+        pp_measure_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+pp_measure_table* pp_measure(const pp_doc* document) {
+    pp_settings settings = { 0, 0, NULL, NULL, 0, 0, 0, NULL };
+    return pp_measure_resolved(&settings, document);
+}
+
+int _pp_pretty_stack(const pp_writer* RESTRICT writer, const pp_settings* RESTRICT settings, const pp_doc* RESTRICT document,
+        pp_render_frame* RESTRICT stack, size_t capacity) {
+    render_stack s = { stack, 0, capacity, 0, 0 };
+    pp_ext_context ext = { NULL, NULL, NULL, NULL, 0, 0, NULL, NULL };
+    render_state st;
+    render_init(&st, writer, settings, NULL, &ext);
+    pp_render_frame f = { document, 0, 0, 0, 0 };
+    int result = render(&s, &st, f);
+    ext_context_free(&ext);
+    return result;
+}
+
+/*
+ * Renders of one document at several widths visit the same documents in the
+ * same order, differing only in which groups are flat and (with different
+ * maximum indents) in indentation. So they are made in one traversal, with
+ * each frame holding a mode per render alongside the stack, and with one look
+ * ahead at each group for every render that hasn't already flattened it.
+ */
+
+typedef struct {
+    size_t indent;
+    int flat;
+} multi_mode;
+
+typedef struct {
+    render_stack s;
+    // The modes of each frame of s, count to a frame.
+    multi_mode* modes;
+    size_t capacity;
+    size_t count;
+} multi_stack;
+
+static int multi_push(multi_stack* RESTRICT m, const pp_doc* RESTRICT d, const multi_mode* RESTRICT modes, int rest,
+        int fill) {
+    if (!(rest ? stack_push_rest(&m->s, d, 0, 0, fill) : stack_push(&m->s, d, 0, 0))) return 0;
+    // The stack grows when looking ahead too, so the modes are resized to
+    // match when next pushed.
+    if (m->s.capacity > m->capacity) {
+        multi_mode* grown = (multi_mode*)realloc(m->modes, m->s.capacity * m->count * sizeof(multi_mode));
+        if (grown == NULL) return 0;
+        m->modes = grown;
+        m->capacity = m->s.capacity;
+    }
+    memcpy(&m->modes[(m->s.size - 1) * m->count], modes, m->count * sizeof(multi_mode));
+    return 1;
+}
+
+static pp_render_frame multi_pop(multi_stack* RESTRICT m, multi_mode* RESTRICT modes) {
+    memcpy(modes, &m->modes[(m->s.size - 1) * m->count], m->count * sizeof(multi_mode));
+    return stack_pop(&m->s);
+}
+
+/*
+ * Find the fewest remaining columns in which d fits when flattened, which is
+ * its flat width less any trailing separators, as can_flatten would examine
+ * it. Looking ahead stops once that exceeds limit.
+ *
+ * Returns 1, or -1 if the stack could not grow.
+ */
+static int flat_need(render_stack* RESTRICT s, const pp_settings* RESTRICT settings, pp_ext_context* RESTRICT ext,
+        const pp_doc* d, size_t limit, size_t* RESTRICT need) {
+    size_t base = s->size;
+    size_t used = 0;
+    int result = 1;
+    *need = 0;
+    while (result == 1 && *need <= limit) {
+        pp_doc_type_t tp = resolve(settings, ext, &d, 1);
+        // The width of a leaf, and the part of it taken by trailing
+        // separators.
+        size_t width = 0;
+        size_t trailing = 0;
+        switch (tp) {
+            case PP_DOC_NIL:
+                break;
+            case PP_DOC_SEP:
+                width = trailing = 1;
+                break;
+            case PP_DOC_TEXT:
+                width = DOCAS(d,text)->length;
+                break;
+            case PP_DOC_LINE:
+                width = 1;
+                break;
+            case PP_DOC_WORDS:
+                width = DOCAS(d,words)->length;
+                trailing = words_trailing(DOCAS(d,words));
+                break;
+            case PP_DOC_NEST:
+                d = DOCAS(d,nest)->nested;
+                continue;
+            case PP_DOC_APPEND:
+                if (!stack_push(s, DOCAS(d,append)->b, 0, 1)) result = -1;
+                d = DOCAS(d,append)->a;
+                continue;
+            case PP_DOC_GROUP:
+                d = DOCAS(d,group)->grouped;
+                continue;
+            case PP_DOC_CONCAT:
+            case PP_DOC_FILL:
+                if (DOCAS(d,concat)->count == 0) break;
+                if (DOCAS(d,concat)->count > 1 && !stack_push_rest(s, d, 0, 1, tp == PP_DOC_FILL)) result = -1;
+                d = DOCAS(d,concat)->docs[0];
+                continue;
+            default:
+                *need = limit + 1;
+                break;
+        }
+        if (width > trailing && used + width - trailing > *need) *need = used + width - trailing;
+        used += width;
+        if (s->size == base) break;
+        pp_render_frame next = stack_pop(s);
+        d = next.doc;
+        // The line before a document of a fill is flat.
+        if (next.fill) {
+            if (used + 1 > *need) *need = used + 1;
+            used += 1;
+        }
+    }
+    s->size = base;
+    return result;
+}
+
+/*
+ * Decide which of the renders that aren't flat lay d out flat. Before a
+ * document of a fill (other than its first), a line is written first, as a
+ * space if the document fits after it.
+ */
+static int multi_fit(multi_stack* RESTRICT m, const pp_settings* RESTRICT settings, pp_ext_context* RESTRICT ext,
+        render_state* RESTRICT st, multi_mode* RESTRICT modes, const pp_doc* d, int fill) {
+    size_t limit = 0;
+    int broken = 0;
+    for (size_t i = 0; i < m->count; i++) {
+        if (modes[i].flat) continue;
+        broken = 1;
+        if (st[i].remaining > limit) limit = st[i].remaining;
+        if (fill && st[i].settings->width - modes[i].indent > limit) limit = st[i].settings->width - modes[i].indent;
+    }
+    size_t need = 0;
+    if (broken && flat_need(&m->s, settings, ext, d, limit, &need) < 0) return -1;
+    for (size_t i = 0; i < m->count; i++) {
+        if (fill) {
+            int fits = modes[i].flat || (st[i].remaining > 0 && need <= st[i].remaining - 1);
+            emit_line(&st[i], modes[i].indent, fits);
+            if (fits) modes[i].flat = 1;
+        }
+        if (!modes[i].flat) modes[i].flat = need <= st[i].remaining;
+    }
+    return 1;
+}
+
+// Render document for renders whose extensions resolve alike.
+static int multi_render(const pp_settings* const* RESTRICT settings, const pp_writer* const* RESTRICT writers,
+        size_t count, const pp_doc* RESTRICT document) {
+    pp_render_frame frames[64];
+    multi_stack m = { { frames, 0, sizeof(frames) / sizeof(frames[0]), 1, 0 }, NULL, 0, count };
+    pp_ext_context ext = { NULL, NULL, NULL, NULL, 0, 0, NULL, NULL };
+    render_state* st = (render_state*)malloc(count * sizeof(render_state));
+    multi_mode* modes = (multi_mode*)malloc(count * sizeof(multi_mode));
+    int result = -1;
+    if (st == NULL || modes == NULL) goto done;
+    for (size_t i = 0; i < count; i++) {
+        render_init(&st[i], writers[i], settings[i], NULL, &ext);
+        modes[i].indent = 0;
+        modes[i].flat = 0;
+    }
+
+    const pp_settings* resolver = settings[0];
+    const pp_doc* d = document;
+    for (;;) {
+        pp_doc_type_t tp = resolve(resolver, &ext, &d, 0);
+        switch (tp) {
+            case PP_DOC_NIL:
+                break;
+            case PP_DOC_SEP:
+                for (size_t i = 0; i < count; i++) emit_sep(&st[i], modes[i].indent);
+                break;
+            case PP_DOC_TEXT:
+                for (size_t i = 0; i < count; i++)
+                    emit_text(&st[i], modes[i].indent, modes[i].flat, DOCAS(d,text)->text, DOCAS(d,text)->length);
+                break;
+            case PP_DOC_LINE:
+                for (size_t i = 0; i < count; i++) emit_line(&st[i], modes[i].indent, modes[i].flat);
+                break;
+            case PP_DOC_WORDS:
+                for (size_t i = 0; i < count; i++)
+                    emit_words(&st[i], modes[i].indent, modes[i].flat, DOCAS(d,words)->text, DOCAS(d,words)->length);
+                break;
+            case PP_DOC_NEST:
+                for (size_t i = 0; i < count; i++) {
+                    modes[i].indent += DOCAS(d,nest)->indent;
+                    if (modes[i].indent > settings[i]->max_indent) modes[i].indent = settings[i]->max_indent;
+                }
+                d = DOCAS(d,nest)->nested;
+                continue;
+            case PP_DOC_APPEND:
+                if (!multi_push(&m, DOCAS(d,append)->b, modes, 0, 0)) goto done;
+                d = DOCAS(d,append)->a;
+                continue;
+            case PP_DOC_GROUP:
+                d = DOCAS(d,group)->grouped;
+                if (multi_fit(&m, resolver, &ext, st, modes, d, 0) < 0) goto done;
+                continue;
+            case PP_DOC_CONCAT:
+            case PP_DOC_FILL:
+                if (DOCAS(d,concat)->count == 0) break;
+                if (DOCAS(d,concat)->count > 1 && !multi_push(&m, d, modes, 1, tp == PP_DOC_FILL)) goto done;
+                d = DOCAS(d,concat)->docs[0];
+                // Each document of a fill is laid out as a group.
+                if (tp == PP_DOC_FILL && multi_fit(&m, resolver, &ext, st, modes, d, 0) < 0) goto done;
+                continue;
+            default:
+                break;
+        }
+        if (m.s.size == 0) break;
+        // Stop once every render's output has been cut.
+        size_t stopped = 0;
+        while (stopped < count && st[stopped].stopped) stopped++;
+        if (stopped == count) break;
+        pp_render_frame f = multi_pop(&m, modes);
+        d = f.doc;
+        if (f.fill && multi_fit(&m, resolver, &ext, st, modes, d, 1) < 0) goto done;
+    }
+    result = 0;
+
+done:
+    if (m.s.owned) free(m.s.frames);
+    free(m.modes);
+    free(st);
+    free(modes);
+    ext_context_free(&ext);
+    return result;
+}
+
+// Whether extensions resolve alike with a and b: they are the same settings,
+// or neither evaluates extensions (lazy documents don't depend on settings).
+static int multi_share(const pp_settings* RESTRICT a, const pp_settings* RESTRICT b) {
+    return a == b || (a->evaluate_extension == NULL && a->resolve_extension == NULL
+            && b->evaluate_extension == NULL && b->resolve_extension == NULL);
+}
+
+int _pp_pretty_multi(const pp_settings* const* RESTRICT settings, const pp_writer* const* RESTRICT writers,
+        size_t count, const pp_doc* RESTRICT document) {
+    if (count == 0) return 0;
+    const pp_settings** group_settings = (const pp_settings**)malloc(count * sizeof(const pp_settings*));
+    const pp_writer** group_writers = (const pp_writer**)malloc(count * sizeof(const pp_writer*));
+    char* taken = (char*)calloc(count, 1);
+    int result = -1;
+    if (group_settings == NULL || group_writers == NULL || taken == NULL) goto done;
+    // The renders are traversed together in groups that share extension
+    // resolution.
+    result = 0;
+    for (size_t i = 0; i < count && result == 0; i++) {
+        if (taken[i]) continue;
+        size_t n = 0;
+        for (size_t j = i; j < count; j++) {
+            if (taken[j] || !multi_share(settings[i], settings[j])) continue;
+            taken[j] = 1;
+            group_settings[n] = settings[j];
+            group_writers[n++] = writers[j];
+        }
+        result = multi_render(group_settings, group_writers, n, document);
+    }
+
+done:
+    free(group_settings);
+    free(group_writers);
+    free(taken);
+    return result;
+}
+
+/*
+ * The streaming renderer receives a document as a sequence of tokens and
+ * renders it as they arrive. A group in break mode is flat if its content
+ * fits in the remaining columns, so the tokens following its opening are held
+ * back until either its closing arrives (it fits, and is rendered flat) or
+ * the text held back exceeds the remaining columns (it does not, and is
+ * rendered broken). Either way, at most a line's worth of text is held back.
+ * Tokens are then rendered from the queue in order, which may hold back
+ * again at a group within a broken group.
+ */
+
+enum {
+    STREAM_TEXT,
+    STREAM_LINE,
+    STREAM_SEP,
+    STREAM_GROUP_OPEN,
+    STREAM_GROUP_CLOSE,
+    STREAM_NEST_PUSH,
+    STREAM_NEST_POP
+};
+
+typedef struct {
+    int kind;
+    // The length of text, or the indent of a nest.
+    size_t value;
+    // The offset of text in the text buffer.
+    size_t offset;
+} stream_token;
+
+struct _pp_stream {
+    pp_writer writer;
+    render_state st;
+    // The enclosing groups and nests; the innermost is kept in current.
+    render_stack modes;
+    pp_render_frame current;
+    // The number of groups and nests opened and not yet closed.
+    size_t open;
+
+    // Tokens held back, from first to count, and their text.
+    stream_token* tokens;
+    size_t first;
+    size_t count;
+    size_t capacity;
+    char* text;
+    size_t text_used;
+    size_t text_capacity;
+
+    // Whether the group opened by the first token is being checked, and the
+    // state of the check: the next token to examine, the columns left, and
+    // the depth of nesting within the group.
+    int scanning;
+    size_t scan;
+    size_t fit;
+    size_t depth;
+
+    // Whether an allocation has failed.
+    int failed;
+};
+
+static int stream_push_mode(pp_stream* s, size_t indent, int flat) {
+    if (!stack_push(&s->modes, NULL, s->current.indent, s->current.flat)) return 0;
+    s->current.indent = indent;
+    s->current.flat = flat;
+    return 1;
+}
+
+static void stream_pop_mode(pp_stream* s) {
+    if (s->modes.size > 0) s->current = s->modes.frames[--s->modes.size];
+}
+
+// Render a token in the current mode.
+static int stream_emit(pp_stream* RESTRICT s, int kind, size_t value, const char* RESTRICT text) {
+    size_t indent;
+    switch (kind) {
+        case STREAM_TEXT:
+            emit_text(&s->st, s->current.indent, s->current.flat, text, value);
             break;
-        case PP_DOC_APPEND:
-            pretty(writer, settings, DOCAS(d,append)->a, remaining, indent, group);
-            pretty(writer, settings, DOCAS(d,append)->b, remaining, indent, group);
+        case STREAM_LINE:
+            emit_line(&s->st, s->current.indent, s->current.flat);
             break;
-        case PP_DOC_GROUP:
-            {
-                if (0) {}
-                size_t r = *remaining;
-                const pp_doc* grouped = DOCAS(d,group)->grouped;
-                pretty(writer, settings, grouped, remaining, indent, can_flatten(settings, grouped, &r));
-            }
+        case STREAM_SEP:
+            emit_sep(&s->st, s->current.indent);
+            break;
+        case STREAM_GROUP_OPEN:
+            // Only reached within a flat group; other groups are checked.
+            return stream_push_mode(s, s->current.indent, s->current.flat);
+        case STREAM_NEST_PUSH:
+            indent = s->current.indent + value;
+            if (indent > s->st.settings->max_indent) indent = s->st.settings->max_indent;
+            return stream_push_mode(s, indent, s->current.flat);
+        case STREAM_GROUP_CLOSE:
+        case STREAM_NEST_POP:
+            stream_pop_mode(s);
+            break;
+        default:
             break;
     }
-#undef do_write
+    return 1;
 }
 
-void _pp_pretty(const pp_writer* RESTRICT writer, const pp_settings* RESTRICT settings, const pp_doc* RESTRICT document) {
-    size_t remaining = settings->width;
-    pretty(writer, settings, document, &remaining, 0, 0);
+// Move the held-back tokens and text to the start of their buffers.
+static void stream_compact(pp_stream* s) {
+    size_t dead = s->first < s->count ? s->tokens[s->first].offset : s->text_used;
+    if (dead > 0) {
+        memmove(s->text, s->text + dead, s->text_used - dead);
+        s->text_used -= dead;
+    }
+    if (s->first > 0) {
+        memmove(s->tokens, s->tokens + s->first, (s->count - s->first) * sizeof(stream_token));
+        s->count -= s->first;
+        s->scan -= s->first;
+        s->first = 0;
+    }
+    for (size_t i = 0; dead > 0 && i < s->count; i++) s->tokens[i].offset -= dead;
+}
+
+static int stream_hold(pp_stream* RESTRICT s, int kind, size_t value, const char* RESTRICT text) {
+    size_t length = kind == STREAM_TEXT ? value : 0;
+    if (s->count == s->capacity || length > s->text_capacity - s->text_used) stream_compact(s);
+    if (s->count == s->capacity) {
+        size_t capacity = s->capacity == 0 ? 64 : s->capacity * 2;
+        stream_token* tokens = (stream_token*)malloc(capacity * sizeof(stream_token));
+        if (tokens == NULL) return 0;
+        if (s->count > 0) memcpy(tokens, s->tokens, s->count * sizeof(stream_token));
+        free(s->tokens);
+        s->tokens = tokens;
+        s->capacity = capacity;
+    }
+    if (length > s->text_capacity - s->text_used) {
+        size_t capacity = s->text_capacity == 0 ? 256 : s->text_capacity * 2;
+        while (capacity - s->text_used < length) capacity *= 2;
+        char* buffer = (char*)malloc(capacity);
+        if (buffer == NULL) return 0;
+        if (s->text_used > 0) memcpy(buffer, s->text, s->text_used);
+        free(s->text);
+        s->text = buffer;
+        s->text_capacity = capacity;
+    }
+    stream_token* t = &s->tokens[s->count++];
+    t->kind = kind;
+    t->value = value;
+    t->offset = s->text_used;
+    if (length > 0) memcpy(s->text + s->text_used, text, length);
+    s->text_used += length;
+    return 1;
+}
+
+/*
+ * Render held-back tokens until the queue is empty or a group's check needs
+ * more tokens. The check is that of can_flatten, made a token at a time.
+ */
+static int stream_advance(pp_stream* s) {
+    for (;;) {
+        // Tokens held back after output is cut are dropped.
+        if (s->first == s->count || s->st.stopped) {
+            s->first = s->count = s->text_used = 0;
+            return 1;
+        }
+        const stream_token* t = &s->tokens[s->first];
+        if (t->kind != STREAM_GROUP_OPEN || s->current.flat) {
+            if (!stream_emit(s, t->kind, t->value, s->text + t->offset)) return 0;
+            s->first++;
+            continue;
+        }
+        if (!s->scanning) {
+            s->scanning = 1;
+            s->scan = s->first + 1;
+            s->fit = s->st.remaining;
+            s->depth = 0;
+        }
+        int flat = -1;
+        while (flat < 0 && s->scan < s->count) {
+            const stream_token* u = &s->tokens[s->scan++];
+            switch (u->kind) {
+                case STREAM_TEXT:
+                    if (s->fit < u->value) flat = 0;
+                    else s->fit -= u->value;
+                    break;
+                case STREAM_LINE:
+                    if (s->fit < 1) flat = 0;
+                    else s->fit -= 1;
+                    break;
+                case STREAM_SEP:
+                    if (s->fit > 0) s->fit -= 1;
+                    break;
+                case STREAM_GROUP_OPEN:
+                case STREAM_NEST_PUSH:
+                    s->depth++;
+                    break;
+                case STREAM_GROUP_CLOSE:
+                case STREAM_NEST_POP:
+                    if (s->depth == 0) flat = 1;
+                    else s->depth--;
+                    break;
+                default:
+                    break;
+            }
+        }
+        if (flat < 0) return 1;
+        s->scanning = 0;
+        s->first++;
+        if (!stream_push_mode(s, s->current.indent, flat)) return 0;
+    }
+}
+
+static int stream_token_in(pp_stream* RESTRICT s, int kind, size_t value, const char* RESTRICT text) {
+    if (s->failed) return -1;
+    // Once output is cut, the rest of the document is not looked at.
+    if (s->st.stopped) return 1;
+    int ok;
+    if (s->first == s->count && (kind != STREAM_GROUP_OPEN || s->current.flat)) {
+        // Nothing is held back, so the token can be rendered at once.
+        ok = stream_emit(s, kind, value, text);
+    }
+    else if (kind == STREAM_TEXT && s->scanning && value > s->fit) {
+        // The text does not fit the group being checked, so there is no need
+        // to hold it back: break the group, render what is held back, then
+        // the text.
+        s->scanning = 0;
+        s->first++;
+        ok = stream_push_mode(s, s->current.indent, 0) && stream_advance(s);
+        ok = ok && stream_token_in(s, kind, value, text) >= 0;
+    }
+    else {
+        ok = stream_hold(s, kind, value, text) && stream_advance(s);
+    }
+    if (!ok) s->failed = 1;
+    return ok ? s->st.stopped : -1;
+}
+
+pp_stream* pp_stream_begin(const pp_writer* RESTRICT writer, const pp_settings* RESTRICT settings) {
+    pp_stream* s = (pp_stream*)calloc(1, sizeof(pp_stream));
+    if (s == NULL) return NULL;
+    s->writer = *writer;
+    render_init(&s->st, &s->writer, settings, NULL, NULL);
+    s->modes.growable = 1;
+    return s;
+}
+
+int pp_stream_text(pp_stream* RESTRICT s, const char* RESTRICT text, size_t length) {
+    return stream_token_in(s, STREAM_TEXT, length, text);
+}
+
+int pp_stream_line(pp_stream* s) {
+    return stream_token_in(s, STREAM_LINE, 0, NULL);
+}
+
+int pp_stream_sep(pp_stream* s) {
+    return stream_token_in(s, STREAM_SEP, 0, NULL);
+}
+
+int pp_stream_group_open(pp_stream* s) {
+    s->open++;
+    return stream_token_in(s, STREAM_GROUP_OPEN, 0, NULL);
 }
 
+int pp_stream_group_close(pp_stream* s) {
+    if (s->open == 0) return s->failed ? -1 : s->st.stopped;
+    s->open--;
+    return stream_token_in(s, STREAM_GROUP_CLOSE, 0, NULL);
+}
+
+int pp_stream_nest_push(pp_stream* s, size_t indent) {
+    s->open++;
+    return stream_token_in(s, STREAM_NEST_PUSH, indent, NULL);
+}
+
+int pp_stream_nest_pop(pp_stream* s) {
+    if (s->open == 0) return s->failed ? -1 : s->st.stopped;
+    s->open--;
+    return stream_token_in(s, STREAM_NEST_POP, 0, NULL);
+}
+
+int pp_stream_end(pp_stream* s) {
+    if (s == NULL) return -1;
+    while (s->open > 0) pp_stream_group_close(s);
+    int result = s->failed ? -1 : 0;
+    if (s->modes.owned) free(s->modes.frames);
+    free(s->tokens);
+    free(s->text);
+    free(s);
+    return result;
+}
+
+
+/*
+ * Serialized documents are a header, an array of nodes and a pool of text.
+ * Children precede their parents, so every child index is less than that of
+ * its parent (which also rules out cycles). Extensions are evaluated when
+ * serializing, and each group records the columns its content needs to be
+ * flat, so rendering a serialized document never measures.
+ *
+ * Integers are in host byte order; documents from a host of the other order
+ * fail validation.
+ */
+
+// "PPD1" in little-endian order.
+#define SERIAL_MAGIC 0x31445050u
+#define SERIAL_MAX 0xffffffffu
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t root;
+    uint32_t pool;
+} serial_header;
+
+typedef struct {
+    uint32_t type;
+    // Text and words: offset in the pool and length. Nest: indent and child. Append:
+    // children. Group: child and the columns needed to be flat, or SERIAL_MAX
+    // if there are too many to count. Fill: as a group, for a document of a
+    // fill other than the first, with the line before it.
+    uint32_t a;
+    uint32_t b;
+} serial_node;
+
+// A serialized node whose parent has yet to be serialized, and its
+// measurement.
+typedef struct {
+    uint32_t index;
+    pp_measure_entry m;
+} serial_value;
+
+typedef struct {
+    serial_node* nodes;
+    size_t count;
+    size_t capacity;
+    char* pool;
+    size_t pool_used;
+    size_t pool_capacity;
+    serial_value* values;
+    size_t values_size;
+    size_t values_capacity;
+    pp_ext_context ext;
+} serial_out;
+
+// Grow an array to hold at least needed items, returning the array or NULL.
+static void* serial_grow(void* items, size_t* capacity, size_t used, size_t needed, size_t size) {
+    if (needed <= *capacity) return items;
+    size_t c = *capacity == 0 ? 64 : *capacity * 2;
+    while (c < needed) c *= 2;
+    void* grown = malloc(c * size);
+    if (grown == NULL) return NULL;
+    if (used > 0) memcpy(grown, items, used * size);
+    free(items);
+    *capacity = c;
+    return grown;
+}
+
+static int serial_add(serial_out* RESTRICT o, pp_doc_type_t type, size_t a, size_t b,
+        const pp_measure_entry* RESTRICT m) {
+    if (o->count >= SERIAL_MAX) return 0;
+    serial_node* nodes = (serial_node*)serial_grow(o->nodes, &o->capacity, o->count, o->count + 1,
+            sizeof(serial_node));
+    if (nodes == NULL) return 0;
+    o->nodes = nodes;
+    serial_value* values = (serial_value*)serial_grow(o->values, &o->values_capacity, o->values_size,
+            o->values_size + 1, sizeof(serial_value));
+    if (values == NULL) return 0;
+    o->values = values;
+
+    serial_node* n = &o->nodes[o->count];
+    n->type = (uint32_t)type;
+    n->a = a < SERIAL_MAX ? (uint32_t)a : SERIAL_MAX;
+    n->b = b < SERIAL_MAX ? (uint32_t)b : SERIAL_MAX;
+    serial_value* v = &o->values[o->values_size++];
+    v->index = (uint32_t)o->count++;
+    v->m = *m;
+    return 1;
+}
+
+static int serial_add_text(serial_out* RESTRICT o, pp_doc_type_t type, const char* RESTRICT text, size_t length,
+        const pp_measure_entry* RESTRICT m) {
+    if (length > SERIAL_MAX - o->pool_used) return 0;
+    if (length > 0) {
+        char* pool = (char*)serial_grow(o->pool, &o->pool_capacity, o->pool_used, o->pool_used + length, 1);
+        if (pool == NULL) return 0;
+        o->pool = pool;
+        memcpy(o->pool + o->pool_used, text, length);
+        o->pool_used += length;
+    }
+    return serial_add(o, type, o->pool_used - length, length, m);
+}
+
+/*
+ * Serialize d into o, children first, using an explicit stack as measure does.
+ * Frames hold evaluated documents (with their type in place of the indent),
+ * and have flat set once their children are serialized, with the children on
+ * top of the value stack. Shared subtrees are serialized where they are used,
+ * as they are rendered.
+ */
+static int serialize(render_stack* RESTRICT s, serial_out* RESTRICT o, const pp_settings* RESTRICT settings,
+        const pp_doc* RESTRICT document) {
+    if (!stack_push(s, document, 0, 0)) return 0;
+    while (s->size > 0) {
+        pp_render_frame f = s->frames[--s->size];
+        const pp_doc* d = f.doc;
+        pp_measure_entry m;
+        int ok;
+        if (!f.flat) {
+            pp_doc_type_t tp = resolve(settings, &o->ext, &d, 0);
+            m.doc = d;
+            m.width = m.trailing = 0;
+            m.dynamic = 0;
+            switch (tp) {
+                case PP_DOC_NEST:
+                    ok = stack_push(s, d, tp, 1) && stack_push(s, DOCAS(d,nest)->nested, 0, 0);
+                    break;
+                case PP_DOC_APPEND:
+                    ok = stack_push(s, d, tp, 1) && stack_push(s, DOCAS(d,append)->b, 0, 0)
+                        && stack_push(s, DOCAS(d,append)->a, 0, 0);
+                    break;
+                case PP_DOC_GROUP:
+                    ok = stack_push(s, d, tp, 1) && stack_push(s, DOCAS(d,group)->grouped, 0, 0);
+                    break;
+                case PP_DOC_CONCAT:
+                case PP_DOC_FILL:
+                    ok = stack_push(s, d, tp, 1);
+                    for (size_t i = DOCAS(d,concat)->count; ok && i > 0; i--)
+                        ok = stack_push(s, DOCAS(d,concat)->docs[i - 1], 0, 0);
+                    break;
+                case PP_DOC_TEXT:
+                    m.width = DOCAS(d,text)->length;
+                    ok = serial_add_text(o, tp, DOCAS(d,text)->text, m.width, &m);
+                    break;
+                case PP_DOC_WORDS:
+                    m.width = DOCAS(d,words)->length;
+                    m.trailing = words_trailing(DOCAS(d,words));
+                    ok = serial_add_text(o, tp, DOCAS(d,words)->text, m.width, &m);
+                    break;
+                case PP_DOC_SEP:
+                    m.width = m.trailing = 1;
+                    ok = serial_add(o, tp, 0, 0, &m);
+                    break;
+                case PP_DOC_LINE:
+                    m.width = 1;
+                    ok = serial_add(o, tp, 0, 0, &m);
+                    break;
+                default:
+                    ok = serial_add(o, PP_DOC_NIL, 0, 0, &m);
+                    break;
+            }
+            if (!ok) return 0;
+            continue;
+        }
+        if ((pp_doc_type_t)f.indent == PP_DOC_CONCAT || (pp_doc_type_t)f.indent == PP_DOC_FILL) {
+            // Concatenations are serialized as chains of appends, built from
+            // the last document. The documents of fills are first wrapped in a
+            // group (the first) or a fill node (the rest).
+            size_t count = DOCAS(d,concat)->count;
+            if (count == 0) {
+                m.doc = d;
+                m.width = m.trailing = 0;
+                m.dynamic = 0;
+                if (!serial_add(o, PP_DOC_NIL, 0, 0, &m)) return 0;
+                continue;
+            }
+            if ((pp_doc_type_t)f.indent == PP_DOC_FILL) {
+                size_t base = o->values_size - count;
+                for (size_t i = 0; i < count; i++) {
+                    serial_value item = o->values[base + i];
+                    if (i == 0) m = item.m;
+                    else {
+                        m = line_measure;
+                        measure_append(&m, &item.m);
+                    }
+                    if (!serial_add(o, i == 0 ? PP_DOC_GROUP : PP_DOC_FILL, item.index, item.m.width - item.m.trailing, &m))
+                        return 0;
+                    o->values[base + i] = o->values[--o->values_size];
+                }
+            }
+            for (size_t i = 1; i < count; i++) {
+                serial_value rest = o->values[--o->values_size];
+                serial_value first = o->values[--o->values_size];
+                m = first.m;
+                measure_append(&m, &rest.m);
+                if (!serial_add(o, PP_DOC_APPEND, first.index, rest.index, &m)) return 0;
+            }
+            continue;
+        }
+        serial_value child = o->values[--o->values_size];
+        m = child.m;
+        switch ((pp_doc_type_t)f.indent) {
+            case PP_DOC_NEST:
+                ok = serial_add(o, PP_DOC_NEST, DOCAS(d,nest)->indent, child.index, &m);
+                break;
+            case PP_DOC_GROUP:
+                ok = serial_add(o, PP_DOC_GROUP, child.index, m.width - m.trailing, &m);
+                break;
+            default: {
+                serial_value first = o->values[--o->values_size];
+                m = first.m;
+                measure_append(&m, &child.m);
+                ok = serial_add(o, PP_DOC_APPEND, first.index, child.index, &m);
+                break;
+            }
+        }
+        if (!ok) return 0;
+    }
+    return 1;
+}
+
+static void serial_out_free(serial_out* o) {
+    free(o->nodes);
+    free(o->pool);
+    free(o->values);
+    ext_context_free(&o->ext);
+}
+
+// Serialize a document into o, returning 0 if memory could not be allocated
+// or the document is too large to serialize.
+static int serial_build(serial_out* RESTRICT o, const pp_settings* RESTRICT settings, const pp_doc* RESTRICT document) {
+    memset(o, 0, sizeof(serial_out));
+    pp_render_frame frames[64];
+    render_stack s = { frames, 0, sizeof(frames) / sizeof(frames[0]), 1, 0 };
+    int result = serialize(&s, o, settings, document);
+    if (s.owned) free(s.frames);
+    if (!result) serial_out_free(o);
+    return result;
+}
+
+static void serial_header_of(const serial_out* RESTRICT o, serial_header* RESTRICT h) {
+    h->magic = SERIAL_MAGIC;
+    h->count = (uint32_t)o->count;
+    h->root = (uint32_t)o->count - 1;
+    h->pool = (uint32_t)o->pool_used;
+}
+
+size_t pp_doc_serialize_into(void* RESTRICT buffer, size_t capacity, const pp_settings* RESTRICT settings,
+        const pp_doc* RESTRICT document) {
+    serial_out o;
+    if (!serial_build(&o, settings, document)) return 0;
+    size_t size = sizeof(serial_header) + o.count * sizeof(serial_node) + o.pool_used;
+    if (size <= capacity) {
+        char* p = (char*)buffer;
+        serial_header h;
+        serial_header_of(&o, &h);
+        memcpy(p, &h, sizeof(h));
+        memcpy(p + sizeof(h), o.nodes, o.count * sizeof(serial_node));
+        if (o.pool_used > 0) memcpy(p + sizeof(h) + o.count * sizeof(serial_node), o.pool, o.pool_used);
+    }
+    serial_out_free(&o);
+    return size;
+}
+
+int pp_doc_validate(const void* data, size_t size) {
+    if (size < sizeof(serial_header) || (size_t)data % sizeof(uint32_t) != 0) return -1;
+    const serial_header* h = (const serial_header*)data;
+    if (h->magic != SERIAL_MAGIC || h->count == 0 || h->root >= h->count) return -1;
+    if ((size - sizeof(serial_header)) / sizeof(serial_node) < h->count) return -1;
+    if (size - sizeof(serial_header) - h->count * sizeof(serial_node) != h->pool) return -1;
+    const serial_node* nodes = (const serial_node*)(h + 1);
+    for (uint32_t i = 0; i < h->count; i++) {
+        const serial_node* n = &nodes[i];
+        switch (n->type) {
+            case PP_DOC_NIL:
+            case PP_DOC_SEP:
+            case PP_DOC_LINE:
+                break;
+            case PP_DOC_TEXT:
+            case PP_DOC_WORDS:
+                if (n->b > h->pool || n->a > h->pool - n->b) return -1;
+                break;
+            case PP_DOC_NEST:
+                if (n->b >= i) return -1;
+                break;
+            case PP_DOC_APPEND:
+                if (n->a >= i || n->b >= i) return -1;
+                break;
+            case PP_DOC_GROUP:
+            case PP_DOC_FILL:
+                if (n->a >= i) return -1;
+                break;
+            default:
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// As render, over serialized nodes. Frames hold node pointers in place of
+// documents.
+static int render_serialized(render_stack* RESTRICT s, render_state* RESTRICT st, const serial_header* RESTRICT h) {
+    const serial_node* nodes = (const serial_node*)(h + 1);
+    const char* pool = (const char*)(nodes + h->count);
+    const serial_node* n = &nodes[h->root];
+    size_t indent = 0;
+    int flat = 0;
+    for (;;) {
+        switch (n->type) {
+            case PP_DOC_SEP:
+                emit_sep(st, indent);
+                break;
+            case PP_DOC_TEXT:
+                emit_text(st, indent, flat, pool + n->a, n->b);
+                break;
+            case PP_DOC_WORDS:
+                emit_words(st, indent, flat, pool + n->a, n->b);
+                break;
+            case PP_DOC_LINE:
+                emit_line(st, indent, flat);
+                break;
+            case PP_DOC_NEST:
+                indent += n->a;
+                if (indent > st->settings->max_indent) indent = st->settings->max_indent;
+                n = &nodes[n->b];
+                continue;
+            case PP_DOC_APPEND:
+                if (!stack_push(s, (const pp_doc*)&nodes[n->b], indent, flat)) return -1;
+                n = &nodes[n->a];
+                continue;
+            case PP_DOC_GROUP:
+                if (!flat) flat = n->b != SERIAL_MAX && n->b <= st->remaining;
+                n = &nodes[n->a];
+                continue;
+            case PP_DOC_FILL:
+                if (!flat) {
+                    flat = st->remaining > 0 && n->b != SERIAL_MAX && n->b <= st->remaining - 1;
+                    emit_line(st, indent, flat);
+                    if (!flat) flat = n->b != SERIAL_MAX && n->b <= st->remaining;
+                }
+                else emit_line(st, indent, 1);
+                n = &nodes[n->a];
+                continue;
+            default:
+                break;
+        }
+        if (s->size == 0 || st->stopped) return 0;
+        pp_render_frame f = s->frames[--s->size];
+        n = (const serial_node*)f.doc;
+        indent = f.indent;
+        flat = f.flat;
+    }
+}
+
+void _pp_pretty_serialized(const pp_writer* RESTRICT writer, const pp_settings* RESTRICT settings,
+        const void* RESTRICT data) {
+    pp_render_frame frames[64];
+    render_stack s = { frames, 0, sizeof(frames) / sizeof(frames[0]), 1, 0 };
+    render_state st;
+    render_init(&st, writer, settings, NULL, NULL);
+    render_serialized(&s, &st, (const serial_header*)data);
+    if (s.owned) free(s.frames);
+}
+
+
+/*
+ * Compiled documents are a linear sequence of instructions, with extensions
+ * evaluated and the document's structure reduced to what layout needs:
+ *
+ * - Nests set the indentation (in full, before max_indent is applied) on entry
+ *   and restore it on exit. Applying max_indent to the full indentation is the
+ *   same as applying it at every level, so no stack of indentations is needed.
+ * - Groups record the columns their content needs to be flat and where their
+ *   content ends. Flat groups contain only flat groups, so the end of the
+ *   outermost flat group is all the state needed.
+ * - Fills are lowered to a group for their first document and a fill
+ *   instruction, which is a line followed by a group, for each of the rest.
+ *
+ * Rendering is therefore a single loop without a stack. Text is not copied,
+ * so it must outlive the program.
+ */
+
+enum {
+    OP_TEXT,
+    OP_WORDS,
+    OP_LINE,
+    OP_SEP,
+    OP_INDENT,
+    OP_GROUP,
+    OP_FILL
+};
+
+typedef struct {
+    int op;
+    // Text and words: length. Indent: the full indentation. Group and fill: the
+    // columns needed to be flat.
+    size_t value;
+    // Group and fill: the index of the first instruction after its content.
+    size_t end;
+    const char* text;
+} compiled_op;
+
+struct _pp_program {
+    compiled_op* code;
+    size_t count;
+    size_t capacity;
+    // The documents made by extensions, which the code may refer to.
+    pp_ext_context ext;
+};
+
+static compiled_op* program_add(pp_program* p, int op, size_t value) {
+    if (p->count == p->capacity) {
+        size_t capacity = p->capacity == 0 ? 64 : p->capacity * 2;
+        compiled_op* code = (compiled_op*)malloc(capacity * sizeof(compiled_op));
+        if (code == NULL) return NULL;
+        if (p->count > 0) memcpy(code, p->code, p->count * sizeof(compiled_op));
+        free(p->code);
+        p->code = code;
+        p->capacity = capacity;
+    }
+    compiled_op* c = &p->code[p->count++];
+    c->op = op;
+    c->value = value;
+    c->end = 0;
+    c->text = NULL;
+    return c;
+}
+
+enum {
+    COMPILE_VISIT,
+    COMPILE_END_GROUP,
+    COMPILE_END_NEST
+};
+
+/*
+ * Compile d into p. Frames to visit hold the full indentation; frames ending
+ * a group hold the index of its instruction, and those ending a nest the
+ * indentation to restore. The measurement of the innermost open group's
+ * content so far is kept in m, with those of the enclosing groups on v.
+ */
+static int compile(render_stack* RESTRICT s, measure_values* RESTRICT v, pp_program* RESTRICT p,
+        const pp_settings* RESTRICT settings, const pp_doc* RESTRICT document) {
+    pp_measure_entry m = { NULL, 0, 0, 0 };
+    pp_measure_entry leaf = { NULL, 0, 0, 0 };
+    if (!stack_push(s, document, 0, COMPILE_VISIT)) return 0;
+    while (s->size > 0) {
+        pp_render_frame f = stack_pop(s);
+        compiled_op* c;
+        if (f.fill) {
+            // The documents of a fill after the first are preceded by a line.
+            measure_append(&m, &line_measure);
+            if (program_add(p, OP_FILL, 0) == NULL || !values_push(v, &m)
+                    || !stack_push(s, f.doc, p->count - 1, COMPILE_END_GROUP)
+                    || !stack_push(s, f.doc, f.indent, COMPILE_VISIT))
+                return 0;
+            m.width = m.trailing = 0;
+            continue;
+        }
+        if (f.flat == COMPILE_END_GROUP) {
+            c = &p->code[f.indent];
+            c->value = m.width - m.trailing;
+            c->end = p->count;
+            pp_measure_entry content = m;
+            m = v->values[--v->size];
+            measure_append(&m, &content);
+            continue;
+        }
+        if (f.flat == COMPILE_END_NEST) {
+            if (program_add(p, OP_INDENT, f.indent) == NULL) return 0;
+            continue;
+        }
+        const pp_doc* d = f.doc;
+        size_t indent;
+        int ok = 1;
+        switch (resolve(settings, &p->ext, &d, 0)) {
+            case PP_DOC_SEP:
+                ok = program_add(p, OP_SEP, 0) != NULL;
+                leaf.width = leaf.trailing = 1;
+                measure_append(&m, &leaf);
+                break;
+            case PP_DOC_TEXT:
+                c = program_add(p, OP_TEXT, DOCAS(d,text)->length);
+                if (c == NULL) return 0;
+                c->text = DOCAS(d,text)->text;
+                leaf.width = DOCAS(d,text)->length;
+                leaf.trailing = 0;
+                measure_append(&m, &leaf);
+                break;
+            case PP_DOC_WORDS:
+                c = program_add(p, OP_WORDS, DOCAS(d,words)->length);
+                if (c == NULL) return 0;
+                c->text = DOCAS(d,words)->text;
+                leaf.width = DOCAS(d,words)->length;
+                leaf.trailing = words_trailing(DOCAS(d,words));
+                measure_append(&m, &leaf);
+                break;
+            case PP_DOC_LINE:
+                ok = program_add(p, OP_LINE, 0) != NULL;
+                leaf.width = 1;
+                leaf.trailing = 0;
+                measure_append(&m, &leaf);
+                break;
+            case PP_DOC_NEST:
+                if (DOCAS(d,nest)->indent == 0) {
+                    ok = stack_push(s, DOCAS(d,nest)->nested, f.indent, COMPILE_VISIT);
+                    break;
+                }
+                indent = f.indent + DOCAS(d,nest)->indent;
+                if (indent < f.indent) indent = (size_t)-1;
+                ok = program_add(p, OP_INDENT, indent) != NULL
+                    && stack_push(s, d, f.indent, COMPILE_END_NEST)
+                    && stack_push(s, DOCAS(d,nest)->nested, indent, COMPILE_VISIT);
+                break;
+            case PP_DOC_APPEND:
+                ok = stack_push(s, DOCAS(d,append)->b, f.indent, COMPILE_VISIT)
+                    && stack_push(s, DOCAS(d,append)->a, f.indent, COMPILE_VISIT);
+                break;
+            case PP_DOC_CONCAT:
+                if (DOCAS(d,concat)->count > 1) ok = stack_push_rest(s, d, f.indent, COMPILE_VISIT, 0);
+                if (DOCAS(d,concat)->count > 0)
+                    ok = ok && stack_push(s, DOCAS(d,concat)->docs[0], f.indent, COMPILE_VISIT);
+                break;
+            case PP_DOC_FILL:
+                if (DOCAS(d,fill)->count == 0) break;
+                if (DOCAS(d,fill)->count > 1) ok = stack_push_rest(s, d, f.indent, COMPILE_VISIT, 1);
+                // The first document is a group.
+                ok = ok && program_add(p, OP_GROUP, 0) != NULL && values_push(v, &m)
+                    && stack_push(s, d, p->count - 1, COMPILE_END_GROUP)
+                    && stack_push(s, DOCAS(d,fill)->docs[0], f.indent, COMPILE_VISIT);
+                m.width = m.trailing = 0;
+                break;
+            case PP_DOC_GROUP:
+                ok = program_add(p, OP_GROUP, 0) != NULL && values_push(v, &m)
+                    && stack_push(s, d, p->count - 1, COMPILE_END_GROUP)
+                    && stack_push(s, DOCAS(d,group)->grouped, f.indent, COMPILE_VISIT);
+                m.width = m.trailing = 0;
+                break;
+            case PP_DOC_NIL:
+            default:
+                break;
+        }
+        if (!ok) return 0;
+    }
+    return 1;
+}
+
+void pp_program_free(pp_program* p) {
+    if (p == NULL) return;
+    free(p->code);
+    ext_context_free(&p->ext);
+    free(p);
+}
+
+pp_program* pp_compile(const pp_settings* RESTRICT settings, const pp_doc* RESTRICT document) {
+    pp_program* p = (pp_program*)calloc(1, sizeof(pp_program));
+    if (p == NULL) return NULL;
+    pp_render_frame frames[64];
+    render_stack s = { frames, 0, sizeof(frames) / sizeof(frames[0]), 1, 0 };
+    measure_values v = { NULL, 0, 0 };
+    int result = compile(&s, &v, p, settings, document);
+    if (s.owned) free(s.frames);
+    free(v.values);
+    if (!result) {
+        pp_program_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+void _pp_pretty_compiled(const pp_writer* RESTRICT writer, const pp_settings* RESTRICT settings,
+        const pp_program* RESTRICT program) {
+    render_state st;
+    render_init(&st, writer, settings, NULL, NULL);
+    const compiled_op* code = program->code;
+    size_t indent = 0;
+    size_t flat_end = 0;
+    for (size_t i = 0; i < program->count && !st.stopped; i++) {
+        const compiled_op* c = &code[i];
+        int flat = i < flat_end;
+        switch (c->op) {
+            case OP_TEXT:
+                emit_text(&st, indent, flat, c->text, c->value);
+                break;
+            case OP_WORDS:
+                emit_words(&st, indent, flat, c->text, c->value);
+                break;
+            case OP_LINE:
+                emit_line(&st, indent, flat);
+                break;
+            case OP_SEP:
+                emit_sep(&st, indent);
+                break;
+            case OP_INDENT:
+                indent = c->value < settings->max_indent ? c->value : settings->max_indent;
+                break;
+            case OP_GROUP:
+                if (!flat && c->value <= st.remaining) flat_end = c->end;
+                break;
+            case OP_FILL:
+                if (!flat) {
+                    int fits = st.remaining > 0 && c->value <= st.remaining - 1;
+                    emit_line(&st, indent, fits);
+                    if (fits || c->value <= st.remaining) flat_end = c->end;
+                }
+                else emit_line(&st, indent, 1);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+#endif
+
+typedef struct {
+    char* buffer;
+    size_t capacity;
+    size_t length;
+} memory_output;
+
+static void memory_write(void* data, const char* RESTRICT text, size_t length) {
+    memory_output* m = (memory_output*)data;
+    if (m->length < m->capacity) {
+        size_t n = m->capacity - m->length;
+        memcpy(m->buffer + m->length, text, length < n ? length : n);
+    }
+    m->length += length;
+}
+
+size_t pp_render_into(char* RESTRICT buffer, size_t capacity, const pp_settings* RESTRICT settings,
+        const pp_doc* RESTRICT document) {
+    memory_output m = { buffer, capacity, 0 };
+    pp_writer w;
+    w.write = memory_write;
+    w.data = &m;
+    _pp_pretty(&w, settings, document);
+    return m.length;
+}
+
+size_t pp_render_size(const pp_settings* RESTRICT settings, const pp_doc* RESTRICT document) {
+    return pp_render_into(NULL, 0, settings, document);
+}
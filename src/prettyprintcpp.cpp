@@ -1,4 +1,11 @@
 #include <cstring>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "prettyprint.h"
 
@@ -24,62 +31,107 @@ doc_string::doc_string(const std::string& s)
     _pp_text(static_cast<pp_doc_text*>(this), this->s.data(), this->s.size());
 }
 
-doc_nest::doc_nest(size_t indent, std::shared_ptr<const doc> nested)
-    : s_nested(nested)
+doc_words::doc_words(const std::string& s)
+    : s(s)
 {
-    _pp_nest(static_cast<pp_doc_nest*>(this), indent, s_nested.get());
+    _pp_words(static_cast<pp_doc_words*>(this), this->s.data(), this->s.size());
 }
 
-void doc_nest::set_nested(std::shared_ptr<const doc> nested) {
-    s_nested = nested;
-    this->nested = s_nested.get();
+template <typename Handle>
+basic_doc_nest<Handle>::basic_doc_nest(size_t indent, Handle nested)
+    : s_nested(std::move(nested))
+{
+    _pp_nest(static_cast<pp_doc_nest*>(this), indent, s_nested.get());
 }
 
-
-doc_append::doc_append(std::shared_ptr<const doc> a, std::shared_ptr<const doc> b)
-    : s_a(a)
-    , s_b(b)
+template <typename Handle>
+basic_doc_append<Handle>::basic_doc_append(Handle a, Handle b)
+    : s_a(std::move(a))
+    , s_b(std::move(b))
 {
     _pp_append(static_cast<pp_doc_append*>(this), s_a.get(), s_b.get());
 }
 
-doc_group::doc_group(std::shared_ptr<const doc> grouped)
-    : s_grouped(grouped)
+template <typename Handle>
+basic_doc_group<Handle>::basic_doc_group(Handle grouped)
+    : s_grouped(std::move(grouped))
 {
     _pp_group(static_cast<pp_doc_group*>(this), s_grouped.get());
 }
 
-static std::shared_ptr<doc> get_words(const char* t) {
-    const char* start = t;
-    while (*t != '\0' && *t != ' ' && *t != '\n') t++;
-    if (*t == '\0') {
-        if (start == t) return nil();
-        return text(start, t - start);
-    }
-    else {
-        auto rest = get_words(t+1);
+template <typename Handle>
+basic_doc_concat<Handle>::basic_doc_concat(std::vector<Handle> docs)
+    : s_handles(std::move(docs))
+{
+    s_docs.reserve(s_handles.size());
+    for (const Handle& h : s_handles) s_docs.push_back(h.get());
+    _pp_concat(static_cast<pp_doc_concat*>(this), s_docs.data(), s_docs.size());
+}
 
-        std::shared_ptr<doc> s;
-        if (*t == '\n') s = line();
-        else s = sep();
+template <typename Handle>
+basic_doc_fill<Handle>::basic_doc_fill(std::vector<Handle> docs)
+    : basic_doc_concat<Handle>(std::move(docs))
+{
+    _pp_fill(static_cast<pp_doc_fill*>(this), this->docs, this->count);
+}
 
-        return text(start, t - start) + s + rest;
+namespace {
+
+// The document made by a lazy document, which holds on to it until the render
+// is done. It is allocated from the render's context.
+template <typename Handle>
+struct lazy_result : public pp_doc_nest {
+    explicit lazy_result(Handle h)
+        : h(std::move(h))
+    {
+        _pp_nest(static_cast<pp_doc_nest*>(this), 0, this->h.get());
     }
+    Handle h;
+};
+
 }
 
-doc_words::doc_words(const std::string& s)
-    : doc_nest(0, nullptr)
-    , s(std::move(s))
+template <typename Handle>
+basic_doc_lazy<Handle>::basic_doc_lazy(std::function<Handle()> make)
+    : s_make(std::move(make))
 {
-    set_nested(get_words(this->s.data()));
+    _pp_lazy(static_cast<pp_doc_lazy*>(this), force, release, this);
+}
+
+template <typename Handle>
+const pp_doc* basic_doc_lazy<Handle>::force(void* data, pp_ext_context* context) {
+    auto self = static_cast<basic_doc_lazy*>(data);
+    void* p = pp_ext_alloc(context, sizeof(lazy_result<Handle>));
+    if (p == nullptr) return nullptr;
+    auto r = new (p) lazy_result<Handle>(self->s_make());
+    return reinterpret_cast<const pp_doc*>(static_cast<pp_doc_nest*>(r));
+}
+
+template <typename Handle>
+void basic_doc_lazy<Handle>::release(void*, const pp_doc* d) {
+    auto n = reinterpret_cast<pp_doc_nest*>(const_cast<pp_doc*>(d));
+    static_cast<lazy_result<Handle>*>(n)->~lazy_result();
 }
 
+template struct basic_doc_nest<std::shared_ptr<const doc>>;
+template struct basic_doc_append<std::shared_ptr<const doc>>;
+template struct basic_doc_group<std::shared_ptr<const doc>>;
+template struct basic_doc_concat<std::shared_ptr<const doc>>;
+template struct basic_doc_fill<std::shared_ptr<const doc>>;
+template struct basic_doc_lazy<std::shared_ptr<const doc>>;
+
+template struct basic_doc_nest<doc_ref>;
+template struct basic_doc_append<doc_ref>;
+template struct basic_doc_group<doc_ref>;
+template struct basic_doc_concat<doc_ref>;
+template struct basic_doc_fill<doc_ref>;
+template struct basic_doc_lazy<doc_ref>;
+
 }
 
 template <typename T, typename... Args>
 static std::shared_ptr<doc> make_shared_d(Args&&... args) {
-    auto t = std::shared_ptr<T>(new T(std::forward<Args>(args)...), std::default_delete<T>());
-    return std::shared_ptr<doc>(t, t->as_doc());
+    return impl::allocate_doc<T>(std::allocator<T>(), std::forward<Args>(args)...);
 }
 
 static void no_delete(doc*) {}
@@ -89,12 +141,16 @@ static std::shared_ptr<T> make_shared_static(T* v) {
     return std::shared_ptr<T>(v, no_delete);
 }
 
+// The static documents share one control block each rather than allocating
+// one per call.
 std::shared_ptr<doc> nil() {
-    return make_shared_static((doc*)_pp_nil);
+    static const std::shared_ptr<doc> d = make_shared_static((doc*)_pp_nil);
+    return d;
 }
 
 std::shared_ptr<doc> sep() {
-    return make_shared_static((doc*)_pp_sep);
+    static const std::shared_ptr<doc> d = make_shared_static((doc*)_pp_sep);
+    return d;
 }
 
 std::shared_ptr<doc> text(const char* t, size_t length) {
@@ -110,32 +166,53 @@ std::shared_ptr<doc> text(const std::string& s) {
 }
 
 std::shared_ptr<doc> line() {
-    return make_shared_static((doc*)_pp_line);
+    static const std::shared_ptr<doc> d = make_shared_static((doc*)_pp_line);
+    return d;
 }
 
 std::shared_ptr<doc> nest(size_t indent, std::shared_ptr<const doc> nested) {
-    return make_shared_d<data::doc_nest>(indent, nested);
+    return make_shared_d<data::doc_nest>(indent, std::move(nested));
 }
 
 std::shared_ptr<doc> append(std::shared_ptr<const doc> a, std::shared_ptr<const doc> b) {
-    return make_shared_d<data::doc_append>(a, b);
+    return make_shared_d<data::doc_append>(std::move(a), std::move(b));
 }
 
 std::shared_ptr<doc> group(std::shared_ptr<const doc> grouped) {
-    return make_shared_d<data::doc_group>(grouped);
+    return make_shared_d<data::doc_group>(std::move(grouped));
+}
+
+std::shared_ptr<doc> concat(std::vector<std::shared_ptr<const doc>> docs) {
+    return make_shared_d<data::doc_concat>(std::move(docs));
+}
+
+std::shared_ptr<doc> concat(std::initializer_list<std::shared_ptr<const doc>> docs) {
+    return concat(std::vector<std::shared_ptr<const doc>>(docs));
+}
+
+std::shared_ptr<doc> fill(std::vector<std::shared_ptr<const doc>> docs) {
+    return make_shared_d<data::doc_fill>(std::move(docs));
+}
+
+std::shared_ptr<doc> fill(std::initializer_list<std::shared_ptr<const doc>> docs) {
+    return fill(std::vector<std::shared_ptr<const doc>>(docs));
+}
+
+std::shared_ptr<doc> lazy(std::function<std::shared_ptr<const doc>()> make) {
+    return make_shared_d<data::doc_lazy>(std::move(make));
 }
 
 std::shared_ptr<doc> operator+(std::shared_ptr<const doc> a, std::shared_ptr<const doc> b) {
-    return append(a, b);
+    return append(std::move(a), std::move(b));
 }
 
 std::shared_ptr<doc> operator+(std::shared_ptr<const doc> a, const std::string& b) {
-    return a + words(b);
+    return std::move(a) + words(b);
 }
 
 /** Aliases of append that add a separator. */
 std::shared_ptr<doc> operator<<(std::shared_ptr<const doc> a, std::shared_ptr<const doc> b) {
-    return a + sep() + b;
+    return std::move(a) + sep() + std::move(b);
 }
 
 std::shared_ptr<doc> words(const std::string& words) {
@@ -143,7 +220,120 @@ std::shared_ptr<doc> words(const std::string& words) {
 }
 
 std::shared_ptr<doc> operator<<(std::shared_ptr<const doc> a, const std::string& w) {
-    return a << words(w);
+    return std::move(a) << words(w);
+}
+
+namespace impl {
+
+template <typename T>
+struct ref_holder : public ref_node {
+    template <typename... Args>
+    ref_holder(Args&&... args)
+        : value(std::forward<Args>(args)...)
+    {}
+    T value;
+};
+
+template <typename T, typename... Args>
+static doc_ref make_ref(Args&&... args) {
+    auto h = new ref_holder<T>(std::forward<Args>(args)...);
+    return doc_ref(h, h->value.as_doc());
+}
+
+}
+
+doc_ref::doc_ref(std::shared_ptr<const doc> shared)
+    : node(nullptr)
+    , d(shared.get())
+{
+    node = new impl::ref_holder<std::shared_ptr<const doc>>(std::move(shared));
+    node->refs++;
+}
+
+namespace local {
+
+doc_ref nil() {
+    return doc_ref(nullptr, (const doc*)_pp_nil);
+}
+
+doc_ref sep() {
+    return doc_ref(nullptr, (const doc*)_pp_sep);
+}
+
+doc_ref text(const char* t, size_t length) {
+    return impl::make_ref<data::doc_text>(t, length);
+}
+
+doc_ref text(const char* str) {
+    return impl::make_ref<data::doc_text>(str);
+}
+
+doc_ref text(const std::string& s) {
+    return impl::make_ref<data::doc_string>(s);
+}
+
+doc_ref line() {
+    return doc_ref(nullptr, (const doc*)_pp_line);
+}
+
+doc_ref nest(size_t indent, doc_ref nested) {
+    return impl::make_ref<data::basic_doc_nest<doc_ref>>(indent, std::move(nested));
+}
+
+doc_ref append(doc_ref a, doc_ref b) {
+    return impl::make_ref<data::basic_doc_append<doc_ref>>(std::move(a), std::move(b));
+}
+
+doc_ref group(doc_ref grouped) {
+    return impl::make_ref<data::basic_doc_group<doc_ref>>(std::move(grouped));
+}
+
+doc_ref concat(std::vector<doc_ref> docs) {
+    return impl::make_ref<data::basic_doc_concat<doc_ref>>(std::move(docs));
+}
+
+doc_ref concat(std::initializer_list<doc_ref> docs) {
+    return concat(std::vector<doc_ref>(docs));
+}
+
+doc_ref fill(std::vector<doc_ref> docs) {
+    return impl::make_ref<data::basic_doc_fill<doc_ref>>(std::move(docs));
+}
+
+doc_ref fill(std::initializer_list<doc_ref> docs) {
+    return fill(std::vector<doc_ref>(docs));
+}
+
+doc_ref lazy(std::function<doc_ref()> make) {
+    return impl::make_ref<data::basic_doc_lazy<doc_ref>>(std::move(make));
+}
+
+doc_ref words(const std::string& words) {
+    return impl::make_ref<data::doc_words>(words);
+}
+
+}
+
+doc_ref operator+(doc_ref a, doc_ref b) {
+    return local::append(std::move(a), std::move(b));
+}
+
+doc_ref operator+(doc_ref a, const std::string& b) {
+    return std::move(a) + local::words(b);
+}
+
+doc_ref operator<<(doc_ref a, doc_ref b) {
+    return std::move(a) + local::sep() + std::move(b);
+}
+
+doc_ref operator<<(doc_ref a, const std::string& w) {
+    return std::move(a) << local::words(w);
+}
+
+std::shared_ptr<const doc> freeze(doc_ref d) {
+    auto owner = new doc_ref(std::move(d));
+    // If the control block can't be allocated, the deleter is called.
+    return std::shared_ptr<const doc>(owner->get(), [owner](const doc*) { delete owner; });
 }
 
 settings::settings()
@@ -151,6 +341,11 @@ settings::settings()
     width = 80;
     max_indent = 40;
     evaluate_extension = NULL;
+    resolve_extension = NULL;
+    pure_extensions = 0;
+    max_lines = 0;
+    max_bytes = 0;
+    elision = NULL;
 }
 
 change_settings::change_settings() {}
@@ -169,8 +364,40 @@ change_settings change_settings::set_max_indent(size_t indent) {
     return s;
 }
 
+change_settings change_settings::set_max_lines(size_t lines) {
+    change_settings s;
+    s.field = F_MAX_LINES;
+    s.max_lines = lines;
+    return s;
+}
+
+change_settings change_settings::set_max_bytes(size_t bytes) {
+    change_settings s;
+    s.field = F_MAX_BYTES;
+    s.max_bytes = bytes;
+    return s;
+}
+
+change_settings change_settings::set_elision(const char* elision) {
+    change_settings s;
+    s.field = F_ELISION;
+    s.elision = elision;
+    return s;
+}
+
 change_settings set_width(size_t width) { return change_settings::set_width(width); }
 change_settings set_max_indent(size_t indent) { return change_settings::set_max_indent(indent); }
+change_settings set_max_lines(size_t lines) { return change_settings::set_max_lines(lines); }
+change_settings set_max_bytes(size_t bytes) { return change_settings::set_max_bytes(bytes); }
+change_settings set_elision(const char* elision) { return change_settings::set_elision(elision); }
+
+void* ext_alloc(pp_ext_context* context, size_t size) {
+    return pp_ext_alloc(context, size);
+}
+
+const doc* ext_text(pp_ext_context* context, const char* text, size_t length) {
+    return static_cast<const doc*>(pp_ext_text(context, text, length));
+}
 
 settings& operator<<(settings& a, change_settings const& b) {
     switch (b.field) {
@@ -180,9 +407,21 @@ settings& operator<<(settings& a, change_settings const& b) {
         case change_settings::F_MAX_INDENT:
             a.max_indent = b.max_indent;
             break;
+        case change_settings::F_MAX_LINES:
+            a.max_lines = b.max_lines;
+            break;
+        case change_settings::F_MAX_BYTES:
+            a.max_bytes = b.max_bytes;
+            break;
+        case change_settings::F_ELISION:
+            a.elision = b.elision;
+            break;
         case change_settings::F_EXT_EVAL:
             a.evaluate_extension = (pp_doc_type_t (*)(const pp_settings*, pp_doc_type_t,pp_doc**))b.ext_eval;
             break;
+        case change_settings::F_EXT_RESOLVE:
+            a.resolve_extension = (const pp_doc* (*)(const pp_settings*, const pp_doc*, pp_ext_context*))b.ext_resolve;
+            break;
     }
     return a;
 }
@@ -194,11 +433,19 @@ namespace impl {
     }
 
     void write_out(std::ostream* os, pp_settings* s, std::shared_ptr<const doc> d) {
+        write_out(os, s, d.get());
+    }
+
+    void write_out(std::ostream* os, pp_settings* s, const doc* d) {
         pp_writer wr;
         wr.write = stream_writer;
         wr.data = (void*)os;
 
-        _pp_pretty(&wr, s, static_cast<const pp_doc*>(d.get()));
+        char buffer[8192];
+        pp_buffered_writer b;
+        _pp_buffered_writer(&b, buffer, sizeof(buffer), &wr);
+        _pp_pretty(&b.writer, s, static_cast<const pp_doc*>(d));
+        _pp_buffered_flush(&b);
     }
 }
 
@@ -213,5 +460,28 @@ std::ostream& operator<<(std::ostream& os, std::shared_ptr<doc> d) {
     return w << d;
 }
 
+std::ostream& operator<<(std::ostream& os, const doc_ref& d) {
+    auto w = writer<settings>(os);
+    return w << d;
+}
+
+static std::string render_string(const pp_doc* document, const pp_settings& s) {
+    std::string result(pp_render_size(&s, document), '\0');
+    size_t length = pp_render_into(&result[0], result.size(), &s, document);
+    // Extensions may render differently the second time.
+    if (length != result.size()) {
+        result.resize(length);
+        pp_render_into(&result[0], result.size(), &s, document);
+    }
+    return result;
+}
+
+std::string to_string(std::shared_ptr<const doc> d, const pp_settings& s) {
+    return render_string(static_cast<const pp_doc*>(d.get()), s);
 }
 
+std::string to_string(const doc_ref& d, const pp_settings& s) {
+    return render_string(static_cast<const pp_doc*>(d.get()), s);
+}
+
+}
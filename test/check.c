@@ -0,0 +1,819 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prettyprint.h"
+
+/*
+ * Checks every way of rendering a document against the reference renderer in
+ * reference.c, on random documents of every type (including extensions and
+ * lazy documents) at random widths, with and without output limits, and with
+ * extensions evaluated and resolved. Run with `make check`.
+ *
+ * Usage: check [iterations] [seed]
+ */
+
+void reference_pretty(const pp_writer* writer, const pp_settings* settings, const pp_doc* document);
+
+#define DOCAS(d,n) ((const pp_doc_##n*)(d))
+
+typedef struct {
+    char* text;
+    size_t length;
+    size_t capacity;
+} output;
+
+static void output_write(void* data, const char* text, size_t length) {
+    output* o = (output*)data;
+    if (length == 0) return;
+    if (o->length + length > o->capacity) {
+        o->capacity = (o->length + length) * 2 + 64;
+        if ((o->text = (char*)realloc(o->text, o->capacity)) == NULL) abort();
+    }
+    memcpy(o->text + o->length, text, length);
+    o->length += length;
+}
+
+static int output_equal(const output* a, const output* b) {
+    return a->length == b->length && (a->length == 0 || memcmp(a->text, b->text, a->length) == 0);
+}
+
+static void output_print(const char* label, const output* o) {
+    printf("--- %s\n%.*s\n", label, (int)o->length, o->text);
+}
+
+/*
+ * Extensions: EXT_TEXT is the text "ext", and EXT_FILTER is its inner document
+ * if its value is below the level in the settings and nil otherwise. Each can
+ * be evaluated (with evaluate_extension) or resolved (with resolve_extension)
+ * to the same output. Every pp_settings here is the start of a check_settings.
+ */
+
+typedef struct {
+    pp_settings settings;
+    int level;
+} check_settings;
+
+enum {
+    EXT_TEXT = PP_DOC_EXTENSION_START,
+    EXT_FILTER
+};
+
+typedef struct {
+    pp_doc_type_t type;
+    int v;
+    const pp_doc* inner;
+} ext_filter;
+
+static pp_doc_type_t evaluate_ext(const pp_settings* settings, pp_doc_type_t type, pp_doc** d) {
+    // An EXT_TEXT document is made as a text.
+    if (type == (pp_doc_type_t)EXT_TEXT) return PP_DOC_TEXT;
+    const ext_filter* f = (const ext_filter*)*d;
+    if (f->v >= ((const check_settings*)settings)->level) return PP_DOC_NIL;
+    *d = (pp_doc*)f->inner;
+    return (*d)->type;
+}
+
+// The extensions resolved, to check each is resolved once per render.
+static const pp_doc* resolved[1 << 16];
+static size_t resolved_count;
+
+static const pp_doc* resolve_ext(const pp_settings* settings, const pp_doc* d, pp_ext_context* context) {
+    size_t i = __sync_fetch_and_add(&resolved_count, 1);
+    if (i < sizeof(resolved) / sizeof(resolved[0])) resolved[i] = d;
+    if (d->type == (pp_doc_type_t)EXT_TEXT) return pp_ext_text(context, "ext", 3);
+    const ext_filter* f = (const ext_filter*)d;
+    return f->v < ((const check_settings*)settings)->level ? f->inner : NULL;
+}
+
+static int resolved_twice(void) {
+    size_t n = resolved_count < sizeof(resolved) / sizeof(resolved[0]) ? resolved_count
+        : sizeof(resolved) / sizeof(resolved[0]);
+    for (size_t i = 0; i < n; i++)
+        for (size_t j = i + 1; j < n; j++)
+            if (resolved[i] == resolved[j]) return 1;
+    return 0;
+}
+
+static void free_ext(pp_doc* d) {
+    if (d->type == (pp_doc_type_t)EXT_FILTER) pp_free_ext(free_ext, (pp_doc*)((ext_filter*)d)->inner);
+    free(d);
+}
+
+/*
+ * Lazy documents hold a generated document, which is what they produce. Those
+ * with a release function count the documents produced and released by the
+ * library (the reference renderer forces them without a context, and releases
+ * nothing), which should match once every render is done.
+ */
+
+static int forced;
+static int released;
+
+static const pp_doc* lazy_force(void* data, pp_ext_context* context) {
+    if (context != NULL) __sync_fetch_and_add(&forced, 1);
+    return (const pp_doc*)data;
+}
+
+static const pp_doc* lazy_force_unreleased(void* data, pp_ext_context* context) {
+    (void)context;
+    return (const pp_doc*)data;
+}
+
+static void lazy_release(void* data, const pp_doc* d) {
+    if (d != data) abort();
+    __sync_fetch_and_add(&released, 1);
+}
+
+/*
+ * Random documents. Lazy documents don't own what they produce, so it is kept
+ * to be freed with the document.
+ */
+
+static const char* texts[] = { "a", "bb", "ccc", "dddd", "eeeee", "ffffffffffff", "" };
+static const char* words[] = {
+    "a", "bb", "ccc", "dddd", "eeeee", "ffffffffffff", "", "x y", "hello world foo", "long  words\nhere",
+    "  leading and trailing  ", "a\n", "\n", " ",
+    "the quick brown fox jumps over the lazy dog\nand then some more words here   ",
+    "abcdefghijklmnopqrstuvwxyz0123456789 x"
+};
+
+typedef struct {
+    pp_doc* produced[4096];
+    size_t count;
+    int fills;
+} generated;
+
+static pp_doc* generate(generated* g, int depth) {
+    const pp_doc* docs[7];
+    size_t n;
+    switch (rand() % (depth > 0 ? 15 : 5)) {
+        case 0:
+            return pp_nil();
+        case 1:
+            return pp_sep();
+        case 2:
+            return pp_line();
+        case 3:
+        case 4:
+            {
+                const char* t = texts[rand() % (sizeof(texts) / sizeof(texts[0]))];
+                return pp_text(t, strlen(t));
+            }
+        case 5:
+            return pp_nest(rand() % 5, generate(g, depth - 1));
+        case 6:
+        case 7:
+            {
+                pp_doc* a = generate(g, depth - 1);
+                return pp_append(a, generate(g, depth - 1));
+            }
+        case 8:
+            return pp_group(generate(g, depth - 1));
+        case 9:
+            return pp_words(words[rand() % (sizeof(words) / sizeof(words[0]))]);
+        case 10:
+            {
+                pp_doc* t = pp_text("ext", 3);
+                t->type = (pp_doc_type_t)EXT_TEXT;
+                return t;
+            }
+        case 11:
+            {
+                ext_filter* f = (ext_filter*)malloc(sizeof(ext_filter));
+                if (f == NULL) abort();
+                f->type = (pp_doc_type_t)EXT_FILTER;
+                f->v = rand() % 4;
+                f->inner = generate(g, depth - 1);
+                return (pp_doc*)f;
+            }
+        case 12:
+            n = rand() % 5;
+            for (size_t i = 0; i < n; i++) docs[i] = generate(g, depth - 1);
+            return pp_concat(docs, n);
+        case 13:
+            n = rand() % 7;
+            for (size_t i = 0; i < n; i++) docs[i] = generate(g, depth - 1);
+            g->fills = 1;
+            return pp_fill(docs, n);
+        default:
+            {
+                pp_doc* inner = generate(g, depth - 1);
+                if (g->count == sizeof(g->produced) / sizeof(g->produced[0])) return inner;
+                g->produced[g->count++] = inner;
+                return rand() % 2 ? pp_lazy(lazy_force, lazy_release, inner)
+                    : pp_lazy(lazy_force_unreleased, NULL, inner);
+            }
+    }
+}
+
+static void generated_free(generated* g, pp_doc* d) {
+    pp_free_ext(free_ext, d);
+    for (size_t i = 0; i < g->count; i++) pp_free_ext(free_ext, g->produced[i]);
+    g->count = 0;
+}
+
+static int is_parent(const pp_doc* d) {
+    return (d->type >= PP_DOC_NEST && d->type <= PP_DOC_CONCAT) || d->type == PP_DOC_FILL;
+}
+
+static size_t child_count(const pp_doc* d) {
+    if (d->type == PP_DOC_APPEND) return 2;
+    if (d->type == PP_DOC_CONCAT || d->type == PP_DOC_FILL) return DOCAS(d,concat)->count;
+    return 1;
+}
+
+static const pp_doc* child(const pp_doc* d, size_t i) {
+    switch (d->type) {
+        case PP_DOC_NEST:
+            return DOCAS(d,nest)->nested;
+        case PP_DOC_GROUP:
+            return DOCAS(d,group)->grouped;
+        case PP_DOC_APPEND:
+            return i == 0 ? DOCAS(d,append)->a : DOCAS(d,append)->b;
+        default:
+            return DOCAS(d,concat)->docs[i];
+    }
+}
+
+/*
+ * The renderers checked. Each writes document to writer as _pp_pretty would,
+ * returning 0, or nonzero (having said why) if something other than the
+ * output is wrong.
+ */
+
+typedef int (*renderer)(const pp_writer* writer, const pp_settings* settings, const pp_doc* document);
+
+static int render_pretty(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    _pp_pretty(writer, settings, document);
+    return 0;
+}
+
+static int render_stack(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    static pp_render_frame frames[1024];
+    return _pp_pretty_stack(writer, settings, document, frames, sizeof(frames) / sizeof(frames[0]));
+}
+
+static int render_buffered(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    char buffer[16];
+    pp_buffered_writer b;
+    _pp_buffered_writer(&b, buffer, 1 + rand() % sizeof(buffer), writer);
+    _pp_pretty(&b.writer, settings, document);
+    _pp_buffered_flush(&b);
+    return 0;
+}
+
+static int render_parallel(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    return _pp_pretty_parallel(writer, settings, document, rand() % 5);
+}
+
+static int render_measured(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    pp_measure_table* m = pp_measure(document);
+    if (m == NULL) return 1;
+    _pp_pretty_measured(writer, settings, m, document);
+    pp_measure_free(m);
+    return 0;
+}
+
+static int same_measurements(const pp_measure_table* a, const pp_measure_table* b) {
+    if (a->count != b->count) return 0;
+    for (size_t i = 0; i < a->capacity; i++) {
+        const pp_measure_entry* e = &a->entries[i];
+        if (e->doc == NULL) continue;
+        const pp_measure_entry* f = NULL;
+        for (size_t j = 0; j < b->capacity && f == NULL; j++) if (b->entries[j].doc == e->doc) f = &b->entries[j];
+        if (f == NULL || f->width != e->width || f->trailing != e->trailing || f->dynamic != e->dynamic) return 0;
+    }
+    return 1;
+}
+
+static int render_measured_parallel(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    pp_measure_table* m = pp_measure_parallel(document, 2 + rand() % 4);
+    pp_measure_table* serial = pp_measure(document);
+    int result = 1;
+    if (m == NULL || serial == NULL) goto done;
+    if (!same_measurements(serial, m)) {
+        printf("pp_measure_parallel measured differently from pp_measure\n");
+        goto done;
+    }
+    _pp_pretty_measured(writer, settings, m, document);
+    result = 0;
+
+done:
+    if (m != NULL) pp_measure_free(m);
+    if (serial != NULL) pp_measure_free(serial);
+    return result;
+}
+
+// Rendered twice from the same measurements, which must write the same.
+static int render_measured_resolved(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    check_settings pure = *(const check_settings*)settings;
+    pure.settings.pure_extensions = 1;
+    pp_measure_table* m = pp_measure_resolved(&pure.settings, document);
+    if (m == NULL) return 1;
+    output first = { NULL, 0, 0 };
+    pp_writer w = { output_write, &first };
+    _pp_pretty_measured(&w, &pure.settings, m, document);
+    _pp_pretty_measured(writer, &pure.settings, m, document);
+    output second = first;
+    second.length = 0;
+    w.data = &second;
+    _pp_pretty_measured(&w, &pure.settings, m, document);
+    int result = !output_equal(&first, &second);
+    if (result) printf("measurements from pp_measure_resolved rendered differently the second time\n");
+    free(second.text);
+    pp_measure_free(m);
+    return result;
+}
+
+static int render_into(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    size_t size = pp_render_size(settings, document);
+    char* buffer = (char*)malloc(size + 1);
+    if (buffer == NULL) return 1;
+    size_t written = pp_render_into(buffer, size, settings, document);
+    if (written == size) writer->write(writer->data, buffer, size);
+    else printf("pp_render_into wrote %zu bytes, but pp_render_size said %zu\n", written, size);
+    free(buffer);
+    return written != size;
+}
+
+// Feed a document to a stream as a producer would, evaluating extensions and
+// lazy documents itself.
+static int stream_document(pp_stream* st, const pp_settings* settings, const pp_doc* d) {
+    pp_doc_type_t tp = d->type;
+    while (tp >= PP_DOC_EXTENSION_START || tp == PP_DOC_LAZY) {
+        if (tp == PP_DOC_LAZY) {
+            d = (const pp_doc*)DOCAS(d,lazy)->data;
+            tp = d->type;
+        }
+        else tp = evaluate_ext(settings, tp, (pp_doc**)&d);
+    }
+    int result = 0;
+    switch (tp) {
+        case PP_DOC_SEP:
+            return pp_stream_sep(st);
+        case PP_DOC_LINE:
+            return pp_stream_line(st);
+        case PP_DOC_TEXT:
+            return pp_stream_text(st, DOCAS(d,text)->text, DOCAS(d,text)->length);
+        case PP_DOC_WORDS:
+            {
+                const pp_doc_words* w = DOCAS(d,words);
+                size_t start = 0;
+                for (size_t i = 0; result >= 0; i++) {
+                    if (i < w->length && w->text[i] != ' ' && w->text[i] != '\n') continue;
+                    if (i < w->length || i != start) result = pp_stream_text(st, w->text + start, i - start);
+                    if (i == w->length || result < 0) break;
+                    result = w->text[i] == '\n' ? pp_stream_line(st) : pp_stream_sep(st);
+                    start = i + 1;
+                }
+                return result;
+            }
+        case PP_DOC_NEST:
+            if (pp_stream_nest_push(st, DOCAS(d,nest)->indent) < 0) return -1;
+            if (stream_document(st, settings, DOCAS(d,nest)->nested) < 0) return -1;
+            return pp_stream_nest_pop(st);
+        case PP_DOC_APPEND:
+            if (stream_document(st, settings, DOCAS(d,append)->a) < 0) return -1;
+            return stream_document(st, settings, DOCAS(d,append)->b);
+        case PP_DOC_CONCAT:
+            for (size_t i = 0; i < DOCAS(d,concat)->count && result >= 0; i++)
+                result = stream_document(st, settings, DOCAS(d,concat)->docs[i]);
+            return result;
+        case PP_DOC_GROUP:
+            if (pp_stream_group_open(st) < 0) return -1;
+            if (stream_document(st, settings, DOCAS(d,group)->grouped) < 0) return -1;
+            return pp_stream_group_close(st);
+        default:
+            return 0;
+    }
+}
+
+static int expect(output* o, const pp_settings* settings, const pp_doc* d);
+
+// Once the output is cut, every call returns 1.
+static int render_stream(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    pp_stream* st = pp_stream_begin(writer, settings);
+    if (st == NULL) return 1;
+    int result = stream_document(st, settings, document);
+    // Popping a nest that isn't open writes nothing, but says whether the
+    // output has been cut.
+    int stopped = pp_stream_nest_pop(st);
+    int after = stopped == 1 ? pp_stream_line(st) : 1;
+    if (pp_stream_end(st) != 0 || result < 0 || stopped < 0) return 1;
+    output scratch = { NULL, 0, 0 };
+    int cut = expect(&scratch, settings, document);
+    free(scratch.text);
+    if ((result == 1 || stopped == 1) && !cut) {
+        printf("a stream whose output was not cut returned 1\n");
+        return 1;
+    }
+    if (after != 1 || (result == 1 && stopped != 1)) {
+        printf("a stream whose output was cut returned 0\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int render_serialized(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    size_t size = pp_doc_serialize_into(NULL, 0, settings, document);
+    void* buffer = malloc(size);
+    if (buffer == NULL) return 1;
+    int result = pp_doc_serialize_into(buffer, size, settings, document) != size || pp_doc_validate(buffer, size) != 0;
+    if (result) printf("the serialized document is %zu bytes, or is invalid\n", size);
+    else _pp_pretty_serialized(writer, settings, buffer);
+    free(buffer);
+    return result;
+}
+
+static int render_compiled(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    pp_program* p = pp_compile(settings, document);
+    if (p == NULL) return 1;
+    _pp_pretty_compiled(writer, settings, p);
+    pp_program_free(p);
+    return 0;
+}
+
+static const pp_doc* intern(pp_interner* in, const pp_doc* d) {
+    const pp_doc* docs[7];
+    switch (d->type) {
+        case PP_DOC_TEXT:
+            return pp_intern_text(in, DOCAS(d,text)->text, DOCAS(d,text)->length);
+        case PP_DOC_WORDS:
+            return pp_intern_words(in, DOCAS(d,words)->text);
+        case PP_DOC_NEST:
+            return pp_intern_nest(in, DOCAS(d,nest)->indent, intern(in, DOCAS(d,nest)->nested));
+        case PP_DOC_APPEND:
+            docs[0] = intern(in, DOCAS(d,append)->a);
+            return pp_intern_append(in, docs[0], intern(in, DOCAS(d,append)->b));
+        case PP_DOC_GROUP:
+            return pp_intern_group(in, intern(in, DOCAS(d,group)->grouped));
+        case PP_DOC_CONCAT:
+        case PP_DOC_FILL:
+            for (size_t i = 0; i < DOCAS(d,concat)->count; i++) docs[i] = intern(in, DOCAS(d,concat)->docs[i]);
+            return d->type == PP_DOC_FILL ? pp_intern_fill(in, docs, DOCAS(d,concat)->count)
+                : pp_intern_concat(in, docs, DOCAS(d,concat)->count);
+        default:
+            return d;
+    }
+}
+
+// Interning a document twice must give the same document.
+static int render_interned(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    pp_interner* in = pp_interner_create(rand() % 2 ? 0 : 64);
+    if (in == NULL) return 1;
+    const pp_doc* d = intern(in, document);
+    int result = intern(in, document) != d;
+    if (result) printf("interning a document twice gave different documents\n");
+    else _pp_pretty_measured(writer, settings, pp_interner_measure(in), d);
+    pp_interner_destroy(in);
+    return result;
+}
+
+static const pp_doc* arena_copy(pp_arena* a, const pp_doc* d) {
+    const pp_doc* docs[7];
+    switch (d->type) {
+        case PP_DOC_TEXT:
+            return pp_arena_text(a, DOCAS(d,text)->text, DOCAS(d,text)->length);
+        case PP_DOC_WORDS:
+            return pp_arena_words(a, DOCAS(d,words)->text);
+        case PP_DOC_NEST:
+            return pp_arena_nest(a, DOCAS(d,nest)->indent, arena_copy(a, DOCAS(d,nest)->nested));
+        case PP_DOC_APPEND:
+            docs[0] = arena_copy(a, DOCAS(d,append)->a);
+            return pp_arena_append(a, docs[0], arena_copy(a, DOCAS(d,append)->b));
+        case PP_DOC_GROUP:
+            return pp_arena_group(a, arena_copy(a, DOCAS(d,group)->grouped));
+        case PP_DOC_CONCAT:
+        case PP_DOC_FILL:
+            for (size_t i = 0; i < DOCAS(d,concat)->count; i++) docs[i] = arena_copy(a, DOCAS(d,concat)->docs[i]);
+            return d->type == PP_DOC_FILL ? pp_arena_fill(a, docs, DOCAS(d,concat)->count)
+                : pp_arena_concat(a, docs, DOCAS(d,concat)->count);
+        default:
+            return d;
+    }
+}
+
+static int render_arena(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    pp_arena* a = pp_arena_create(rand() % 2 ? 0 : 64);
+    if (a == NULL) return 1;
+    _pp_pretty(writer, settings, arena_copy(a, document));
+    pp_arena_destroy(a);
+    return 0;
+}
+
+// The lines of a layout, joined, must be what it writes.
+static int render_layout(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    pp_layout* l = pp_layout_create(settings, document);
+    if (l == NULL) return 1;
+    output written = { NULL, 0, 0 }, joined = { NULL, 0, 0 };
+    pp_writer w = { output_write, &written };
+    _pp_layout_write(&w, l);
+    for (size_t i = 0; i < pp_layout_lines(l); i++) {
+        size_t length;
+        const char* line = pp_layout_line(l, i, &length);
+        if (i > 0) output_write(&joined, "\n", 1);
+        output_write(&joined, line, length);
+    }
+    int result = !output_equal(&written, &joined);
+    if (result) printf("the lines of a layout differ from what it writes\n");
+    else writer->write(writer->data, written.text, written.length);
+    free(written.text);
+    free(joined.text);
+    pp_layout_free(l);
+    return result;
+}
+
+// Two renders with the same settings must write the same.
+static int render_multi(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    output second = { NULL, 0, 0 };
+    pp_writer w = { output_write, &second };
+    const pp_settings* each[2] = { settings, settings };
+    const pp_writer* writers[2] = { writer, &w };
+    int result = _pp_pretty_multi(each, writers, 2, document);
+    free(second.text);
+    return result;
+}
+
+static const struct {
+    const char* name;
+    renderer render;
+    // Whether it renders fills (which can't be streamed).
+    int fills;
+    // Whether it honours max_lines and max_bytes.
+    int limits;
+} renderers[] = {
+    { "pretty", render_pretty, 1, 1 },
+    { "stack", render_stack, 1, 1 },
+    { "buffered", render_buffered, 1, 1 },
+    { "parallel", render_parallel, 1, 1 },
+    { "measured", render_measured, 1, 1 },
+    { "measured_parallel", render_measured_parallel, 1, 1 },
+    { "measured_resolved", render_measured_resolved, 1, 1 },
+    { "into", render_into, 1, 1 },
+    { "stream", render_stream, 0, 1 },
+    { "serialized", render_serialized, 1, 1 },
+    { "compiled", render_compiled, 1, 1 },
+    { "interned", render_interned, 1, 1 },
+    { "arena", render_arena, 1, 1 },
+    { "layout", render_layout, 1, 0 },
+    { "multi", render_multi, 1, 1 }
+};
+
+static int iteration;
+
+static int fail(const char* name, const pp_settings* settings, const output* expected, const output* got) {
+    printf("%s: mismatch at iteration %d, width %zu, max_indent %zu, max_lines %zu, max_bytes %zu\n", name, iteration,
+            settings->width, settings->max_indent, settings->max_lines, settings->max_bytes);
+    output_print("expected", expected);
+    output_print("got", got);
+    return 0;
+}
+
+// Check that each renderer writes expected.
+static int check_renderers(const char* mode, const pp_settings* settings, const pp_doc* d, int fills,
+        const output* expected) {
+    for (size_t i = 0; i < sizeof(renderers) / sizeof(renderers[0]); i++) {
+        if ((fills && !renderers[i].fills) || (!renderers[i].limits && (settings->max_lines || settings->max_bytes)))
+            continue;
+        output got = { NULL, 0, 0 };
+        pp_writer w = { output_write, &got };
+        char name[64];
+        snprintf(name, sizeof(name), "%s (%s)", renderers[i].name, mode);
+        if (renderers[i].render(&w, settings, d) != 0) {
+            printf("%s: failed at iteration %d\n", name, iteration);
+            return 0;
+        }
+        int ok = output_equal(expected, &got) || fail(name, settings, expected, &got);
+        free(got.text);
+        if (!ok) return 0;
+    }
+    return 1;
+}
+
+// What the reference renderer writes, cut as max_lines and max_bytes say.
+// Returns whether it was cut.
+static int expect(output* o, const pp_settings* settings, const pp_doc* d) {
+    check_settings unlimited = *(const check_settings*)settings;
+    unlimited.settings.max_lines = unlimited.settings.max_bytes = 0;
+    unlimited.settings.resolve_extension = NULL;
+    unlimited.settings.evaluate_extension = evaluate_ext;
+    pp_writer w = { output_write, o };
+    reference_pretty(&w, &unlimited.settings, d);
+    size_t cut = o->length, lines = 0;
+    if (settings->max_lines != 0) {
+        for (size_t i = 0; i < o->length; i++) {
+            if (o->text[i] == '\n' && ++lines == settings->max_lines) {
+                cut = i;
+                break;
+            }
+        }
+    }
+    if (settings->max_bytes != 0 && settings->max_bytes < cut) cut = settings->max_bytes;
+    if (cut == o->length) return 0;
+    o->length = cut;
+    if (settings->elision != NULL) output_write(o, settings->elision, strlen(settings->elision));
+    return 1;
+}
+
+// Renders with different settings, some resolving extensions differently,
+// must each write what they would alone.
+static int check_multi(const check_settings* settings, const pp_doc* d) {
+    check_settings each[3];
+    const pp_settings* pointers[3];
+    output outputs[3];
+    pp_writer writers[3];
+    const pp_writer* writer_pointers[3];
+    size_t count = 1 + rand() % 3;
+    for (size_t i = 0; i < count; i++) {
+        each[i] = *settings;
+        if (i > 0) {
+            each[i].settings.width = rand() % 60 + 3;
+            each[i].settings.max_indent = rand() % each[i].settings.width;
+            each[i].level = rand() % 5;
+        }
+        if (rand() % 2) {
+            each[i].settings.evaluate_extension = NULL;
+            each[i].settings.resolve_extension = resolve_ext;
+        }
+        pointers[i] = &each[i].settings;
+        outputs[i].text = NULL;
+        outputs[i].length = outputs[i].capacity = 0;
+        writers[i].write = output_write;
+        writers[i].data = &outputs[i];
+        writer_pointers[i] = &writers[i];
+    }
+    int ok = _pp_pretty_multi(pointers, writer_pointers, count, d) == 0;
+    if (!ok) printf("multi: failed at iteration %d\n", iteration);
+    for (size_t i = 0; i < count; i++) {
+        output expected = { NULL, 0, 0 };
+        expect(&expected, &each[i].settings, d);
+        if (ok && !output_equal(&expected, &outputs[i]))
+            ok = fail("multi (several settings)", &each[i].settings, &expected, &outputs[i]);
+        free(expected.text);
+        free(outputs[i].text);
+    }
+    return ok;
+}
+
+// A document whose subtrees are shared, measured with its extensions
+// resolved, renders as it would otherwise.
+static int check_measured_shared(const pp_settings* settings, pp_doc* d) {
+    pp_doc* group = pp_group(pp_append(pp_line(), d));
+    pp_doc* shared = pp_append(d, group);
+    output expected = { NULL, 0, 0 };
+    expect(&expected, settings, shared);
+    int ok = 1;
+    if (!check_renderers("shared", settings, shared, 1, &expected)) ok = 0;
+    free(expected.text);
+    free((void*)DOCAS(group,group)->grouped);
+    free(group);
+    free(shared);
+    return ok;
+}
+
+static int contains(const pp_doc* d, const pp_doc* old) {
+    if (d == old) return 1;
+    if (is_parent(d)) for (size_t i = 0; i < child_count(d); i++) if (contains(child(d, i), old)) return 1;
+    return 0;
+}
+
+// Whether b is a with old replaced by replacement.
+static int replaced(const pp_doc* a, const pp_doc* b, const pp_doc* old, const pp_doc* replacement) {
+    if (a == old) return b == replacement;
+    if (a == b) return !contains(a, old);
+    if (a->type != b->type || !is_parent(a) || child_count(a) != child_count(b)) return 0;
+    if (a->type == PP_DOC_NEST && DOCAS(a,nest)->indent != DOCAS(b,nest)->indent) return 0;
+    for (size_t i = 0; i < child_count(a); i++) if (!replaced(child(a, i), child(b, i), old, replacement)) return 0;
+    return 1;
+}
+
+static const pp_doc* nodes[1 << 16];
+static size_t node_count;
+
+static void collect(const pp_doc* d) {
+    if (node_count < sizeof(nodes) / sizeof(nodes[0])) nodes[node_count++] = d;
+    if (is_parent(d)) for (size_t i = 0; i < child_count(d); i++) collect(child(d, i));
+}
+
+static int check_layout(const pp_layout* l, const pp_settings* settings) {
+    output expected = { NULL, 0, 0 }, got = { NULL, 0, 0 };
+    pp_writer w = { output_write, &got };
+    expect(&expected, settings, pp_layout_document(l));
+    _pp_layout_write(&w, l);
+    int ok = output_equal(&expected, &got) || fail("layout (replaced)", settings, &expected, &got);
+    free(expected.text);
+    free(got.text);
+    return ok;
+}
+
+// Replacing parts of a layout's document re-renders it as a whole.
+static int check_layout_replace(generated* g, const pp_settings* settings) {
+    const pp_doc* parts[9];
+    pp_doc* sections[5];
+    pp_doc* replacements[4];
+    size_t section_count = 1 + rand() % 5, replacement_count = 0;
+    for (size_t i = 0; i < section_count; i++) {
+        sections[i] = generate(g, rand() % 6);
+        parts[2 * i] = sections[i];
+        if (i > 0) parts[2 * i - 1] = pp_line();
+    }
+    pp_doc* d = pp_concat(parts, 2 * section_count - 1);
+    pp_layout* l = pp_layout_create(settings, d);
+    int ok = l != NULL && check_layout(l, settings);
+    for (int i = 0; i < 4 && ok; i++) {
+        const pp_doc* before = pp_layout_document(l);
+        node_count = 0;
+        collect(before);
+        const pp_doc* old = nodes[rand() % node_count];
+        const pp_doc* replacement;
+        switch (rand() % 6) {
+            case 0:
+                replacement = pp_line();
+                break;
+            case 1:
+                replacement = replacements[replacement_count++] = pp_concat(NULL, 0);
+                break;
+            case 2:
+                replacement = nodes[rand() % node_count];
+                break;
+            default:
+                replacement = replacements[replacement_count++] = generate(g, rand() % 4);
+                break;
+        }
+        int result = pp_layout_replace(l, old, replacement);
+        const pp_doc* after = pp_layout_document(l);
+        if (result < 0 || (result == 0) != (after == before)
+                || (old != replacement && !replaced(before, after, old, replacement))) {
+            printf("layout: replacing gave %d at iteration %d\n", result, iteration);
+            ok = 0;
+        }
+        else ok = check_layout(l, settings);
+    }
+    if (l != NULL) pp_layout_free(l);
+    for (size_t i = 0; i < section_count; i++) pp_free_ext(free_ext, sections[i]);
+    for (size_t i = 0; i < replacement_count; i++) pp_free_ext(free_ext, replacements[i]);
+    free(d);
+    return ok;
+}
+
+static int check(generated* g, pp_doc* d) {
+    check_settings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.settings.width = rand() % 40 + 3;
+    settings.settings.max_indent = rand() % settings.settings.width;
+    settings.settings.evaluate_extension = evaluate_ext;
+    settings.level = rand() % 5;
+    output expected = { NULL, 0, 0 };
+    expect(&expected, &settings.settings, d);
+    int ok = check_renderers("evaluated", &settings.settings, d, g->fills, &expected);
+
+    // Limited output, cut at any point of it.
+    check_settings limited = settings;
+    limited.settings.max_lines = rand() % 3 ? rand() % 6 : 0;
+    limited.settings.max_bytes = rand() % 3 ? rand() % (expected.length + 2) : 0;
+    limited.settings.elision = rand() % 2 ? "<...>" : NULL;
+    output cut = { NULL, 0, 0 };
+    expect(&cut, &limited.settings, d);
+    ok = ok && check_renderers("limited", &limited.settings, d, g->fills, &cut);
+    free(cut.text);
+
+    check_settings resolving = settings;
+    resolving.settings.evaluate_extension = NULL;
+    resolving.settings.resolve_extension = resolve_ext;
+    ok = ok && check_renderers("resolved", &resolving.settings, d, g->fills, &expected);
+    output scratch = { NULL, 0, 0 };
+    pp_writer w = { output_write, &scratch };
+    resolved_count = 0;
+    _pp_pretty(&w, &resolving.settings, d);
+    free(scratch.text);
+    free(expected.text);
+    if (ok && resolved_twice()) {
+        printf("an extension was resolved twice in one render at iteration %d\n", iteration);
+        ok = 0;
+    }
+
+    ok = ok && check_multi(&settings, d) && check_measured_shared(&resolving.settings, d)
+        && check_layout_replace(g, &settings.settings);
+    if (ok && forced != released) {
+        printf("%d lazy documents were produced but %d released at iteration %d\n", forced, released, iteration);
+        ok = 0;
+    }
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 3000;
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+    for (iteration = 0; iteration < iterations; iteration++) {
+        generated g;
+        g.count = 0;
+        g.fills = 0;
+        pp_doc* d = generate(&g, rand() % 8 + 1);
+        int ok = check(&g, d);
+        generated_free(&g, d);
+        if (!ok) return 1;
+    }
+    printf("%d documents rendered alike by every renderer\n", iterations);
+    return 0;
+}
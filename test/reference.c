@@ -0,0 +1,222 @@
+#include <stddef.h>
+#include <stdio.h>
+
+#include "prettyprint.h"
+
+/*
+ * The reference renderer the others are checked against. This is the
+ * recursive renderer the library started with, extended to the document
+ * types added since: it has no explicit stack, measurements, memoization or
+ * output limits, and evaluates extensions (with evaluate_extension alone) and
+ * lazy documents wherever it meets them, so it is slow but easy to check by
+ * reading.
+ */
+
+#define DOCAS(d,n) ((const pp_doc_##n*)(d))
+
+static const pp_doc ref_line = { PP_DOC_LINE };
+static const pp_doc ref_sep = { PP_DOC_SEP };
+
+// Evaluate extensions and lazy documents, returning the resulting type and
+// updating *d. Extensions that cannot be evaluated are nil.
+static pp_doc_type_t evaluate(const pp_settings* settings, const pp_doc** d) {
+    pp_doc_type_t tp = (*d)->type;
+    while (tp >= PP_DOC_EXTENSION_START || tp == PP_DOC_LAZY) {
+        if (tp == PP_DOC_LAZY) {
+            *d = DOCAS(*d,lazy)->force(DOCAS(*d,lazy)->data, NULL);
+            tp = (*d)->type;
+        }
+        else if (settings->evaluate_extension != NULL) tp = settings->evaluate_extension(settings, tp, (pp_doc**)d);
+        else return PP_DOC_NIL;
+    }
+    return tp;
+}
+
+// Split words at spaces and newlines into texts, seps and lines, calling f on
+// each.
+static int each_word(const pp_doc* d, int (*f)(void* data, const pp_doc* d), void* data) {
+    const pp_doc_words* w = DOCAS(d,words);
+    size_t start = 0;
+    for (size_t i = 0;; i++) {
+        if (i < w->length && w->text[i] != ' ' && w->text[i] != '\n') continue;
+        if (i < w->length || i != start) {
+            pp_doc_text t = { PP_DOC_TEXT, w->text + start, i - start };
+            if (!f(data, (const pp_doc*)&t)) return 0;
+        }
+        if (i == w->length) return 1;
+        if (!f(data, w->text[i] == '\n' ? &ref_line : &ref_sep)) return 0;
+        start = i + 1;
+    }
+}
+
+typedef struct {
+    const pp_settings* settings;
+    size_t* remaining;
+} flatten_args;
+
+static int can_flatten(const pp_settings* settings, const pp_doc* d, size_t* remaining);
+
+static int can_flatten_word(void* data, const pp_doc* d) {
+    flatten_args* args = (flatten_args*)data;
+    return can_flatten(args->settings, d, args->remaining);
+}
+
+static int can_flatten(const pp_settings* settings, const pp_doc* d, size_t* remaining) {
+    switch (evaluate(settings, &d)) {
+        case PP_DOC_NIL:
+            return 1;
+        case PP_DOC_SEP:
+            if (*remaining > 0) *remaining -= 1;
+            return 1;
+        case PP_DOC_TEXT:
+            if (*remaining < DOCAS(d,text)->length) return 0;
+            *remaining -= DOCAS(d,text)->length;
+            return 1;
+        case PP_DOC_LINE:
+            if (*remaining < 1) return 0;
+            *remaining -= 1;
+            return 1;
+        case PP_DOC_NEST:
+            return can_flatten(settings, DOCAS(d,nest)->nested, remaining);
+        case PP_DOC_APPEND:
+            if (!can_flatten(settings, DOCAS(d,append)->a, remaining)) return 0;
+            return can_flatten(settings, DOCAS(d,append)->b, remaining);
+        case PP_DOC_GROUP:
+            return can_flatten(settings, DOCAS(d,group)->grouped, remaining);
+        case PP_DOC_WORDS:
+            {
+                flatten_args args = { settings, remaining };
+                return each_word(d, can_flatten_word, &args);
+            }
+        case PP_DOC_FILL:
+            for (size_t i = 0; i < DOCAS(d,concat)->count; i++) {
+                if (i > 0 && !can_flatten(settings, &ref_line, remaining)) return 0;
+                if (!can_flatten(settings, DOCAS(d,concat)->docs[i], remaining)) return 0;
+            }
+            return 1;
+        case PP_DOC_CONCAT:
+            for (size_t i = 0; i < DOCAS(d,concat)->count; i++)
+                if (!can_flatten(settings, DOCAS(d,concat)->docs[i], remaining)) return 0;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+typedef struct {
+    const pp_writer* writer;
+    const pp_settings* settings;
+    size_t* remaining;
+    size_t indent;
+    int group;
+} pretty_args;
+
+static void pretty(const pp_writer* writer, const pp_settings* settings, const pp_doc* d, size_t* remaining,
+        size_t indent, int group);
+
+static int pretty_word(void* data, const pp_doc* d) {
+    pretty_args* args = (pretty_args*)data;
+    pretty(args->writer, args->settings, d, args->remaining, args->indent, args->group);
+    return 1;
+}
+
+static void pretty(const pp_writer* writer, const pp_settings* settings, const pp_doc* d, size_t* remaining,
+        size_t indent, int group) {
+#define do_write(c,l) writer->write(writer->data,c,l)
+    switch (evaluate(settings, &d)) {
+        case PP_DOC_NIL:
+            break;
+        case PP_DOC_SEP:
+            if (settings->width - indent != *remaining && *remaining != 0) {
+                do_write(" ", 1);
+                *remaining -= 1;
+            }
+            break;
+        case PP_DOC_TEXT:
+            {
+                if (DOCAS(d,text)->length > *remaining) {
+                    pretty(writer, settings, &ref_line, remaining, indent, group);
+                }
+                const pp_doc_text* t = DOCAS(d,text);
+                size_t len = t->length;
+                while (len > *remaining) {
+                    do_write(t->text + (t->length - len), *remaining);
+                    len -= *remaining;
+                    *remaining = 0;
+                    pretty(writer, settings, &ref_line, remaining, indent, group);
+                }
+                do_write(t->text + (t->length - len), len);
+                *remaining -= len;
+            }
+            break;
+        case PP_DOC_LINE:
+            if (group) {
+                do_write(" ", 1);
+                *remaining -= 1;
+            }
+            else {
+                do_write("\n", 1);
+                for (size_t i = 0; i < indent; i++) do_write(" ", 1);
+                *remaining = settings->width - indent;
+            }
+            break;
+        case PP_DOC_NEST:
+            {
+                const pp_doc_nest* n = DOCAS(d,nest);
+                size_t newindent = indent + n->indent;
+                if (newindent > settings->max_indent) newindent = settings->max_indent;
+                pretty(writer, settings, n->nested, remaining, newindent, group);
+            }
+            break;
+        case PP_DOC_APPEND:
+            pretty(writer, settings, DOCAS(d,append)->a, remaining, indent, group);
+            pretty(writer, settings, DOCAS(d,append)->b, remaining, indent, group);
+            break;
+        case PP_DOC_WORDS:
+            {
+                pretty_args args = { writer, settings, remaining, indent, group };
+                each_word(d, pretty_word, &args);
+            }
+            break;
+        case PP_DOC_FILL:
+            // Each document is laid out as a group, and the line before it
+            // (other than the first) is a space if the document fits after it.
+            for (size_t i = 0; i < DOCAS(d,concat)->count; i++) {
+                const pp_doc* item = DOCAS(d,concat)->docs[i];
+                int fits = group;
+                if (i > 0) {
+                    size_t r = *remaining;
+                    if (!group && r > 0) {
+                        r -= 1;
+                        fits = can_flatten(settings, item, &r);
+                    }
+                    pretty(writer, settings, &ref_line, remaining, indent, fits);
+                }
+                if (!fits) {
+                    size_t r = *remaining;
+                    fits = can_flatten(settings, item, &r);
+                }
+                pretty(writer, settings, item, remaining, indent, fits);
+            }
+            break;
+        case PP_DOC_CONCAT:
+            for (size_t i = 0; i < DOCAS(d,concat)->count; i++)
+                pretty(writer, settings, DOCAS(d,concat)->docs[i], remaining, indent, group);
+            break;
+        case PP_DOC_GROUP:
+            {
+                size_t r = *remaining;
+                const pp_doc* grouped = DOCAS(d,group)->grouped;
+                pretty(writer, settings, grouped, remaining, indent, can_flatten(settings, grouped, &r));
+            }
+            break;
+        default:
+            break;
+    }
+#undef do_write
+}
+
+void reference_pretty(const pp_writer* writer, const pp_settings* settings, const pp_doc* document) {
+    size_t remaining = settings->width;
+    pretty(writer, settings, document, &remaining, 0, 0);
+}